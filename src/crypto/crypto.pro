@@ -14,10 +14,29 @@ maemo {
     PKGCONFIG += mssf-crypto
  }
 
+metrics {
+    message("Collecting storage metrics")
+    DEFINES += MSSFQT_METRICS
+}
+
 SOURCES += \
     mssfcrypto.cpp \
     mssfstorage.cpp \
-    protectedfile.cpp
+    protectedfile.cpp \
+    storagecache.cpp \
+    storagequeue.cpp \
+    storagewatcher.cpp \
+    storagemetrics.cpp \
+    protectedkeyvaluestore.cpp \
+    protectedlog.cpp \
+    protectedfiledevice.cpp \
+    hashtree.cpp \
+    verifiedfile.cpp \
+    readahead.cpp \
+    maskmatcher.cpp \
+    digestindex.cpp \
+    keyvaluerecord.cpp \
+    logblock.cpp
 
 PUBLIC_HEADERS += \
     mssfcrypto.h \
@@ -25,11 +44,37 @@ PUBLIC_HEADERS += \
     mssfstorage.h \
     MssfStorage \
     protectedfile.h \
-    ProtectedFile
+    ProtectedFile \
+    storagewatcher.h \
+    StorageWatcher \
+    storagemetrics.h \
+    StorageMetrics \
+    protectedkeyvaluestore.h \
+    ProtectedKeyValueStore \
+    protectedlog.h \
+    ProtectedLog \
+    protectedfiledevice.h \
+    ProtectedFileDevice \
+    verifiedfile.h \
+    VerifiedFile
 
 PRIVATE_HEADERS += \
     mssfstorage_p.h \
-    protectedfile_p.h
+    protectedfile_p.h \
+    storagecache_p.h \
+    storagequeue_p.h \
+    storagewatcher_p.h \
+    storagemetrics_p.h \
+    protectedkeyvaluestore_p.h \
+    protectedlog_p.h \
+    protectedfiledevice_p.h \
+    hashtree_p.h \
+    verifiedfile_p.h \
+    readahead_p.h \
+    maskmatcher_p.h \
+    digestindex_p.h \
+    keyvaluerecord_p.h \
+    logblock_p.h
 
 HEADERS += \
     $$PUBLIC_HEADERS \
@@ -0,0 +1,73 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "digestindex_p.h"
+
+using namespace MssfQt::Internal;
+
+void DigestIndex::insert(const QByteArray &member, const QByteArray &digest)
+{
+    remove(member);
+    digestMembers.insert(digest, member);
+    memberDigests.insert(member, digest);
+}
+
+QByteArray DigestIndex::member(const QByteArray &digest) const
+{
+    return digestMembers.value(digest);
+}
+
+QByteArray DigestIndex::digest(const QByteArray &member) const
+{
+    return memberDigests.value(member);
+}
+
+QByteArray DigestIndex::remove(const QByteArray &member)
+{
+    QByteArray digest = memberDigests.take(member);
+    // a later copy that could not be linked may have taken over the digest
+    if (!digest.isEmpty() && digestMembers.value(digest) == member)
+        digestMembers.remove(digest);
+    return digest;
+}
+
+void DigestIndex::rename(const QByteArray &from, const QByteArray &to)
+{
+    bool holder = (digestMembers.value(memberDigests.value(from)) == from);
+    QByteArray digest = remove(from);
+    remove(to);
+    if (digest.isEmpty())
+        return;
+
+    memberDigests.insert(to, digest);
+    if (holder || !digestMembers.contains(digest))
+        digestMembers.insert(digest, to);
+}
+
+void DigestIndex::clear()
+{
+    digestMembers.clear();
+    memberDigests.clear();
+}
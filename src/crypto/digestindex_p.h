@@ -0,0 +1,77 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef DIGESTINDEX_P_H
+#define DIGESTINDEX_P_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+
+namespace MssfQt
+{
+
+namespace Internal
+{
+
+/*!
+  * \class DigestIndex
+  * \brief Which member holds which contents, for the deduplication of a store.
+  *
+  * Every member written through the store is recorded with the SHA1 of its contents. Several
+  * members may have the same digest if they could not be linked, the one written last is the
+  * one new duplicates are linked to. The index is not locked, the store does that.
+  */
+class DigestIndex
+{
+public:
+
+    //! Record the contents of member, replacing what it held before.
+    void insert(const QByteArray &member, const QByteArray &digest);
+
+    //! The member new copies of the contents are linked to, empty if none.
+    QByteArray member(const QByteArray &digest) const;
+
+    //! The digest recorded for member, empty if none.
+    QByteArray digest(const QByteArray &member) const;
+
+    //! Forget member. \returns The digest it had, empty if none.
+    QByteArray remove(const QByteArray &member);
+
+    //! The contents of from now are held by to.
+    void rename(const QByteArray &from, const QByteArray &to);
+
+    void clear();
+
+private:
+    //! SHA1 of the contents to the member holding them, and back.
+    QHash<QByteArray, QByteArray> digestMembers;
+    QHash<QByteArray, QByteArray> memberDigests;
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+#endif // DIGESTINDEX_P_H
@@ -0,0 +1,346 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "hashtree_p.h"
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QFile>
+#include <QtCore/QtAlgorithms>
+#include <QtCore/QtEndian>
+
+#include <string.h>
+
+using namespace MssfQt;
+using namespace MssfQt::Internal;
+
+//! "MQHT", the first word of a root file.
+static const quint32 RootMagic = 0x4d514854;
+
+static const char LeafPrefix = 0x00;
+static const char NodePrefix = 0x01;
+
+QString HashTree::treeName(const QString &pathname)
+{
+    return pathname + QLatin1String(".merkle");
+}
+
+QString HashTree::rootName(const QString &pathname)
+{
+    return pathname + QLatin1String(".merkle-root");
+}
+
+QByteArray HashTree::leafHash(const char *data, int length)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(&LeafPrefix, 1);
+    hash.addData(data, length);
+    return hash.result();
+}
+
+QByteArray HashTree::nodeHash(const QByteArray &left, const QByteArray &right)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(&NodePrefix, 1);
+    hash.addData(left);
+    hash.addData(right);
+    return hash.result();
+}
+
+QVector<quint64> HashTree::levelCounts(quint64 size, quint32 blockSize)
+{
+    QVector<quint64> counts;
+    quint64 count = (size + blockSize - 1) / blockSize;
+    if (count == 0)
+        count = 1;
+
+    counts.append(count);
+    while (count > 1)
+    {
+        count = (count + 1) / 2;
+        counts.append(count);
+    }
+    return counts;
+}
+
+QByteArray HashTree::encodeHeader(quint32 blockSize, quint64 size, const QByteArray &root)
+{
+    QByteArray header(HeaderSize - DigestSize, 0);
+    uchar *p = reinterpret_cast<uchar *>(header.data());
+    qToBigEndian<quint32>(RootMagic, p);
+    qToBigEndian<quint32>(blockSize, p + 4);
+    qToBigEndian<quint64>(size, p + 8);
+    header.append(root);
+    return header;
+}
+
+bool HashTree::decodeHeader(const QByteArray &header, quint32 *blockSize, quint64 *size, QByteArray *root)
+{
+    if (header.size() != HeaderSize)
+        return false;
+
+    const uchar *p = reinterpret_cast<const uchar *>(header.constData());
+    if (qFromBigEndian<quint32>(p) != RootMagic)
+        return false;
+
+    *blockSize = qFromBigEndian<quint32>(p + 4);
+    *size = qFromBigEndian<quint64>(p + 8);
+    *root = header.mid(HeaderSize - DigestSize);
+    return (*blockSize > 0);
+}
+
+static bool writeWhole(const QString &pathname, const QByteArray &data)
+{
+    QFile file(pathname);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(data) != data.size())
+        return false;
+    file.close();
+    return true;
+}
+
+bool HashTree::writeFiles(const QString &pathname, quint32 blockSize, quint64 size, const QByteArray &tree,
+                          const QByteArray &root)
+{
+    return (writeWhole(treeName(pathname), tree)
+            && writeWhole(rootName(pathname), encodeHeader(blockSize, size, root)));
+}
+
+HashTreeBuilder::HashTreeBuilder(quint32 blockSize)
+    : blockSize(blockSize),
+      total(0)
+{
+}
+
+void HashTreeBuilder::addData(const char *data, qint64 length)
+{
+    total += length;
+
+    // top up a block left over from the previous call first
+    if (!pending.isEmpty())
+    {
+        qint64 take = qMin<qint64>(length, blockSize - pending.size());
+        pending.append(data, take);
+        data += take;
+        length -= take;
+        if ((quint32)pending.size() < blockSize)
+            return;
+        leaves.append(HashTree::leafHash(pending.constData(), pending.size()));
+        pending.clear();
+    }
+
+    while (length >= blockSize)
+    {
+        leaves.append(HashTree::leafHash(data, blockSize));
+        data += blockSize;
+        length -= blockSize;
+    }
+
+    if (length > 0)
+        pending = QByteArray(data, length);
+}
+
+quint64 HashTreeBuilder::size() const
+{
+    return total;
+}
+
+QByteArray HashTreeBuilder::finish(QByteArray *root)
+{
+    if (!pending.isEmpty() || leaves.isEmpty())
+        leaves.append(HashTree::leafHash(pending.constData(), pending.size()));
+    pending.clear();
+
+    MutableHashTree tree(blockSize, total, leaves);
+    *root = tree.root();
+    return tree.tree();
+}
+
+MutableHashTree::MutableHashTree(quint32 blockSize, quint64 size, const QByteArray &leaves)
+    : bytesPerBlock(blockSize),
+      total(size),
+      resized(false)
+{
+    levels.append(leaves);
+    rebuild();
+}
+
+MutableHashTree *MutableHashTree::load(const QByteArray &header, const QString &pathname, quint64 size)
+{
+    quint32 blockSize;
+    quint64 storedSize;
+    QByteArray root;
+    if (!HashTree::decodeHeader(header, &blockSize, &storedSize, &root) || storedSize != size)
+        return NULL;
+
+    QFile treeFile(HashTree::treeName(pathname));
+    if (!treeFile.open(QIODevice::ReadOnly))
+        return NULL;
+
+    // only the leaves are taken, the rest is rebuilt from them and must arrive at the signed root
+    qint64 length = HashTree::levelCounts(size, blockSize).first() * HashTree::DigestSize;
+    QByteArray leaves = treeFile.read(length);
+    if (leaves.size() != length)
+        return NULL;
+
+    MutableHashTree *tree = new MutableHashTree(blockSize, size, leaves);
+    if (tree->root() != root)
+    {
+        delete tree;
+        return NULL;
+    }
+    return tree;
+}
+
+quint32 MutableHashTree::blockSize() const
+{
+    return bytesPerBlock;
+}
+
+quint64 MutableHashTree::size() const
+{
+    return total;
+}
+
+bool MutableHashTree::isDirty() const
+{
+    return (resized || !dirty.isEmpty());
+}
+
+void MutableHashTree::touch(quint64 at, quint64 length, quint64 size)
+{
+    if (size != total)
+    {
+        quint64 before = HashTree::levelCounts(total, bytesPerBlock).first();
+        quint64 after = HashTree::levelCounts(size, bytesPerBlock).first();
+
+        // the old last block changes length, as do all the blocks up to the new end
+        quint64 first = qMin(before, after) - 1;
+        for (quint64 block = first; block < after; block++)
+            dirty.insert(block);
+
+        QSet<quint64>::iterator it = dirty.begin();
+        while (it != dirty.end())
+        {
+            if (*it >= after)
+                it = dirty.erase(it);
+            else
+                ++it;
+        }
+
+        levels[0].resize(after * HashTree::DigestSize);
+        total = size;
+        resized = true;
+    }
+
+    if (length == 0 || at >= total)
+        return;
+
+    quint64 last = (qMin(at + length, total) - 1) / bytesPerBlock;
+    for (quint64 block = at / bytesPerBlock; block <= last; block++)
+        dirty.insert(block);
+}
+
+bool MutableHashTree::update(BlockReader reader, void *context)
+{
+    QList<quint64> blocks = dirty.toList();
+    qSort(blocks);
+
+    QByteArray data;
+    for (int i = 0; i < blocks.count(); i++)
+    {
+        quint64 start = blocks.at(i) * bytesPerBlock;
+        quintptr length = qMin<quint64>(bytesPerBlock, total - start);
+        data.resize(length);
+        if (reader(start, data.data(), length, context) != (qint64)length)
+            return false;
+
+        QByteArray hash = HashTree::leafHash(data.constData(), length);
+        memcpy(levels[0].data() + blocks.at(i) * HashTree::DigestSize, hash.constData(), HashTree::DigestSize);
+    }
+
+    if (resized)
+    {
+        rebuild();
+    }
+    else
+    {
+        // walk up from the changed leaves, every parent is hashed once per level
+        QList<quint64> changed = blocks;
+        for (int level = 1; level < levels.count(); level++)
+        {
+            QList<quint64> parents;
+            const QByteArray &below = levels.at(level - 1);
+            for (int i = 0; i < changed.count(); i++)
+            {
+                quint64 parent = changed.at(i) / 2;
+                if (!parents.isEmpty() && parents.last() == parent)
+                    continue;
+                parents.append(parent);
+
+                int at = (int)(parent * 2 * HashTree::DigestSize);
+                QByteArray left = below.mid(at, HashTree::DigestSize);
+                QByteArray right = below.mid(at + HashTree::DigestSize, HashTree::DigestSize);
+                QByteArray hash = HashTree::nodeHash(left, right);
+                memcpy(levels[level].data() + parent * HashTree::DigestSize, hash.constData(), HashTree::DigestSize);
+            }
+            changed = parents;
+        }
+    }
+
+    dirty.clear();
+    resized = false;
+    return true;
+}
+
+QByteArray MutableHashTree::root() const
+{
+    return levels.last();
+}
+
+QByteArray MutableHashTree::leaf(quint64 block) const
+{
+    return levels.first().mid((int)(block * HashTree::DigestSize), HashTree::DigestSize);
+}
+
+QByteArray MutableHashTree::tree() const
+{
+    QByteArray all;
+    for (int level = 0; level < levels.count(); level++)
+        all.append(levels.at(level));
+    return all;
+}
+
+void MutableHashTree::rebuild()
+{
+    levels.resize(1);
+    while (levels.last().size() > HashTree::DigestSize)
+    {
+        const QByteArray below = levels.last();
+        QByteArray parents;
+        for (int at = 0; at < below.size(); at += 2 * HashTree::DigestSize)
+            parents.append(HashTree::nodeHash(below.mid(at, HashTree::DigestSize),
+                                              below.mid(at + HashTree::DigestSize, HashTree::DigestSize)));
+        levels.append(parents);
+    }
+}
@@ -0,0 +1,185 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef HASHTREE_P_H
+#define HASHTREE_P_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QSet>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+namespace MssfQt
+{
+
+namespace Internal
+{
+
+/*!
+  * \class HashTree
+  * \brief The layout of the block hash tree of a signed member.
+  *
+  * The member is split into blocks of a fixed size, the last one may be shorter. A leaf is the
+  * SHA1 of 0x00 followed by the block, a node the SHA1 of 0x01 followed by its children, a node
+  * without a right child hashes its left child only. An empty member has a single empty block.
+  *
+  * The tree file holds all levels from the leaves up to the root, each as an array of digests.
+  * The root file holds a header and the root digest; it is the only part added to the store, the
+  * tree file is verified against it.
+  */
+class HashTree
+{
+public:
+
+    enum {
+        DigestSize = 20,
+        //! Magic, block size, member size and the root digest.
+        HeaderSize = 4 + 4 + 8 + DigestSize,
+        DefaultBlockSize = 4096
+    };
+
+    //! The file holding all levels of the tree of pathname.
+    static QString treeName(const QString &pathname);
+
+    //! The member holding the root of the tree of pathname.
+    static QString rootName(const QString &pathname);
+
+    static QByteArray leafHash(const char *data, int length);
+
+    //! \param right Empty if left has no sibling.
+    static QByteArray nodeHash(const QByteArray &left, const QByteArray &right);
+
+    //! The number of nodes on each level, from the leaves to the root.
+    static QVector<quint64> levelCounts(quint64 size, quint32 blockSize);
+
+    static QByteArray encodeHeader(quint32 blockSize, quint64 size, const QByteArray &root);
+
+    //! \returns false if header is not a valid root file.
+    static bool decodeHeader(const QByteArray &header, quint32 *blockSize, quint64 *size, QByteArray *root);
+
+    //! Write the tree file and the root file of pathname, the root still has to be added to the store.
+    static bool writeFiles(const QString &pathname, quint32 blockSize, quint64 size, const QByteArray &tree,
+                           const QByteArray &root);
+};
+
+/*!
+  * \class HashTreeBuilder
+  * \brief Hashes a stream of data into a \ref HashTree.
+  */
+class HashTreeBuilder
+{
+public:
+
+    HashTreeBuilder(quint32 blockSize);
+
+    void addData(const char *data, qint64 length);
+
+    //! The bytes seen so far.
+    quint64 size() const;
+
+    /*!
+      * \brief Hash the last partial block and build the upper levels.
+      * \param root (out) The root digest.
+      * \returns The contents of the tree file.
+      */
+    QByteArray finish(QByteArray *root);
+
+private:
+    quint32 blockSize;
+    quint64 total;
+    QByteArray pending;
+    QByteArray leaves;
+};
+
+/*!
+  * \class MutableHashTree
+  * \brief A \ref HashTree kept in memory and updated as the member changes.
+  *
+  * Changes only mark the blocks they touch, \ref update rehashes those blocks and the nodes
+  * above them. If the number of blocks changed the upper levels are rebuilt from the leaves,
+  * which hashes digests only, not data.
+  */
+class MutableHashTree
+{
+public:
+
+    //! Reads a block for rehashing. \returns The bytes read, -1 on error.
+    typedef qint64 (*BlockReader)(quint64 at, char *buf, quintptr len, void *context);
+
+    /*!
+      * \brief Constructor
+      * \param blockSize The size of the blocks.
+      * \param size The size of the member.
+      * \param leaves The leaf level, one digest per block of size.
+      */
+    MutableHashTree(quint32 blockSize, quint64 size, const QByteArray &leaves);
+
+    /*!
+      * \brief Read the stored tree of a member
+      * \param header The contents of the root file, as verified by the store.
+      * \param pathname The name of the member.
+      * \param size The size the member has now.
+      * \returns The tree, verified against the root, or NULL if there is no matching one.
+      */
+    static MutableHashTree *load(const QByteArray &header, const QString &pathname, quint64 size);
+
+    quint32 blockSize() const;
+
+    quint64 size() const;
+
+    //! Has anything changed since the last \ref update.
+    bool isDirty() const;
+
+    //! Mark the range as written, the member is size bytes long afterwards.
+    void touch(quint64 at, quint64 length, quint64 size);
+
+    //! Rehash the changed blocks. \returns false if a block could not be read.
+    bool update(BlockReader reader, void *context);
+
+    //! The root as of the last \ref update.
+    QByteArray root() const;
+
+    //! The digest of a block as of the last \ref update.
+    QByteArray leaf(quint64 block) const;
+
+    //! The contents of the tree file as of the last \ref update.
+    QByteArray tree() const;
+
+private:
+    void rebuild();
+
+    quint32 bytesPerBlock;
+    quint64 total;
+    //! The levels from the leaves up, each an array of digests.
+    QVector<QByteArray> levels;
+    QSet<quint64> dirty;
+    bool resized;
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+#endif // HASHTREE_P_H
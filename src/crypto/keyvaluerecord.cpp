@@ -0,0 +1,59 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "keyvaluerecord_p.h"
+
+#include <QtCore/QtEndian>
+
+using namespace MssfQt::Internal;
+
+quint32 KeyValueRecord::decode(const QByteArray &data, quint32 at, quint32 *keyLength, quint32 *valueLength,
+                               quint8 *flags)
+{
+    if ((quint64)at + HeaderSize > (quint64)data.size())
+        return 0;
+
+    const uchar *header = reinterpret_cast<const uchar *>(data.constData()) + at;
+    *keyLength = qFromBigEndian<quint32>(header);
+    *valueLength = qFromBigEndian<quint32>(header + 4);
+    *flags = header[8];
+
+    quint64 size = (quint64)HeaderSize + *keyLength + *valueLength;
+    if (at + size > (quint64)data.size())
+        return 0;
+    return size;
+}
+
+void KeyValueRecord::append(QByteArray &to, const QByteArray &key, const QByteArray &value, quint8 flags)
+{
+    uchar header[HeaderSize];
+    qToBigEndian<quint32>(key.size(), header);
+    qToBigEndian<quint32>(value.size(), header + 4);
+    header[8] = flags;
+
+    to.append(reinterpret_cast<const char *>(header), HeaderSize);
+    to.append(key);
+    to.append(value);
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef KEYVALUERECORD_P_H
+#define KEYVALUERECORD_P_H
+
+#include <QtCore/QByteArray>
+
+namespace MssfQt
+{
+
+namespace Internal
+{
+
+/*!
+  * \class KeyValueRecord
+  * \brief The encoding of the records in the segments of a \ref ProtectedKeyValueStore.
+  *
+  * A record is a header of [quint32 key length][quint32 value length][quint8 flags], big endian,
+  * followed by the key and the value.
+  */
+class KeyValueRecord
+{
+public:
+
+    enum {
+        HeaderSize = 9,
+        //! The record removes its key.
+        Tombstone = 0x01
+    };
+
+    /*!
+      * \brief Decode the record header at an offset.
+      * \returns The size of the whole record, 0 if there is no complete record at the offset.
+      */
+    static quint32 decode(const QByteArray &data, quint32 at, quint32 *keyLength, quint32 *valueLength,
+                          quint8 *flags);
+
+    //! Encode a record at the end of to.
+    static void append(QByteArray &to, const QByteArray &key, const QByteArray &value, quint8 flags);
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+#endif // KEYVALUERECORD_P_H
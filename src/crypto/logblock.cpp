@@ -0,0 +1,114 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "logblock_p.h"
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QtEndian>
+
+using namespace MssfQt::Internal;
+
+static const quint32 BlockMagic = 0x4d514c42;       // "MQLB"
+
+//! The chain digest of a block, computed over the header and the body.
+static QByteArray chainDigest(const QByteArray &previous, const char *block, int length)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(previous);
+    hash.addData(block, length);
+    return hash.result();
+}
+
+void LogBlock::appendRecord(QByteArray &body, const QByteArray &record)
+{
+    uchar length[4];
+    qToBigEndian<quint32>(record.size(), length);
+    body.append(reinterpret_cast<const char *>(length), sizeof(length));
+    body.append(record);
+}
+
+QByteArray LogBlock::encode(const QByteArray &body, quint32 count, const QByteArray &previous)
+{
+    uchar header[HeaderSize];
+    qToBigEndian<quint32>(BlockMagic, header);
+    qToBigEndian<quint32>(count, header + 4);
+    qToBigEndian<quint32>(body.size(), header + 8);
+
+    QByteArray block(reinterpret_cast<const char *>(header), HeaderSize);
+    block.append(body);
+    block.append(chainDigest(previous, block.constData(), block.size()));
+    return block;
+}
+
+quint32 LogBlock::size(const QByteArray &header, quint32 *count)
+{
+    if (header.size() < HeaderSize)
+        return 0;
+
+    const uchar *bytes = reinterpret_cast<const uchar *>(header.constData());
+    if (qFromBigEndian<quint32>(bytes) != BlockMagic)
+        return 0;
+
+    *count = qFromBigEndian<quint32>(bytes + 4);
+    quint32 body = qFromBigEndian<quint32>(bytes + 8);
+    if (body > 0x7fffffff - HeaderSize - DigestSize)
+        return 0;
+    return HeaderSize + body + DigestSize;
+}
+
+bool LogBlock::verify(const QByteArray &block, const QByteArray &previous)
+{
+    int covered = block.size() - DigestSize;
+    if (covered < HeaderSize)
+        return false;
+    return (chainDigest(previous, block.constData(), covered) == block.mid(covered));
+}
+
+QByteArray LogBlock::digest(const QByteArray &block)
+{
+    return block.right(DigestSize);
+}
+
+bool LogBlock::records(const QByteArray &block, quint32 count, QList<QByteArray> *records)
+{
+    if (block.size() < HeaderSize + DigestSize)
+        return false;
+
+    const char *record = block.constData() + HeaderSize;
+    const char *end = block.constData() + block.size() - DigestSize;
+    for (quint32 i = 0; i < count; i++)
+    {
+        if (end - record < 4)
+            return false;
+        quint32 size = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(record));
+        record += 4;
+        if ((quint32)(end - record) < size)
+            return false;
+
+        records->append(QByteArray(record, size));
+        record += size;
+    }
+    return true;
+}
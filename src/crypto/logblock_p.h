@@ -0,0 +1,81 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef LOGBLOCK_P_H
+#define LOGBLOCK_P_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+
+namespace MssfQt
+{
+
+namespace Internal
+{
+
+/*!
+  * \class LogBlock
+  * \brief The encoding of the blocks of a \ref ProtectedLog and their digest chain.
+  *
+  * A block is a header of [magic][record count][body size], big endian, the body and a digest.
+  * The body holds the records, each as [quint32 length] followed by the data. The digest is the
+  * SHA1 of the digest of the block before, all zero for the first one, the header and the body.
+  */
+class LogBlock
+{
+public:
+
+    enum {
+        HeaderSize = 12,
+        DigestSize = 20
+    };
+
+    //! Add a record to the body of a block.
+    static void appendRecord(QByteArray &body, const QByteArray &record);
+
+    //! Build the block of count records, chained to the block with the digest previous.
+    static QByteArray encode(const QByteArray &body, quint32 count, const QByteArray &previous);
+
+    /*!
+      * \brief Check a block header.
+      * \returns The size of the whole block, 0 if the header is not valid.
+      */
+    static quint32 size(const QByteArray &header, quint32 *count);
+
+    //! \returns true if the digest at the end of block follows from previous.
+    static bool verify(const QByteArray &block, const QByteArray &previous);
+
+    //! The digest at the end of block, the next one is chained to it.
+    static QByteArray digest(const QByteArray &block);
+
+    //! Split the body of a block. \returns false if count records do not fit.
+    static bool records(const QByteArray &block, quint32 count, QList<QByteArray> *records);
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+#endif // LOGBLOCK_P_H
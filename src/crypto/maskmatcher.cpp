@@ -0,0 +1,67 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "maskmatcher_p.h"
+
+using namespace MssfQt::Internal;
+
+MaskMatcher::MaskMatcher(const QString &mask)
+{
+    int wildcard = mask.indexOf(QRegExp(QLatin1String("[*?[]")));
+    if (mask.isEmpty() || mask == QLatin1String("*"))
+    {
+        kind = All;
+    }
+    else if (wildcard < 0)
+    {
+        kind = Exact;
+        text = mask;
+    }
+    else if (wildcard == mask.length() - 1 && mask.at(wildcard) == QLatin1Char('*'))
+    {
+        kind = Prefix;
+        text = mask.left(wildcard);
+    }
+    else
+    {
+        kind = Wildcard;
+        rx = QRegExp(mask, Qt::CaseSensitive, QRegExp::Wildcard);
+    }
+}
+
+bool MaskMatcher::matches(const QString &name) const
+{
+    switch (kind)
+    {
+    case All:
+        return true;
+    case Exact:
+        return (name == text);
+    case Prefix:
+        return name.startsWith(text);
+    default:
+        return rx.exactMatch(name);
+    }
+}
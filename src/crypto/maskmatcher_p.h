@@ -0,0 +1,68 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef MASKMATCHER_P_H
+#define MASKMATCHER_P_H
+
+#include <QtCore/QRegExp>
+#include <QtCore/QString>
+
+namespace MssfQt
+{
+
+namespace Internal
+{
+
+/*!
+  * \class MaskMatcher
+  * \brief Matches member names against a wildcard mask.
+  *
+  * The common masks, a plain name or a name followed by a single trailing '*', are matched with
+  * a string comparison, only the others go through QRegExp.
+  */
+class MaskMatcher
+{
+public:
+
+    /*!
+      * \brief Constructor
+      * \param mask The wildcard mask, empty or "*" matches everything.
+      */
+    MaskMatcher(const QString &mask);
+
+    bool matches(const QString &name) const;
+
+private:
+    enum Kind { All, Exact, Prefix, Wildcard };
+    Kind kind;
+    QString text;
+    QRegExp rx;
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+#endif // MASKMATCHER_P_H
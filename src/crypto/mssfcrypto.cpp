@@ -118,6 +118,11 @@ QString MssfCrypto::applicationId(const QString &pathName)
     return applicationId(pathName.toUtf8().constData());
 }
 
+QString MssfCrypto::applicationId(const QByteArray &pathName)
+{
+    return applicationId(pathName.constData());
+}
+
 QString MssfCrypto::applicationId(const char *pathName)
 {
     if (!pathName)
@@ -264,6 +269,11 @@ bool MssfCrypto::verifyMssffs(const QString &dir, MssfCrypto::SystemMode *mode)
     return verifyMssffs(dir.toUtf8().constData(), mode);
 }
 
+bool MssfCrypto::verifyMssffs(const QByteArray &dir, MssfCrypto::SystemMode *mode)
+{
+    return verifyMssffs(dir.constData(), mode);
+}
+
 bool MssfCrypto::verifyMssffs(const char *dir, MssfCrypto::SystemMode *mode)
 {
     mssf_system_mode_t cmode;
@@ -139,6 +139,14 @@ public:
       */
     static QString applicationId(const char *pathName);
 
+    /*!
+      * \brief Return the application ID of a particular application.
+      * \param pathName The UTF-8 encoded path name of the binary to query, used as is.
+      * \returns The application ID if it exists, QString() on error.
+      * This is an overloaded method provided for convenience.
+      */
+    static QString applicationId(const QByteArray &pathName);
+
     /*!
      * \brief In what mode the system seems to be in
      * \return The current mode.
@@ -252,6 +260,17 @@ public:
      * This overladed method is provided for convenience.
      */
     bool verifyMssffs(const char *dir, MssfCrypto::SystemMode *mode);
+
+    /*!
+     * \brief Verify that the given directory is an MSSFFS mountpoint
+     * \param dir UTF-8 encoded name of the directory, used as is
+     * \param mode On ouput, the variable tells in which mode
+     *             the security framework is on. If the mode
+     *             is open, take the result with a grain of salt.
+     * \returns true on success, false otherwise
+     * This overladed method is provided for convenience.
+     */
+    bool verifyMssffs(const QByteArray &dir, MssfCrypto::SystemMode *mode);
 };
 
 } //namespace MssfQt
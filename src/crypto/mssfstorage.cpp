@@ -27,18 +27,31 @@
 #include "mssfstorage_p.h"
 #include "protectedfile.h"
 #include "protectedfile_p.h"
+#include "storagecache_p.h"
+#include "storagequeue_p.h"
+#include "storagemetrics_p.h"
+#include "hashtree_p.h"
+#include "maskmatcher_p.h"
 
 #include <QtCore/QVector>
+#include <QtCore/QHash>
+#include <QtCore/QFutureInterface>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QtConcurrentMap>
 #include <QtCore/QRegExp>
 #include <QtCore/QString>
 #include <QtCore/QStringList>
 #include <QtCore/QByteArray>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QIODevice>
+#include <QtCore/QScopedPointer>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #ifdef MAEMO
 //use the V1 libraries for maemo
@@ -54,6 +67,15 @@ using namespace mssf;
 
 using namespace MssfQt;
 
+//! The amount of data streamed to or from a member at a time.
+static const int StreamChunkSize = 64 * 1024;
+
+//! Appended to the name of the member a stream is written to before it replaces the original.
+static const char PartialSuffix[] = ".mssfqt-part";
+
+//! The number of open handles kept by openMember() unless changed.
+static const int DefaultHandleLimit = 32;
+
 //Convert to wrapped types
 static storage::visibility_t visConverter(MssfStorage::Visibility vis)
 {
@@ -84,19 +106,176 @@ QStringList vectorToStringList(const storage::stringlist &list, const QString &m
     QList<const char *> fullList = QList<const char *>::fromVector(QVector<const char *>::fromStdVector(list));
 
     QStringList resultList;
-    QRegExp rx(mask);
-    rx.setPatternSyntax(QRegExp::Wildcard);
+    Internal::MaskMatcher matcher(mask);
 
     foreach(const char *stdString, fullList)
     {
         QString file = QString::fromUtf8(stdString);
-        if (mask.isEmpty() || rx.exactMatch(file))
+        if (matcher.matches(file))
             resultList.append(file);
     }
 
     return resultList;
 }
 
+namespace
+{
+//! The stores opened with MssfStorage::open(), shared by all callers in the process.
+struct StorageRegistry
+{
+    QMutex mutex;
+    QHash<QString, QWeakPointer<MssfStorage> > stores;
+};
+}
+
+Q_GLOBAL_STATIC(StorageRegistry, storageRegistry)
+
+//! Build the registry key of a store, the NUL separators cannot occur in a store or token name.
+static QString storeKey(const QString &name, const QString &owner, MssfStorage::Visibility vis, MssfStorage::Protection prot)
+{
+    return name + QChar(0) + owner + QChar(0) + QString::number(vis) + QChar(0) + QString::number(prot);
+}
+
+//! Open one store of an MssfStorage::openAll() batch, run on the thread pool.
+static QSharedPointer<MssfStorage> openDescriptor(const MssfStorage::Descriptor &store)
+{
+    return MssfStorage::open(store.name, store.owner, store.visibility, store.protection);
+}
+
+namespace
+{
+//! State of a single MssfStorage::iterateStorageNames() call.
+struct StorageIteration
+{
+    MssfStorage::Visibility vis;
+    MssfStorage::Protection prot;
+    QRegExp rx;
+    MssfStorage::StorageVisitor visitor;
+    void *context;
+    int count;
+};
+}
+
+//! Backend callback of iterate_storage_names, forwards each matching name to the visitor.
+static int storageNameRelay(int nbr, void *item, void *context)
+{
+    Q_UNUSED(nbr)
+    StorageIteration *iteration = static_cast<StorageIteration *>(context);
+    QString name = QString::fromUtf8(static_cast<const char *>(item));
+
+    if (!iteration->rx.isEmpty() && !iteration->rx.exactMatch(name))
+        return 0;
+
+    iteration->count++;
+    // a negative return value stops the backend iteration
+    return (iteration->visitor(MssfStorage::Descriptor(name, QString(), iteration->vis, iteration->prot), iteration->context) ? 0 : -1);
+}
+
+//! ChunkHandler of MssfStorage::getFile(const QString &, QIODevice *).
+static bool writeToDevice(const char *data, qint64 length, void *context)
+{
+    return (static_cast<QIODevice *>(context)->write(data, length) == length);
+}
+
+//! StorageVisitor of MssfStorage::openMatching(), collects the stores to open.
+static bool collectDescriptor(const MssfStorage::Descriptor &store, void *context)
+{
+    static_cast<QList<MssfStorage::Descriptor> *>(context)->append(store);
+    return true;
+}
+
+namespace
+{
+//! MssfStorage::getFileAsync() on the storage queue.
+class GetFileTask : public Internal::StorageTask
+{
+public:
+    GetFileTask(MssfStoragePrivate *d, const QByteArray &pathname)
+        : Internal::StorageTask(pathname), d(d), pathname(pathname)
+    {
+        result.reportStarted();
+    }
+
+    QFutureInterface<QByteArray> result;
+
+protected:
+    void execute()
+    {
+        QByteArray data = d->getFile(pathname.constData());
+        result.reportResult(data);
+        result.reportFinished();
+    }
+
+private:
+    MssfStoragePrivate *d;
+    QByteArray pathname;
+};
+
+//! MssfStorage::putFileAsync() on the storage queue.
+class PutFileTask : public Internal::StorageTask
+{
+public:
+    PutFileTask(MssfStoragePrivate *d, const QByteArray &pathname, const QByteArray &data)
+        : Internal::StorageTask(pathname), d(d), pathname(pathname), data(data)
+    {
+        result.reportStarted();
+    }
+
+    QFutureInterface<bool> result;
+
+protected:
+    void execute()
+    {
+        bool ok = d->putFile(pathname.constData(), data);
+        data.clear();
+        result.reportResult(ok);
+        result.reportFinished();
+    }
+
+private:
+    MssfStoragePrivate *d;
+    QByteArray pathname;
+    QByteArray data;
+};
+
+//! MssfStorage::commitAsync() on the storage queue, runs as a barrier.
+class CommitTask : public Internal::StorageTask
+{
+public:
+    CommitTask(MssfStoragePrivate *d)
+        : Internal::StorageTask(QByteArray(), true), d(d)
+    {
+        result.reportStarted();
+    }
+
+    QFutureInterface<void> result;
+
+protected:
+    void execute()
+    {
+        d->commit();
+        result.reportFinished();
+    }
+
+private:
+    MssfStoragePrivate *d;
+};
+}
+
+MssfStorage::Descriptor::Descriptor()
+    : visibility(MssfStorage::private_vis),
+      protection(MssfStorage::Signed)
+{
+}
+
+MssfStorage::Descriptor::Descriptor(const QString &name, const QString &owner, MssfStorage::Visibility vis, MssfStorage::Protection prot)
+    : name(name),
+      owner(owner),
+      visibility(vis),
+      protection(prot)
+{
+}
+
 MssfStorage::MssfStorage(const QString &name, const QString &owner, MssfStorage::Visibility vis, MssfStorage::Protection prot)
     : d_ptr(new MssfStoragePrivate(name, owner, vis, prot))
 {
@@ -108,13 +287,32 @@ MssfStorage::MssfStorage(MssfStoragePrivate *other)
 }
 
 MssfStoragePrivate::MssfStoragePrivate(const QString &name, const QString &owner, MssfStorage::Visibility vis, MssfStorage::Protection prot)
-    : store(new storage(name.toUtf8().constData(), owner.toUtf8().constData(), visConverter(vis), protConverter(prot)))
+    : mutex(QMutex::Recursive),
+      store(new storage(name.toUtf8().constData(), owner.toUtf8().constData(), visConverter(vis), protConverter(prot))),
+      ownsStore(true),
+      ownerName(owner),
+      queue(NULL),
+      cache(NULL),
+      usageValid(false),
+      dedup(false),
+      aliasesLoaded(false),
+      handles(DefaultHandleLimit)
 {
+    memset(&indexStatus, 0, sizeof(indexStatus));
 }
 
 MssfStoragePrivate::MssfStoragePrivate(storage *store)
-    : store(store)
+    : mutex(QMutex::Recursive),
+      store(store),
+      ownsStore(false),
+      queue(NULL),
+      cache(NULL),
+      usageValid(false),
+      dedup(false),
+      aliasesLoaded(false),
+      handles(DefaultHandleLimit)
 {
+    memset(&indexStatus, 0, sizeof(indexStatus));
 }
 
 MssfStorage::~MssfStorage()
@@ -123,7 +321,102 @@ MssfStorage::~MssfStorage()
 
 MssfStoragePrivate::~MssfStoragePrivate()
 {
-    delete store; store = NULL;
+    // let the queued operations complete while everything is still there
+    delete queue; queue = NULL;
+    delete cache; cache = NULL;
+    // dropping the pool closes the handles nobody else holds
+    handles.clear();
+    // the others may outlive us, close them and cut them off before the store goes away
+    QSet<ProtectedFilePrivate *> alive = members;
+    members.clear();
+    foreach(ProtectedFilePrivate *file, alive)
+        file->detach();
+    if (ownsStore)
+        delete store;
+    store = NULL;
+}
+
+QSharedPointer<MssfStorage> MssfStorage::open(const QString &name, const QString &owner, MssfStorage::Visibility vis, MssfStorage::Protection prot)
+{
+    QString key = storeKey(name, owner, vis, prot);
+    StorageRegistry *registry = storageRegistry();
+
+    {
+        QMutexLocker locker(&registry->mutex);
+        QSharedPointer<MssfStorage> existing = registry->stores.value(key).toStrongRef();
+        if (existing)
+            return existing;
+    }
+
+    // parse the index outside the lock so that different stores can be opened concurrently
+    QSharedPointer<MssfStorage> opened(new MssfStorage(name, owner, vis, prot));
+    QSharedPointer<MssfStorage> existing;
+
+    {
+        QMutexLocker locker(&registry->mutex);
+        existing = registry->stores.value(key).toStrongRef();
+        if (!existing)
+        {
+            // forget the stores that have been closed since
+            QMutableHashIterator<QString, QWeakPointer<MssfStorage> > it(registry->stores);
+            while (it.hasNext())
+                if (it.next().value().isNull())
+                    it.remove();
+
+            opened->d_ptr->self = opened.toWeakRef();
+            registry->stores.insert(key, opened);
+            return opened;
+        }
+    }
+
+    // somebody else opened the same store in the meantime, drop ours outside the lock
+    opened.clear();
+    return existing;
+}
+
+QFuture<QSharedPointer<MssfStorage> > MssfStorage::openAll(const QList<MssfStorage::Descriptor> &stores)
+{
+    return QtConcurrent::mapped(stores, openDescriptor);
+}
+
+int MssfStorage::iterateStorageNames(MssfStorage::Visibility vis, MssfStorage::Protection prot, const QString &pattern,
+                                     MssfStorage::StorageVisitor visitor, void *context)
+{
+    return MssfStoragePrivate::iterateStorageNames(vis, prot, pattern, visitor, context);
+}
+
+int MssfStoragePrivate::iterateStorageNames(MssfStorage::Visibility vis, MssfStorage::Protection prot, const QString &pattern,
+                                            MssfStorage::StorageVisitor visitor, void *context)
+{
+    if (!visitor)
+        return -1;
+
+    StorageIteration iteration;
+    iteration.vis = vis;
+    iteration.prot = prot;
+    iteration.rx = QRegExp(pattern, Qt::CaseSensitive, QRegExp::Wildcard);
+    iteration.visitor = visitor;
+    iteration.context = context;
+    iteration.count = 0;
+
+    // the backend takes a regular expression, the wildcard is applied in the relay instead
+    if (storage::iterate_storage_names(visConverter(vis), protConverter(prot), ".*",
+                                       storageNameRelay, &iteration) < 0)
+        return -1;
+
+    return iteration.count;
+}
+
+QFuture<QSharedPointer<MssfStorage> > MssfStorage::openMatching(MssfStorage::Visibility vis, MssfStorage::Protection prot,
+                                                                const QString &pattern, const QString &owner)
+{
+    QList<MssfStorage::Descriptor> stores;
+    MssfStoragePrivate::iterateStorageNames(vis, prot, pattern, collectDescriptor, &stores);
+
+    for (int i = 0; i < stores.count(); i++)
+        stores[i].owner = owner;
+
+    return openAll(stores);
 }
 
 QString MssfStorage::storageRoot()
@@ -143,6 +436,7 @@ QString MssfStorage::name() const
 
 QString MssfStoragePrivate::name() const
 {
+    QMutexLocker locker(&mutex);
     return QLatin1String(store->name());
 }
 
@@ -153,9 +447,15 @@ QString MssfStorage::filename() const
 
 QString MssfStoragePrivate::filename() const
 {
+    QMutexLocker locker(&mutex);
     return QLatin1String(store->filename());
 }
 
+QString MssfStoragePrivate::owner() const
+{
+    return ownerName;
+}
+
 QString MssfStorage::lastError()
 {
     return d_ptr->lastError();
@@ -175,6 +475,7 @@ MssfStorage::Visibility MssfStorage::visibility() const
 
 MssfStorage::Visibility MssfStoragePrivate::visibility() const
 {
+    QMutexLocker locker(&mutex);
     storage::visibility_t vis = store->visibility();
     if (vis == storage::vis_global)
         return MssfStorage::global_vis;
@@ -191,6 +492,7 @@ MssfStorage::Protection MssfStorage::protection() const
 
 MssfStorage::Protection MssfStoragePrivate::protection() const
 {
+    QMutexLocker locker(&mutex);
     return (store->protection() == storage::prot_encrypted ? MssfStorage::Encrypted : MssfStorage::Signed);
 }
 
@@ -201,6 +503,7 @@ int MssfStorage::numFiles() const
 
 int MssfStoragePrivate::numFiles() const
 {
+    QMutexLocker locker(&mutex);
     return store->nbrof_files();
 }
 
@@ -211,6 +514,7 @@ int MssfStorage::numLinks() const
 
 int MssfStoragePrivate::numLinks() const
 {
+    QMutexLocker locker(&mutex);
     return store->nbrof_links();
 }
 
@@ -221,7 +525,18 @@ bool MssfStorage::removeAllFiles()
 
 bool MssfStoragePrivate::removeAllFiles()
 {
-    return store->remove_all_files();
+    MSSFQT_MEASURE(StorageRemoveAllFiles);
+    QMutexLocker locker(&mutex);
+    if (cache)
+        cache->clear();
+    handles.clear();
+    statusCache.clear();
+    usageValid = false;
+    digests.clear();
+    aliases.clear();
+    bool ok = store->remove_all_files();
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 QStringList MssfStorage::getFiles(const QString &mask)
@@ -231,6 +546,8 @@ QStringList MssfStorage::getFiles(const QString &mask)
 
 QStringList MssfStoragePrivate::getFiles(const QString &mask)
 {
+    MSSFQT_MEASURE(StorageGetFiles);
+    QMutexLocker locker(&mutex);
     storage::stringlist list;
     size_t total = store->get_files(list);
     if (total <= 0)
@@ -249,6 +566,8 @@ QStringList MssfStorage::getUFiles()
 
 QStringList MssfStoragePrivate::getUFiles()
 {
+    MSSFQT_MEASURE(StorageGetUFiles);
+    QMutexLocker locker(&mutex);
     storage::stringlist list;
     size_t total = store->get_ufiles(list);
     if (total <= 0)
@@ -261,23 +580,47 @@ QStringList MssfStoragePrivate::getUFiles()
 }
 
 bool MssfStorage::containsFile(const QString &pathname)
+{
+    return d_ptr->containsFile(pathname.toUtf8().constData());
+}
+
+bool MssfStorage::containsFile(const QByteArray &pathname)
+{
+    return d_ptr->containsFile(pathname.constData());
+}
+
+bool MssfStorage::containsFile(const char *pathname)
 {
     return d_ptr->containsFile(pathname);
 }
 
-bool MssfStoragePrivate::containsFile(const QString &pathname)
+bool MssfStoragePrivate::containsFile(const char *pathname)
 {
-    return store->contains_file(pathname.toUtf8().constData());
+    MSSFQT_MEASURE(StorageContainsFile);
+    QMutexLocker locker(&mutex);
+    return store->contains_file(pathname);
 }
 
 bool MssfStorage::containsLink(const QString &pathname)
+{
+    return d_ptr->containsLink(pathname.toUtf8().constData());
+}
+
+bool MssfStorage::containsLink(const QByteArray &pathname)
+{
+    return d_ptr->containsLink(pathname.constData());
+}
+
+bool MssfStorage::containsLink(const char *pathname)
 {
     return d_ptr->containsLink(pathname);
 }
 
-bool MssfStoragePrivate::containsLink(const QString &pathname)
+bool MssfStoragePrivate::containsLink(const char *pathname)
 {
-    return store->contains_link(pathname.toUtf8().constData());
+    MSSFQT_MEASURE(StorageContainsLink);
+    QMutexLocker locker(&mutex);
+    return store->contains_link(pathname);
 }
 
 void MssfStorage::addFile(const QString &pathname)
@@ -287,17 +630,83 @@ void MssfStorage::addFile(const QString &pathname)
 
 void MssfStoragePrivate::addFile(const QString &pathname)
 {
-    store->add_file(pathname.toUtf8().constData());
+    MSSFQT_MEASURE(StorageAddFile);
+    QMutexLocker locker(&mutex);
+    QByteArray key = pathname.toUtf8();
+    invalidate(key.constData());
+    store->add_file(key.constData());
 }
 
 void MssfStorage::removeFile(const QString &pathname)
+{
+    d_ptr->removeFile(pathname.toUtf8().constData());
+}
+
+void MssfStorage::removeFile(const QByteArray &pathname)
+{
+    d_ptr->removeFile(pathname.constData());
+}
+
+void MssfStorage::removeFile(const char *pathname)
 {
     d_ptr->removeFile(pathname);
 }
 
-void MssfStoragePrivate::removeFile(const QString &pathname)
+void MssfStoragePrivate::removeFile(const char *pathname)
+{
+    MSSFQT_MEASURE(StorageRemoveFile);
+    QMutexLocker locker(&mutex);
+    invalidate(pathname);
+    if (unshare(QByteArray::fromRawData(pathname, qstrlen(pathname))))
+        store->remove_file(pathname);
+}
+
+int MssfStorage::removeFiles(const QString &mask)
+{
+    return d_ptr->removeFiles(mask);
+}
+
+int MssfStoragePrivate::removeFiles(const QString &mask)
 {
-    store->remove_file(pathname.toUtf8().constData());
+    MSSFQT_MEASURE(StorageRemoveFiles);
+    if (mask.isEmpty())
+        return 0;
+
+    QMutexLocker locker(&mutex);
+    QStringList names = getFiles(mask);
+    if (names.isEmpty())
+        return 0;
+
+    // everything may be affected, start the caches over once instead of per member
+    statusCache.clear();
+    usageValid = false;
+    handles.clear();
+    if (cache)
+        cache->clear();
+
+    int removed = 0;
+    bool touched = false;
+    foreach(const QString &name, names)
+    {
+        QByteArray path = name.toUtf8();
+        // a link or a member handed over to its links is already gone when unshare() returns false
+        if (unshare(path))
+        {
+            if (store->contains_link(path.constData()))
+                store->remove_link(path.constData());
+            else
+                store->remove_file(path.constData());
+        }
+        touched = true;
+
+        // the backend does not report failures, count what is actually gone
+        if (!store->contains_file(path.constData()) && !store->contains_link(path.constData()))
+            removed++;
+    }
+
+    if (touched)
+        store->commit();
+    return removed;
 }
 
 void MssfStorage::addLink(const QString &pathname, const QString &to)
@@ -307,7 +716,15 @@ void MssfStorage::addLink(const QString &pathname, const QString &to)
 
 void MssfStoragePrivate::addLink(const QString &pathname, const QString &to)
 {
-    store->add_link(pathname.toUtf8().constData(), to.toUtf8().constData());
+    MSSFQT_MEASURE(StorageAddLink);
+    QMutexLocker locker(&mutex);
+    QByteArray key = pathname.toUtf8();
+    QByteArray target = to.toUtf8();
+    invalidate(key.constData());
+    unshare(key);
+    store->add_link(key.constData(), target.constData());
+    if (aliasesLoaded && store->contains_link(key.constData()) && store->contains_file(target.constData()))
+        aliases[target].append(key);
 }
 
 void MssfStorage::removeLink(const QString &pathname)
@@ -317,7 +734,12 @@ void MssfStorage::removeLink(const QString &pathname)
 
 void MssfStoragePrivate::removeLink(const QString &pathname)
 {
-    store->remove_link(pathname.toUtf8().constData());
+    MSSFQT_MEASURE(StorageRemoveLink);
+    QMutexLocker locker(&mutex);
+    QByteArray key = pathname.toUtf8();
+    invalidate(key.constData());
+    if (unshare(key))
+        store->remove_link(key.constData());
 }
 
 void MssfStorage::rename(const QString &pathname, const QString &to)
@@ -327,7 +749,79 @@ void MssfStorage::rename(const QString &pathname, const QString &to)
 
 void MssfStoragePrivate::rename(const QString &pathname, const QString &to)
 {
-    store->rename(pathname.toUtf8().constData(), to.toUtf8().constData());
+    MSSFQT_MEASURE(StorageRename);
+    QMutexLocker locker(&mutex);
+    QByteArray from = pathname.toUtf8();
+    QByteArray target = to.toUtf8();
+    invalidate(from.constData());
+    invalidate(target.constData());
+    unshare(target);
+    store->rename(from.constData(), target.constData());
+    renamed(from, target);
+}
+
+int MssfStorage::renamePrefix(const QString &from, const QString &to)
+{
+    return d_ptr->renamePrefix(from, to);
+}
+
+int MssfStoragePrivate::renamePrefix(const QString &from, const QString &to)
+{
+    MSSFQT_MEASURE(StorageRenamePrefix);
+    if (from.isEmpty() || from == to)
+        return 0;
+
+    // with nested prefixes a renamed member could match again or take the name of another
+    if (to.startsWith(from) || from.startsWith(to))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    QMutexLocker locker(&mutex);
+    // the prefix may contain wildcard characters, it is matched literally instead of as a mask
+    QStringList found = getFiles();
+
+    QStringList names;
+    QList<QByteArray> newNames;
+    foreach(const QString &name, found)
+    {
+        if (!name.startsWith(from))
+            continue;
+
+        QByteArray newName = (to + name.mid(from.length())).toUtf8();
+        if (store->contains_file(newName.constData()) || store->contains_link(newName.constData()))
+        {
+            errno = EEXIST;
+            return -1;
+        }
+
+        names.append(name);
+        newNames.append(newName);
+    }
+
+    if (names.isEmpty())
+        return 0;
+
+    statusCache.clear();
+    usageValid = false;
+    handles.clear();
+    if (cache)
+        cache->clear();
+
+    int moved = 0;
+    for (int i = 0; i < names.count(); i++)
+    {
+        QByteArray oldName = names.at(i).toUtf8();
+        const QByteArray &newName = newNames.at(i);
+        store->rename(oldName.constData(), newName.constData());
+        renamed(oldName, newName);
+        moved++;
+    }
+
+    if (moved > 0)
+        store->commit();
+    return moved;
 }
 
 QString MssfStorage::readLink(const QString &pathname)
@@ -337,61 +831,324 @@ QString MssfStorage::readLink(const QString &pathname)
 
 QString MssfStoragePrivate::readLink(const QString &pathname)
 {
+    MSSFQT_MEASURE(StorageReadLink);
+    QMutexLocker locker(&mutex);
     std::string pointsTo;
     store->read_link(pathname.toUtf8().constData(), pointsTo);
     return QString::fromStdString(pointsTo);
 }
 
 bool MssfStorage::verifyFile(const QString &pathname)
+{
+    return d_ptr->verifyFile(pathname.toUtf8().constData());
+}
+
+bool MssfStorage::verifyFile(const QByteArray &pathname)
+{
+    return d_ptr->verifyFile(pathname.constData());
+}
+
+bool MssfStorage::verifyFile(const char *pathname)
 {
     return d_ptr->verifyFile(pathname);
 }
 
-bool MssfStoragePrivate::verifyFile(const QString &pathname)
+bool MssfStoragePrivate::verifyFile(const char *pathname)
 {
-    return store->verify_file(pathname.toUtf8().constData());
+    MSSFQT_MEASURE(StorageVerifyFile);
+    QMutexLocker locker(&mutex);
+    bool ok = store->verify_file(pathname);
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 bool MssfStorage::verifyContent(const QString &pathname, const QByteArray &data)
+{
+    return d_ptr->verifyContent(pathname.toUtf8().constData(), data);
+}
+
+bool MssfStorage::verifyContent(const QByteArray &pathname, const QByteArray &data)
+{
+    return d_ptr->verifyContent(pathname.constData(), data);
+}
+
+bool MssfStorage::verifyContent(const char *pathname, const QByteArray &data)
 {
     return d_ptr->verifyContent(pathname, data);
 }
 
-bool MssfStoragePrivate::verifyContent(const QString &pathname, const QByteArray &data)
+bool MssfStoragePrivate::verifyContent(const char *pathname, const QByteArray &data)
 {
-    return store->verify_content(pathname.toUtf8().constData(), (uchar *)data.constData(), data.size());
+    MSSFQT_MEASURE(StorageVerifyContent);
+    QMutexLocker locker(&mutex);
+    bool ok = store->verify_content(pathname, (uchar *)data.constData(), data.size());
+    MSSFQT_MEASURE_BYTES(data.size());
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 QByteArray MssfStorage::getFile(const QString &pathname)
+{
+    return d_ptr->getFile(pathname.toUtf8().constData());
+}
+
+QByteArray MssfStorage::getFile(const QByteArray &pathname)
+{
+    return d_ptr->getFile(pathname.constData());
+}
+
+QByteArray MssfStorage::getFile(const char *pathname)
 {
     return d_ptr->getFile(pathname);
 }
 
-QByteArray MssfStoragePrivate::getFile(const QString &pathname)
+QByteArray MssfStoragePrivate::getFile(const char *pathname)
 {
+    MSSFQT_MEASURE(StorageGetFile);
+    QMutexLocker locker(&mutex);
+    QByteArray retrievedData;
+    if (cache && cache->find(QByteArray::fromRawData(pathname, qstrlen(pathname)), &retrievedData))
+    {
+        MSSFQT_MEASURE_BYTES(retrievedData.size());
+        return retrievedData;
+    }
+
     RAWDATA_PTR storedData = NULL;
     size_t length = 0;
 
-    if (store->get_file(pathname.toUtf8().constData(), &storedData, &length) != 0)
+    if (store->get_file(pathname, &storedData, &length) != 0)
     {
+        MSSFQT_MEASURE_RESULT(false);
         store->release_buffer(storedData);
         return QByteArray();
     }
+    MSSFQT_MEASURE_BYTES(length);
 
-    QByteArray retrievedData((char *)storedData, length);
+    retrievedData = QByteArray((char *)storedData, length);
     //clean up
     store->release_buffer(storedData);
+
+    if (cache)
+        cache->insert(QByteArray(pathname), retrievedData);
     return retrievedData;
 }
 
+bool MssfStorage::getFile(const QString &pathname, MssfStorage::ChunkHandler handler, void *context)
+{
+    return d_ptr->getFile(pathname, handler, context);
+}
+
+bool MssfStorage::getFile(const QString &pathname, QIODevice *sink)
+{
+    if (!sink || !sink->isWritable())
+    {
+        errno = EINVAL;
+        return false;
+    }
+    return d_ptr->getFile(pathname, writeToDevice, sink);
+}
+
+bool MssfStoragePrivate::getFile(const QString &pathname, MssfStorage::ChunkHandler handler, void *context)
+{
+    MSSFQT_MEASURE(StorageGetFile);
+    if (!handler)
+    {
+        errno = EINVAL;
+        MSSFQT_MEASURE_RESULT(false);
+        return false;
+    }
+
+    QMutexLocker locker(&mutex);
+    QByteArray key = pathname.toUtf8();
+
+    QByteArray cached;
+    if (cache && cache->find(key, &cached))
+    {
+        MSSFQT_MEASURE_BYTES(cached.size());
+        return (cached.isEmpty() || handler(cached.constData(), cached.size(), context));
+    }
+
+    // the store verifies the member when it is opened
+    QScopedPointer<p_file> file(store->member(key.constData()));
+    if (!file || !file->p_open(O_RDONLY))
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return false;
+    }
+
+    QByteArray chunk(StreamChunkSize, 0);
+    quint64 at = 0;
+    bool ok = true;
+
+    forever
+    {
+        ssize_t length = file->p_read(at, chunk.data(), chunk.size());
+        if (length < 0)
+        {
+            ok = false;
+            break;
+        }
+        if (length == 0)
+            break;
+
+        if (!handler(chunk.constData(), length, context))
+        {
+            ok = false;
+            break;
+        }
+        at += length;
+    }
+
+    file->p_close();
+    MSSFQT_MEASURE_BYTES(at);
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
+}
+
 bool MssfStorage::putFile(const QString &pathname, const QByteArray &data)
+{
+    return d_ptr->putFile(pathname.toUtf8().constData(), data);
+}
+
+bool MssfStorage::putFile(const QByteArray &pathname, const QByteArray &data)
+{
+    return d_ptr->putFile(pathname.constData(), data);
+}
+
+bool MssfStorage::putFile(const char *pathname, const QByteArray &data)
 {
     return d_ptr->putFile(pathname, data);
 }
 
-bool MssfStoragePrivate::putFile(const QString &pathname, const QByteArray &data)
+bool MssfStorage::putFile(const QString &pathname, const char *data, quintptr length)
 {
-    return (store->put_file(pathname.toUtf8().constData(), (void *)data.constData(), data.size()) == 0 ? true : false);
+    // put_file() is synchronous and nothing keeps the data, the cache makes its own copy
+    return d_ptr->putFile(pathname.toUtf8().constData(), QByteArray::fromRawData(data, length));
+}
+
+bool MssfStoragePrivate::putFile(const char *pathname, const QByteArray &data)
+{
+    MSSFQT_MEASURE(StoragePutFile);
+    QMutexLocker locker(&mutex);
+    invalidate(pathname);
+    // only looked up, the indexes get a copy of their own
+    QByteArray key = QByteArray::fromRawData(pathname, qstrlen(pathname));
+
+    QByteArray digest;
+    if (dedup)
+    {
+        digest = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+        QByteArray existing = digests.member(digest);
+
+        // the index only knows what was written through us, the store has the final say
+        if (!existing.isEmpty() && store->contains_file(existing.constData())
+                && store->verify_content(existing.constData(), (uchar *)data.constData(), data.size()))
+        {
+            if (existing == key || aliases.value(existing).contains(key))
+                return true;
+
+            // a plain member that is still there must go before the name can become a link
+            if (unshare(key) && store->contains_file(pathname))
+                store->remove_file(pathname);
+            store->add_link(pathname, existing.constData());
+            aliases[existing].append(QByteArray(pathname));
+            return true;
+        }
+    }
+
+    unshare(key);
+    bool ok = (store->put_file(pathname, (void *)data.constData(), data.size()) == 0);
+    if (ok && dedup)
+        digests.insert(QByteArray(pathname), digest);
+    MSSFQT_MEASURE_BYTES(data.size());
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
+}
+
+bool MssfStorage::putFile(const QString &pathname, QIODevice *source)
+{
+    return d_ptr->putFile(pathname, source);
+}
+
+bool MssfStoragePrivate::putFile(const QString &pathname, QIODevice *source)
+{
+    MSSFQT_MEASURE(StoragePutFile);
+    if (!source || !source->isReadable())
+    {
+        errno = EINVAL;
+        MSSFQT_MEASURE_RESULT(false);
+        return false;
+    }
+
+    QMutexLocker locker(&mutex);
+    QByteArray key = pathname.toUtf8();
+    // the old contents are kept until the new ones are complete
+    QByteArray partial = key + PartialSuffix;
+    invalidate(partial.constData());
+    unshare(partial);
+
+    QScopedPointer<p_file> file(store->member(partial.constData()));
+    if (!file || !file->p_open(O_WRONLY | O_CREAT | O_TRUNC))
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return false;
+    }
+
+    QByteArray chunk(StreamChunkSize, 0);
+    quint64 at = 0;
+    bool ok = true;
+    // the data is only seen once, so a stream is never linked, but later copies may link to it
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+
+    forever
+    {
+        qint64 length = source->read(chunk.data(), chunk.size());
+        if (length < 0)
+        {
+            ok = false;
+            break;
+        }
+
+        if (length == 0)
+        {
+            // a socket or a pipe may just not have more data yet
+            if (source->isSequential() && source->waitForReadyRead(-1))
+                continue;
+            break;
+        }
+
+        if (file->p_write(at, (void *)chunk.constData(), length) != length)
+        {
+            ok = false;
+            break;
+        }
+        if (dedup)
+            hash.addData(chunk.constData(), length);
+        at += length;
+    }
+
+    // closing records the hash of whatever was written, it must not replace anything unless complete
+    file->p_close();
+    file.reset();
+    if (!ok)
+    {
+        int error = errno;
+        store->remove_file(partial.constData());
+        errno = error;
+        MSSFQT_MEASURE_BYTES(at);
+        MSSFQT_MEASURE_RESULT(false);
+        return false;
+    }
+
+    invalidate(key.constData());
+    unshare(key);
+    store->rename(partial.constData(), key.constData());
+
+    if (dedup)
+        digests.insert(key, hash.result());
+    MSSFQT_MEASURE_BYTES(at);
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 void MssfStorage::commit()
@@ -401,28 +1158,606 @@ void MssfStorage::commit()
 
 void MssfStoragePrivate::commit()
 {
+    MSSFQT_MEASURE(StorageCommit);
+    QMutexLocker locker(&mutex);
+    statusCache.clear();
+    usageValid = false;
     store->commit();
 }
 
+QFuture<QByteArray> MssfStorage::getFileAsync(const QString &pathname)
+{
+    return d_ptr->getFileAsync(pathname);
+}
+
+QFuture<QByteArray> MssfStoragePrivate::getFileAsync(const QString &pathname)
+{
+    GetFileTask *task = new GetFileTask(this, pathname.toUtf8());
+    // the task is deleted once it has run, take the future first
+    QFuture<QByteArray> future = task->result.future();
+    ioQueue()->submit(task);
+    return future;
+}
+
+QFuture<bool> MssfStorage::putFileAsync(const QString &pathname, const QByteArray &data)
+{
+    return d_ptr->putFileAsync(pathname, data);
+}
+
+QFuture<bool> MssfStoragePrivate::putFileAsync(const QString &pathname, const QByteArray &data)
+{
+    PutFileTask *task = new PutFileTask(this, pathname.toUtf8(), data);
+    QFuture<bool> future = task->result.future();
+    ioQueue()->submit(task);
+    return future;
+}
+
+QFuture<void> MssfStorage::commitAsync()
+{
+    return d_ptr->commitAsync();
+}
+
+QFuture<void> MssfStoragePrivate::commitAsync()
+{
+    CommitTask *task = new CommitTask(this);
+    QFuture<void> future = task->result.future();
+    ioQueue()->submit(task);
+    return future;
+}
+
+Internal::StorageQueue *MssfStoragePrivate::ioQueue()
+{
+    QMutexLocker locker(&mutex);
+    if (!queue)
+        queue = new Internal::StorageQueue();
+    return queue;
+}
+
 ProtectedFile* MssfStorage::member(const QString &pathname)
 {
-   return d_ptr->member(pathname);
+   return d_ptr->member(pathname.toUtf8().constData());
 }
 
-ProtectedFile* MssfStoragePrivate::member(const QString &pathname)
+ProtectedFile* MssfStorage::member(const QByteArray &pathname)
 {
-    p_file *file = store->member(pathname.toUtf8().constData());
+    return d_ptr->member(pathname.constData());
+}
+
+ProtectedFile* MssfStorage::member(const char *pathname)
+{
+    return d_ptr->member(pathname);
+}
+
+ProtectedFile* MssfStoragePrivate::member(const char *pathname)
+{
+    MSSFQT_MEASURE(StorageMember);
+    QMutexLocker locker(&mutex);
+    // the handle may be used to write, so do not trust the cached copy afterwards
+    invalidate(pathname);
+    p_file *file = store->member(pathname);
     if (!file)
+    {
+        MSSFQT_MEASURE_RESULT(false);
         return NULL;
-    return new ProtectedFile(new ProtectedFilePrivate(file));
+    }
+
+    ProtectedFilePrivate *filePrivate = new ProtectedFilePrivate(file);
+    filePrivate->ownerPointer = self.toStrongRef();
+    attach(filePrivate);
+    return new ProtectedFile(filePrivate);
+}
+
+//! The deleter of pooled handles, nobody else closes them.
+static void closeHandle(ProtectedFile *file)
+{
+    if (file->isOpen())
+        file->close();
+    delete file;
+}
+
+QSharedPointer<ProtectedFile> MssfStorage::openMember(const QString &pathname, QIODevice::OpenMode mode)
+{
+    return d_ptr->openMember(pathname.toUtf8().constData(), mode);
+}
+
+QSharedPointer<ProtectedFile> MssfStorage::openMember(const QByteArray &pathname, QIODevice::OpenMode mode)
+{
+    return d_ptr->openMember(pathname.constData(), mode);
+}
+
+QSharedPointer<ProtectedFile> MssfStoragePrivate::openMember(const char *pathname, QIODevice::OpenMode mode)
+{
+    MSSFQT_MEASURE(StorageOpenMember);
+    QMutexLocker locker(&mutex);
+    // only looked up, the pool gets a copy of its own
+    QByteArray key = QByteArray::fromRawData(pathname, qstrlen(pathname));
+    QIODevice::OpenMode pooledMode = mode & ~QIODevice::Truncate;
+
+    if (!(mode & QIODevice::Truncate))
+    {
+        PooledHandle *pooled = handles.object(key);
+        // a read-only user can share a writer's handle, but not the other way around
+        if (pooled && pooled->d->isOpenUnlocked()
+                && (pooled->mode == pooledMode || (mode == QIODevice::ReadOnly && (pooled->mode & QIODevice::ReadOnly))))
+        {
+            // the shared handle is about to be written through, as with a new one
+            if (mode & QIODevice::WriteOnly)
+                invalidateData(pathname);
+            return pooled->file;
+        }
+    }
+
+    // the handle may be used to write, so do not trust the cached copy afterwards
+    if (mode & QIODevice::WriteOnly)
+        invalidate(pathname);
+    else
+        handles.remove(key);
+
+    p_file *file = store->member(pathname);
+    if (!file)
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return QSharedPointer<ProtectedFile>();
+    }
+
+    ProtectedFilePrivate *filePrivate = new ProtectedFilePrivate(file);
+    filePrivate->poolOwner = self;
+    attach(filePrivate);
+    QSharedPointer<ProtectedFile> handle(new ProtectedFile(filePrivate), closeHandle);
+    if (!handle->open(mode))
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return QSharedPointer<ProtectedFile>();
+    }
+
+    if (handles.maxCost() > 0)
+    {
+        PooledHandle *pooled = new PooledHandle;
+        pooled->file = handle;
+        pooled->d = filePrivate;
+        pooled->mode = pooledMode;
+        handles.insert(QByteArray(pathname), pooled);
+    }
+    return handle;
+}
+
+void MssfStorage::setHandleLimit(int handles)
+{
+    d_ptr->setHandleLimit(handles);
+}
+
+void MssfStoragePrivate::setHandleLimit(int limit)
+{
+    QMutexLocker locker(&mutex);
+    handles.setMaxCost(qMax(limit, 0));
+}
+
+int MssfStorage::handleLimit() const
+{
+    return d_ptr->handleLimit();
+}
+
+int MssfStoragePrivate::handleLimit() const
+{
+    QMutexLocker locker(&mutex);
+    return handles.maxCost();
 }
 
 bool MssfStorage::statFile(const QString &pathname, struct stat *stbuf)
+{
+    return d_ptr->statFile(pathname.toUtf8().constData(), stbuf);
+}
+
+bool MssfStorage::statFile(const QByteArray &pathname, struct stat *stbuf)
+{
+    return d_ptr->statFile(pathname.constData(), stbuf);
+}
+
+bool MssfStorage::statFile(const char *pathname, struct stat *stbuf)
 {
     return d_ptr->statFile(pathname, stbuf);
 }
 
-bool MssfStoragePrivate::statFile(const QString &pathname, struct stat *stbuf)
+bool MssfStoragePrivate::statFile(const char *pathname, struct stat *stbuf)
+{
+    MSSFQT_MEASURE(StorageStatFile);
+    QMutexLocker locker(&mutex);
+    bool ok = (store->stat_file(pathname, stbuf) == 0);
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
+}
+
+void MssfStorage::setCacheLimit(quint32 bytes)
+{
+    d_ptr->setCacheLimit(bytes);
+}
+
+void MssfStoragePrivate::setCacheLimit(quint32 bytes)
+{
+    QMutexLocker locker(&mutex);
+    if (bytes == 0)
+    {
+        delete cache; cache = NULL;
+        return;
+    }
+
+    if (cache)
+        cache->setLimit(bytes);
+    else
+        cache = new Internal::StorageCache(bytes);
+}
+
+quint32 MssfStorage::cacheLimit() const
+{
+    return d_ptr->cacheLimit();
+}
+
+quint32 MssfStoragePrivate::cacheLimit() const
+{
+    QMutexLocker locker(&mutex);
+    return (cache ? cache->limit() : 0);
+}
+
+MssfStorage::CacheStatistics MssfStorage::cacheStatistics() const
+{
+    return d_ptr->cacheStatistics();
+}
+
+MssfStorage::CacheStatistics MssfStoragePrivate::cacheStatistics() const
+{
+    QMutexLocker locker(&mutex);
+    if (cache)
+        return cache->statistics();
+
+    MssfStorage::CacheStatistics stats;
+    memset(&stats, 0, sizeof(stats));
+    return stats;
+}
+
+void MssfStorage::setDeduplication(bool enabled)
+{
+    d_ptr->setDeduplication(enabled);
+}
+
+void MssfStoragePrivate::setDeduplication(bool enabled)
+{
+    QMutexLocker locker(&mutex);
+    // the members of a signed store are real files, linking them would change what they are
+    if (store->protection() != storage::prot_encrypted)
+        return;
+
+    dedup = enabled;
+    if (!dedup || aliasesLoaded)
+        return;
+
+    // links written earlier must be known before any member is overwritten
+    storage::stringlist list;
+    if (store->get_files(list) > 0)
+    {
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            if (!store->contains_link(list[i]))
+                continue;
+
+            std::string pointsTo;
+            store->read_link(list[i], pointsTo);
+            aliases[QByteArray(pointsTo.c_str())].append(QByteArray(list[i]));
+        }
+        store->release(list);
+    }
+    aliasesLoaded = true;
+}
+
+bool MssfStorage::deduplication() const
+{
+    return d_ptr->deduplication();
+}
+
+bool MssfStoragePrivate::deduplication() const
+{
+    QMutexLocker locker(&mutex);
+    return dedup;
+}
+
+static bool hashTreeChunk(const char *data, qint64 length, void *context)
+{
+    static_cast<Internal::HashTreeBuilder *>(context)->addData(data, length);
+    return true;
+}
+
+bool MssfStorage::buildHashTree(const QString &pathname, int blockSize)
+{
+    return d_ptr->buildHashTree(pathname, blockSize);
+}
+
+bool MssfStoragePrivate::buildHashTree(const QString &pathname, int blockSize)
+{
+    QMutexLocker locker(&mutex);
+    if (store->protection() != storage::prot_signed || blockSize <= 0)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    // hash what the store verifies, not whatever is in the file
+    Internal::HashTreeBuilder builder(blockSize);
+    if (!getFile(pathname, hashTreeChunk, &builder))
+        return false;
+
+    QByteArray root;
+    QByteArray tree = builder.finish(&root);
+    if (!Internal::HashTree::writeFiles(pathname, blockSize, builder.size(), tree, root))
+        return false;
+
+    addFile(Internal::HashTree::rootName(pathname));
+    return true;
+}
+
+Internal::MutableHashTree *MssfStoragePrivate::loadHashTree(const QString &pathname, quint64 size)
+{
+    QByteArray rootName = Internal::HashTree::rootName(pathname).toUtf8();
+    if (protection() != MssfStorage::Signed || !containsFile(rootName.constData()))
+        return NULL;
+
+    // the store checks the root member against its signed index
+    return Internal::MutableHashTree::load(getFile(rootName.constData()), pathname, size);
+}
+
+bool MssfStoragePrivate::unshare(const QByteArray &pathname)
 {
-    return (store->stat_file(pathname.toUtf8().constData(), stbuf) == 0 ? true : false);
+    if (!aliasesLoaded)
+        return true;
+
+    if (store->contains_link(pathname.constData()))
+    {
+        std::string pointsTo;
+        store->read_link(pathname.constData(), pointsTo);
+        QHash<QByteArray, QList<QByteArray> >::iterator it = aliases.find(QByteArray(pointsTo.c_str()));
+        if (it != aliases.end())
+        {
+            it.value().removeAll(pathname);
+            if (it.value().isEmpty())
+                aliases.erase(it);
+        }
+        store->remove_link(pathname.constData());
+        return false;
+    }
+
+    QByteArray digest = digests.remove(pathname);
+    QList<QByteArray> links = aliases.take(pathname);
+    if (links.isEmpty())
+        return true;
+
+    // the first link becomes the member, renaming keeps the encrypted data where it is
+    QByteArray heir = links.takeFirst();
+    store->remove_link(heir.constData());
+    store->rename(pathname.constData(), heir.constData());
+    foreach(const QByteArray &link, links)
+    {
+        store->remove_link(link.constData());
+        store->add_link(link.constData(), heir.constData());
+    }
+
+    if (!links.isEmpty())
+        aliases.insert(heir, links);
+    if (!digest.isEmpty())
+        digests.insert(heir, digest);
+    return false;
+}
+
+void MssfStoragePrivate::renamed(const QByteArray &from, const QByteArray &to)
+{
+    if (!aliasesLoaded)
+        return;
+
+    if (store->contains_link(to.constData()))
+    {
+        std::string pointsTo;
+        store->read_link(to.constData(), pointsTo);
+        QHash<QByteArray, QList<QByteArray> >::iterator it = aliases.find(QByteArray(pointsTo.c_str()));
+        if (it != aliases.end())
+        {
+            int index = it.value().indexOf(from);
+            if (index >= 0)
+                it.value()[index] = to;
+        }
+        return;
+    }
+
+    digests.rename(from, to);
+
+    // links name their target, so they have to follow it
+    QList<QByteArray> links = aliases.take(from);
+    foreach(const QByteArray &link, links)
+    {
+        store->remove_link(link.constData());
+        store->add_link(link.constData(), to.constData());
+    }
+    if (!links.isEmpty())
+        aliases.insert(to, links);
+}
+
+void MssfStoragePrivate::invalidate(const char *pathname)
+{
+    // a link is opened under its own name, so changing its target must drop every handle
+    if (store->nbrof_links() > 0)
+        handles.clear();
+    else
+        handles.remove(QByteArray::fromRawData(pathname, qstrlen(pathname)));
+
+    invalidateData(pathname);
+}
+
+void MssfStoragePrivate::invalidateData(const char *pathname)
+{
+    // changes are rare compared to accounting, just start over
+    statusCache.clear();
+    usageValid = false;
+
+    if (!cache)
+        return;
+
+    // a link is cached under its own name, so changing its target must drop every entry
+    if (store->nbrof_links() > 0)
+        cache->clear();
+    else
+        cache->remove(QByteArray::fromRawData(pathname, qstrlen(pathname)));
+}
+
+void MssfStoragePrivate::memberChanged(const char *pathname)
+{
+    QMutexLocker locker(&mutex);
+    invalidateData(pathname);
+
+    // the contents no longer are what the deduplication index has for them
+    digests.remove(QByteArray::fromRawData(pathname, qstrlen(pathname)));
+}
+
+void MssfStoragePrivate::memberRenamed(const QByteArray &from, const QByteArray &to)
+{
+    QMutexLocker locker(&mutex);
+    invalidateData(from.constData());
+    // a handle of the replaced member is stale, the renamed one is still in use
+    invalidate(to.constData());
+    renamed(from, to);
+}
+
+void MssfStoragePrivate::attach(ProtectedFilePrivate *file)
+{
+    file->storage = this;
+    members.insert(file);
+}
+
+void MssfStoragePrivate::forget(ProtectedFilePrivate *file)
+{
+    QMutexLocker locker(&mutex);
+    members.remove(file);
+}
+
+void MssfStoragePrivate::invalidateCached(const QString &pathname)
+{
+    QMutexLocker locker(&mutex);
+    invalidate(pathname.toUtf8().constData());
+}
+
+QList<MssfStorage::MemberStatus> MssfStorage::statFiles(const QStringList &pathnames)
+{
+    return d_ptr->statFiles(pathnames);
+}
+
+QList<MssfStorage::MemberStatus> MssfStoragePrivate::statFiles(const QStringList &pathnames)
+{
+    MSSFQT_MEASURE(StorageStatFiles);
+    QMutexLocker locker(&mutex);
+    checkIndex();
+    QList<MssfStorage::MemberStatus> result;
+    result.reserve(pathnames.count());
+
+    foreach(const QString &pathname, pathnames)
+        result.append(memberStatus(pathname.toUtf8()));
+
+    return result;
+}
+
+MssfStorage::Usage MssfStorage::usage()
+{
+    return d_ptr->usage();
+}
+
+MssfStorage::Usage MssfStoragePrivate::usage()
+{
+    MSSFQT_MEASURE(StorageUsage);
+    QMutexLocker locker(&mutex);
+    checkIndex();
+    if (usageValid)
+        return usageCache;
+
+    MssfStorage::Usage total;
+    total.files = 0;
+    total.bytes = 0;
+    total.diskBytes = 0;
+
+    storage::stringlist list;
+    if (store->get_files(list) > 0)
+    {
+        // a link shares the contents of its target, deduplicated members are linked
+        QSet<QByteArray> counted;
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            QByteArray member(list[i]);
+            if (store->contains_link(list[i]))
+            {
+                std::string pointsTo;
+                store->read_link(list[i], pointsTo);
+                member = QByteArray(pointsTo.c_str());
+            }
+            if (counted.contains(member))
+                continue;
+            counted.insert(member);
+
+            MssfStorage::MemberStatus status = memberStatus(member);
+            if (!status.exists)
+                continue;
+            total.files++;
+            total.bytes += status.size;
+        }
+        store->release(list);
+    }
+
+    // the actual files are stat'ed directly, they are not members
+    storage::stringlist ulist;
+    if (store->get_ufiles(ulist) > 0)
+    {
+        struct stat st;
+        for (size_t i = 0; i < ulist.size(); i++)
+        {
+            if (::stat(ulist[i], &st) == 0)
+                total.diskBytes += (qint64)st.st_blocks * 512;
+        }
+        store->release(ulist);
+    }
+
+    usageCache = total;
+    usageValid = true;
+    return total;
+}
+
+void MssfStoragePrivate::checkIndex()
+{
+    struct stat st;
+    if (::stat(store->filename(), &st) != 0)
+        memset(&st, 0, sizeof(st));
+
+    // a rewrite replaces the file or at least touches it, another process may have done it
+    if (st.st_ino == indexStatus.st_ino && st.st_size == indexStatus.st_size
+            && st.st_mtim.tv_sec == indexStatus.st_mtim.tv_sec && st.st_mtim.tv_nsec == indexStatus.st_mtim.tv_nsec)
+        return;
+
+    statusCache.clear();
+    usageValid = false;
+    indexStatus = st;
+}
+
+MssfStorage::MemberStatus MssfStoragePrivate::memberStatus(const QByteArray &pathname)
+{
+    QHash<QByteArray, MssfStorage::MemberStatus>::const_iterator it = statusCache.constFind(pathname);
+    if (it != statusCache.constEnd())
+        return it.value();
+
+    MssfStorage::MemberStatus status;
+    struct stat st;
+    if (store->stat_file(pathname.constData(), &st) == 0)
+    {
+        status.size = st.st_size;
+        status.modified = st.st_mtime;
+        status.mode = st.st_mode;
+        status.exists = true;
+    }
+    else
+    {
+        memset(&status, 0, sizeof(status));
+    }
+
+    statusCache.insert(pathname, status);
+    return status;
 }
@@ -32,7 +32,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <QtCore/QFuture>
+#include <QtCore/QIODevice>
+#include <QtCore/QList>
 #include <QtCore/QScopedPointer>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QString>
 
 class QStringList;
@@ -47,6 +51,7 @@ class MssfStoragePrivate;
 class MSSFQTSHARED_EXPORT MssfStorage
 {
     friend class ProtectedFilePrivate;
+    friend class StorageWatcherPrivate;
 
 public:
 
@@ -71,6 +76,70 @@ public:
         Encrypted       /*!< Encrypted - Confidentiality is protected by encryption */
     };
 
+    /*!
+      * \struct Descriptor
+      * \brief Everything that is needed to open a store. \sa MssfStorage::openAll
+      */
+    struct MSSFQTSHARED_EXPORT Descriptor {
+        Descriptor();
+        Descriptor(const QString &name, const QString &owner, MssfStorage::Visibility vis, MssfStorage::Protection prot);
+
+        QString name;               /*!< name       - The name of the storage area. */
+        QString owner;              /*!< owner      - The token that is required to access the store. */
+        Visibility visibility;      /*!< visibility - The visibility of the storage area. */
+        Protection protection;      /*!< protection - The protection of the storage area. */
+    };
+
+    /*!
+      * \struct MemberStatus
+      * \brief The part of a member's status that is needed for accounting. \sa MssfStorage::statFiles
+      */
+    struct MemberStatus {
+        qint64 size;        /*!< size     - The size of the contents in bytes. */
+        time_t modified;    /*!< modified - The time of the last modification. */
+        mode_t mode;        /*!< mode     - The type and permission bits, as in struct stat. */
+        bool exists;        /*!< exists   - false if the member could not be stat'ed, the other fields are then 0. */
+    };
+
+    /*!
+      * \struct Usage
+      * \brief The disk footprint of a store. \sa MssfStorage::usage
+      */
+    struct Usage {
+        int files;          /*!< files     - Number of members that could be stat'ed, links counted as their target. */
+        qint64 bytes;       /*!< bytes     - Total size of the member contents, shared contents counted once. */
+        qint64 diskBytes;   /*!< diskBytes - Disk space allocated for the actual files, including the index file. */
+    };
+
+    /*!
+      * \brief Callback of \ref iterateStorageNames
+      * \param store The store that was found. The owner token is not known and left empty.
+      * \param context The context pointer given to \ref iterateStorageNames
+      * \returns true to continue the iteration, false to stop it.
+      */
+    typedef bool (*StorageVisitor)(const MssfStorage::Descriptor &store, void *context);
+
+    /*!
+      * \brief Callback of the streaming \ref getFile
+      * \param data The next piece of the file contents, only valid during the call.
+      * \param length The number of bytes in data.
+      * \param context The context pointer given to \ref getFile
+      * \returns true to continue reading, false to abort.
+      */
+    typedef bool (*ChunkHandler)(const char *data, qint64 length, void *context);
+
+    /*!
+      * \struct CacheStatistics
+      * \brief Usage counters of the plaintext cache. \sa MssfStorage::setCacheLimit
+      */
+    struct CacheStatistics {
+        quint64 hits;       /*!< hits      - Reads served from the cache. */
+        quint64 misses;     /*!< misses    - Reads that had to go to the store. */
+        quint64 evictions;  /*!< evictions - Entries dropped to stay within the byte budget. */
+        int entries;        /*!< entries   - Number of members currently cached. */
+        quint32 bytes;      /*!< bytes     - Locked memory currently in use. */
+    };
+
     /*!
       * \brief Create a storage object
       * \param name The name of the storage area.
@@ -85,6 +154,61 @@ public:
       */
     ~MssfStorage();
 
+    /*!
+      * \brief Open a store shared with the rest of the process
+      * \param name The name of the storage area.
+      * \param owner The name of the token that is required to access the store.
+      * \param vis The visibility of the storage area. \sa MssfStorage::Visibility
+      * \param prot The Protection that is being used for the storage area. \sa MssfStorage::Protection
+      * \returns A handle to the store, never null.
+      *
+      * All callers that open the same (name, owner, vis, prot) combination while a previous handle
+      * is still alive get the same instance, so the store index is only read once. The store is
+      * closed when the last handle is released. Access to the shared instance is serialised
+      * internally, so it may be used from several threads.
+      *
+      * \ref ProtectedFile::owner of the members of such a store returns the shared handle.
+      */
+    static QSharedPointer<MssfStorage> open(const QString &name, const QString &owner, MssfStorage::Visibility vis, MssfStorage::Protection prot);
+
+    /*!
+      * \brief Open a number of stores concurrently
+      * \param stores The stores to open.
+      * \returns A future that holds one shared handle per descriptor, in the same order.
+      *
+      * The stores are opened with \ref open on the threads of QThreadPool::globalInstance(), so the
+      * call returns immediately and the caller can continue with other work. Connect a
+      * QFutureWatcher to the result to be told about each store as soon as it is ready
+      * (QFutureWatcher::resultReadyAt), or block on QFuture::resultAt when a particular store is
+      * needed.
+      */
+    static QFuture<QSharedPointer<MssfStorage> > openAll(const QList<MssfStorage::Descriptor> &stores);
+
+    /*!
+      * \brief Iterate over the existing stores
+      * \param vis Only report stores of this visibility.
+      * \param prot Only report stores of this protection.
+      * \param pattern An optional wildcard pattern the store names must match, QString() matches all.
+      * \param visitor Called once per matching store, while the iteration is running.
+      * \param context Passed unchanged to the visitor.
+      * \returns The number of stores passed to the visitor, or -1 on error.
+      *
+      * The stores are reported one at a time as they are found, no list of all stores is built.
+      */
+    static int iterateStorageNames(MssfStorage::Visibility vis, MssfStorage::Protection prot, const QString &pattern,
+                                   MssfStorage::StorageVisitor visitor, void *context);
+
+    /*!
+      * \brief Open all matching stores concurrently
+      * \param vis Only open stores of this visibility.
+      * \param prot Only open stores of this protection.
+      * \param pattern An optional wildcard pattern the store names must match, QString() matches all.
+      * \param owner The token used to open every matching store.
+      * \returns A future that holds one shared handle per matching store. \sa openAll
+      */
+    static QFuture<QSharedPointer<MssfStorage> > openMatching(MssfStorage::Visibility vis, MssfStorage::Protection prot,
+                                                             const QString &pattern, const QString &owner);
+
     /*!
       * \brief The storage directory
       *
@@ -164,6 +288,17 @@ public:
       */
     bool containsFile(const QString &pathname);
 
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    bool containsFile(const QByteArray &pathname);
+
+    /*!
+      * \overload
+      */
+    bool containsFile(const char *pathname);
+
     /*!
       * \brief Check if the store contains the given link
       * \param pathname The name of a symbolic link
@@ -175,6 +310,17 @@ public:
       */
     bool containsLink(const QString &pathname);
 
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    bool containsLink(const QByteArray &pathname);
+
+    /*!
+      * \overload
+      */
+    bool containsLink(const char *pathname);
+
     /*!
       * \brief Add a link to an existing file into the store
       * \param pathname The name of the link.
@@ -201,6 +347,40 @@ public:
       */
     bool putFile(const QString &pathname, const QByteArray &data);
 
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    bool putFile(const QByteArray &pathname, const QByteArray &data);
+
+    /*!
+      * \overload
+      */
+    bool putFile(const char *pathname, const QByteArray &data);
+
+    /*!
+      * \overload
+      * \param pathname The name of the file to write.
+      * \param data The data to write, it is not copied.
+      * \param length The number of bytes to write.
+      */
+    bool putFile(const QString &pathname, const char *data, quintptr length);
+
+    /*!
+      * \brief Write a file from a stream. Encrypt if needed.
+      * \param pathname The name of the file to write. If the file does not yet exist in the store, it's added.
+      * \param source An open, readable device. It is read until the end of the data.
+      * \returns true on success, false otherwise.
+      *
+      * The data is passed to the store in fixed size chunks, so the memory used does not depend
+      * on the size of the file. It is written to a temporary member, pathname followed by
+      * ".mssfqt-part", which replaces pathname once the whole stream has been stored. If reading
+      * or writing fails the temporary member is removed and pathname keeps its old contents. For
+      * sequential devices the call blocks until the device is closed
+      * by its peer, and the store cannot be used from other threads in the meantime.
+      */
+    bool putFile(const QString &pathname, QIODevice *source);
+
     /*!
       * \brief Remove a file from the store
       * \param pathname The name of the file
@@ -212,6 +392,29 @@ public:
       */
     void removeFile(const QString &pathname);
 
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    void removeFile(const QByteArray &pathname);
+
+    /*!
+      * \overload
+      */
+    void removeFile(const char *pathname);
+
+    /*!
+      * \brief Remove all files and links matching a mask and commit the store
+      * \param mask The wildcard mask, as for \ref getFiles. An empty mask matches nothing, use
+      * \ref removeAllFiles to clear the whole store.
+      * \returns The number of files and links actually removed, members that could not be removed
+      * are not counted.
+      *
+      * The member list is read and matched once and the index is written once at the end, so this
+      * is much faster than removing the members one by one.
+      */
+    int removeFiles(const QString &mask);
+
     /*!
       * \brief Remove a link from the store
       * \param pathname The name of the link
@@ -229,6 +432,18 @@ public:
       */
     void rename(const QString &pathname, const QString &to);
 
+    /*!
+      * \brief Move every file and link whose name starts with a prefix and commit the store
+      * \param from The prefix to replace, must not be empty.
+      * \param to The new prefix, neither prefix may start with the other.
+      * \returns The number of files and links renamed, -1 with errno set if nothing was renamed
+      * because the prefixes overlap (EINVAL) or a new name is already taken (EEXIST).
+      *
+      * All new names are checked before anything is renamed, so either every matching member is
+      * moved or none. The index is written once at the end.
+      */
+    int renamePrefix(const QString &from, const QString &to);
+
     /*!
       * \brief Get the name of the file a link points to.
       * \param pathname The name of the link.
@@ -249,6 +464,17 @@ public:
       */
     bool verifyFile(const QString &pathname);
 
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    bool verifyFile(const QByteArray &pathname);
+
+    /*!
+      * \overload
+      */
+    bool verifyFile(const char *pathname);
+
     /*!
       * \brief Read an entire file into memory. Verification and decryption are performed automatically.
       * \param pathname The name of the file
@@ -260,6 +486,40 @@ public:
       */
     QByteArray getFile(const QString &pathname);
 
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    QByteArray getFile(const QByteArray &pathname);
+
+    /*!
+      * \overload
+      */
+    QByteArray getFile(const char *pathname);
+
+    /*!
+      * \brief Read a file piece by piece. Verification and decryption are performed automatically.
+      * \param pathname The name of the file
+      * \param handler Called with each consecutive piece of the contents.
+      * \param context Passed unchanged to the handler.
+      * \returns true if the whole file was read and accepted by the handler, false otherwise.
+      *
+      * The file is read in fixed size chunks, so the memory used does not depend on the size of
+      * the file. The member is verified by the store when it is opened, before the first chunk is
+      * passed to the handler.
+      */
+    bool getFile(const QString &pathname, MssfStorage::ChunkHandler handler, void *context);
+
+    /*!
+      * \brief Read a file into a device. Verification and decryption are performed automatically.
+      * \param pathname The name of the file
+      * \param sink An open, writable device that receives the contents.
+      * \returns true if the whole file was written to the sink, false otherwise.
+      *
+      * This is an overloaded method provided for convenience. \sa getFile(const QString &, ChunkHandler, void *)
+      */
+    bool getFile(const QString &pathname, QIODevice *sink);
+
     /*!
       * \brief Check if the content in a buffer matches the hash recorded for a file.
       * \param pathname The name of the file
@@ -268,6 +528,17 @@ public:
       */
     bool verifyContent(const QString &pathname, const QByteArray &data);
 
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    bool verifyContent(const QByteArray &pathname, const QByteArray &data);
+
+    /*!
+      * \overload
+      */
+    bool verifyContent(const char *pathname, const QByteArray &data);
+
     /*!
       * \brief Seal a store
       *
@@ -276,6 +547,39 @@ public:
      */
     void commit();
 
+    /*!
+      * \brief Read an entire file on a worker thread. \sa getFile
+      * \param pathname The name of the file
+      * \returns A future that holds the contents, or an empty QByteArray() on error.
+      *
+      * The asynchronous operations of a store are run in order for each member: a getFileAsync
+      * issued after a putFileAsync of the same member sees the new contents. They take the caller
+      * off the storage I/O, they do not make it faster: every operation holds the lock of the store
+      * while it runs, so operations on different members still run one at a time, as do the
+      * synchronous calls made meanwhile. Synchronous calls are not ordered with the queued
+      * operations, wait for the relevant futures before mixing the two.
+      */
+    QFuture<QByteArray> getFileAsync(const QString &pathname);
+
+    /*!
+      * \brief Write a file on a worker thread. \sa putFile getFileAsync
+      * \param pathname The name of the file to write.
+      * \param data The data to be written and optionally encrypted
+      * \returns A future that holds true on success, false otherwise.
+      *
+      * Runs one at a time with the other operations on the store, \sa getFileAsync
+      */
+    QFuture<bool> putFileAsync(const QString &pathname, const QByteArray &data);
+
+    /*!
+      * \brief Seal a store on a worker thread. \sa commit getFileAsync
+      * \returns A future that finishes when the index has been written.
+      *
+      * The commit waits for all asynchronous operations issued before it, and the ones issued after
+      * it wait for the commit.
+      */
+    QFuture<void> commitAsync();
+
     /*!
       * \brief Create a protected handle to a file in the store
       * \param pathname The name of the file
@@ -291,6 +595,56 @@ public:
       */
     ProtectedFile* member(const QString &pathname);
 
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    ProtectedFile* member(const QByteArray &pathname);
+
+    /*!
+      * \overload
+      */
+    ProtectedFile* member(const char *pathname);
+
+    /*!
+      * \brief Get an open, shared handle to a file in the store
+      * \param pathname The name of the file
+      * \param mode How to open the file, \sa ProtectedFile::open(QIODevice::OpenMode)
+      * \return The handle, null if the file could not be opened, errno is set then.
+      *
+      * Unlike \ref member the handles are kept in a pool, so asking for the same member again
+      * returns the same handle without opening the file again. A read-only request is served by
+      * any pooled handle that can read, a request with QIODevice::Truncate always opens the file.
+      * Handles are dropped from the pool, least recently used first, when there are more than
+      * \ref handleLimit of them, and whenever the member is changed through this object, e.g.
+      * renamed, removed or overwritten. A dropped handle is closed when its last user lets go of
+      * it and stays usable until then.
+      *
+      * The handle is shared by every caller, do not close it. Many threads may read through it at
+      * once, \sa ProtectedFile.
+      */
+    QSharedPointer<ProtectedFile> openMember(const QString &pathname, QIODevice::OpenMode mode = QIODevice::ReadOnly);
+
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    QSharedPointer<ProtectedFile> openMember(const QByteArray &pathname, QIODevice::OpenMode mode = QIODevice::ReadOnly);
+
+    /*!
+      * \brief Limit the number of pooled handles \sa openMember
+      * \param handles The most open handles kept in the pool, 0 disables the pooling.
+      *
+      * Handles in use by callers stay open after they are evicted, so this is a soft limit on the
+      * file descriptors of the store. The default is 32.
+      */
+    void setHandleLimit(int handles);
+
+    /*!
+      * \brief The size of the handle pool \sa setHandleLimit
+      */
+    int handleLimit() const;
+
     /*!
       * \brief Get the status of a member file
       * \param pathname The name of the file
@@ -300,11 +654,93 @@ public:
       */
     bool statFile(const QString &pathname, struct stat *stbuf);
 
-//    static int iterate_storage_names(storage::visibility_t of_visibility,
-//                             storage::protection_t of_protection,
-//                             const char* matching_names,
-//                             mssf_callback* cb_func,
-//                             void* ctx);
+    /*!
+      * \overload
+      * \param pathname The UTF-8 encoded name, used as is without a conversion.
+      */
+    bool statFile(const QByteArray &pathname, struct stat *stbuf);
+
+    /*!
+      * \overload
+      */
+    bool statFile(const char *pathname, struct stat *stbuf);
+
+    /*!
+      * \brief Get the status of several member files at once
+      * \param pathnames The names of the files
+      * \returns One record per name, in the same order.
+      *
+      * The results are cached until the store is next changed through this object or its index
+      * file is rewritten, also by another process, so repeated calls are cheap.
+      */
+    QList<MemberStatus> statFiles(const QStringList &pathnames);
+
+    /*!
+      * \brief Compute the size of the store
+      * \returns The totals over all members and actual files.
+      *
+      * Everything is gathered in one pass over the store and cached like \ref statFiles. A link
+      * is not a member of its own, the contents it shares with its target are counted once.
+      */
+    Usage usage();
+
+    /*!
+      * \brief Enable or resize the plaintext cache of \ref getFile
+      * \param bytes The maximum amount of memory the cache may use, 0 disables the cache.
+      *
+      * Decrypted (or verified) member contents are kept in memory that is locked into RAM and
+      * wiped when the entry is evicted. The least recently used entries are evicted first.
+      * Entries are invalidated by \ref putFile, \ref removeFile, \ref rename,
+      * \ref removeAllFiles and by handing out a \ref member for the file. Changes made to the
+      * store by other processes are not noticed. The cache is disabled by default.
+      */
+    void setCacheLimit(quint32 bytes);
+
+    /*!
+      * \brief The size of the plaintext cache
+      * \returns The byte budget given to \ref setCacheLimit, 0 if the cache is disabled.
+      */
+    quint32 cacheLimit() const;
+
+    /*!
+      * \brief Get the usage counters of the plaintext cache
+      * \returns The statistics, all zero if the cache has never been enabled.
+      */
+    CacheStatistics cacheStatistics() const;
+
+    /*!
+      * \brief Store identical contents only once
+      * \param enabled true to turn the deduplication on.
+      *
+      * When enabled, \ref putFile hashes the data and, if a member written earlier through this
+      * object has the same contents, adds a link to that member instead of encrypting and writing
+      * the data again. The match is confirmed with \ref verifyContent first. Overwriting, removing
+      * or renaming a member that others link to moves the contents to one of the links, so the
+      * other names keep their data.
+      *
+      * Only the contents written during this session are indexed. Members changed through a
+      * \ref member handle are not noticed and must not be mixed with deduplicated writes.
+      * Deduplication only applies to encrypted stores and is disabled by default.
+      */
+    void setDeduplication(bool enabled);
+
+    /*!
+      * \brief Is deduplication enabled \sa setDeduplication
+      */
+    bool deduplication() const;
+
+    /*!
+      * \brief Build the block hash tree of a signed member
+      * \param pathname The name of the member.
+      * \param blockSize The size of the verified blocks.
+      * \returns false if the store is not signed or the member cannot be verified, errno is set.
+      *
+      * The member is verified and hashed into the file pathname.merkle, next to it, and the root
+      * of the tree is added to the store as the member pathname.merkle-root. \ref VerifiedFile
+      * then reads the member without hashing all of it. Build the tree again whenever the member
+      * changes, and commit the store afterwards, as with \ref addFile.
+      */
+    bool buildHashTree(const QString &pathname, int blockSize = 4096);
 
 private:
     /*!
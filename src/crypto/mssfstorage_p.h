@@ -26,6 +26,18 @@
 #ifndef MSSFSTORAGE_P_H
 #define MSSFSTORAGE_P_H
 
+#include "digestindex_p.h"
+
+#include <QtCore/QByteArray>
+#include <QtCore/QCache>
+#include <QtCore/QFuture>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QSet>
+#include <QtCore/QString>
+#include <QtCore/QWeakPointer>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -43,15 +55,25 @@ class storage;
 class QString;
 class QStringList;
 class QByteArray;
+class QIODevice;
 
 namespace MssfQt
 {
 
 class ProtectedFile;
+class ProtectedFilePrivate;
 class MssfStorage;
 
+namespace Internal
+{
+class StorageCache;
+class StorageQueue;
+class MutableHashTree;
+}
+
 class MssfStoragePrivate
 {
+    friend class MssfStorage;
     friend class ProtectedFilePrivate;
 
 public:
@@ -82,45 +104,120 @@ public:
 
     QStringList getUFiles();
 
-    bool containsFile(const QString &pathname);
+    bool containsFile(const char *pathname);
 
-    bool containsLink(const QString &pathname);
+    bool containsLink(const char *pathname);
 
     void addLink(const QString &pathname, const QString &to);
 
     void addFile(const QString &pathname);
 
-    bool putFile(const QString &pathname, const QByteArray &data);
+    bool putFile(const char *pathname, const QByteArray &data);
+
+    bool putFile(const QString &pathname, QIODevice *source);
 
-    void removeFile(const QString &pathname);
+    void removeFile(const char *pathname);
+
+    int removeFiles(const QString &mask);
 
     void removeLink(const QString &pathname);
 
     void rename(const QString &pathname, const QString &to);
 
+    int renamePrefix(const QString &from, const QString &to);
+
     QString readLink(const QString &pathname);
 
-    bool verifyFile(const QString &pathname);
+    bool verifyFile(const char *pathname);
 
-    QByteArray getFile(const QString &pathname);
+    QByteArray getFile(const char *pathname);
 
-    bool verifyContent(const QString &pathname, const QByteArray &data);
+    bool getFile(const QString &pathname, MssfStorage::ChunkHandler handler, void *context);
+
+    bool verifyContent(const char *pathname, const QByteArray &data);
 
     void commit();
 
-    ProtectedFile* member(const QString &pathname);
+    QFuture<QByteArray> getFileAsync(const QString &pathname);
+
+    QFuture<bool> putFileAsync(const QString &pathname, const QByteArray &data);
+
+    QFuture<void> commitAsync();
+
+    ProtectedFile* member(const char *pathname);
+
+    QSharedPointer<ProtectedFile> openMember(const char *pathname, QIODevice::OpenMode mode);
+
+    void setHandleLimit(int handles);
+
+    int handleLimit() const;
+
+    bool statFile(const char *pathname, struct stat *stbuf);
+
+    QList<MssfStorage::MemberStatus> statFiles(const QStringList &pathnames);
+
+    MssfStorage::Usage usage();
+
+    void setCacheLimit(quint32 bytes);
 
-    bool statFile(const QString &pathname, struct stat *stbuf);
+    quint32 cacheLimit() const;
 
-    //    static int iterate_storage_names(storage::visibility_t of_visibility,
-    //                             storage::protection_t of_protection,
-    //                             const char* matching_names,
-    //                             mssf_callback* cb_func,
-    //                             void* ctx);
+    MssfStorage::CacheStatistics cacheStatistics() const;
+
+    void setDeduplication(bool enabled);
+
+    bool deduplication() const;
+
+    bool buildHashTree(const QString &pathname, int blockSize);
+
+    //! The stored tree of a signed member, NULL if there is none matching size.
+    Internal::MutableHashTree *loadHashTree(const QString &pathname, quint64 size);
+
+    QString owner() const;
+
+    void invalidateCached(const QString &pathname);
+
+    //! A handle wrote to, truncated or closed pathname, drop what is cached of it.
+    void memberChanged(const char *pathname);
+
+    //! A handle renamed its member.
+    void memberRenamed(const QByteArray &from, const QByteArray &to);
+
+    static int iterateStorageNames(MssfStorage::Visibility vis, MssfStorage::Protection prot, const QString &pattern,
+                                   MssfStorage::StorageVisitor visitor, void *context);
 
 private:
 
-    //static MssfStorage* createStorage()
+    //! The queue of the asynchronous operations, created on first use.
+    Internal::StorageQueue *ioQueue();
+
+    //! Drop the cached data of a changed member and its pooled handle.
+    void invalidate(const char *pathname);
+
+    //! Drop the cached contents and status of a changed member, its handles stay open.
+    void invalidateData(const char *pathname);
+
+    //! Keep track of a handle created by member() or openMember().
+    void attach(ProtectedFilePrivate *file);
+
+    //! A handle passed to attach() is being deleted.
+    void forget(ProtectedFilePrivate *file);
+
+    //! Drop the status cache if the index file has changed since it was filled, maybe by another process.
+    void checkIndex();
+
+    //! Stat a member through the status cache.
+    MssfStorage::MemberStatus memberStatus(const QByteArray &pathname);
+
+    //! Hand the contents of pathname over to its links before it is replaced or removed.
+    //! \returns false if pathname no longer exists afterwards.
+    bool unshare(const QByteArray &pathname);
+
+    //! Update the deduplication index after the store renamed a member.
+    void renamed(const QByteArray &from, const QByteArray &to);
+
+    //! Serialises all access to the wrapped store, which may be shared between threads.
+    mutable QMutex mutex;
     //! The storage class that is being wrapped.
 #ifdef MAEMO
     MssfStoragePrivate(aegis::storage *store);
@@ -129,6 +226,43 @@ private:
     MssfStoragePrivate(mssf::storage *store);
     mssf::storage *store;
 #endif
+    //! false if the store belongs to somebody else and must not be deleted.
+    bool ownsStore;
+    //! The token the store was opened with, empty if not known.
+    QString ownerName;
+    //! The shared handle if the store was opened with MssfStorage::open(), null otherwise.
+    QWeakPointer<MssfStorage> self;
+    //! Runs the asynchronous operations, NULL until the first one.
+    Internal::StorageQueue *queue;
+    //! Cache of decrypted members, NULL unless enabled.
+    Internal::StorageCache *cache;
+    //! Results of statFiles() and usage() since the last change.
+    QHash<QByteArray, MssfStorage::MemberStatus> statusCache;
+    MssfStorage::Usage usageCache;
+    bool usageValid;
+    //! The status of the index file the caches above were filled against.
+    struct stat indexStatus;
+    //! Link new duplicate contents, see MssfStorage::setDeduplication().
+    bool dedup;
+    //! true once the links of the store have been read into aliases, from then on they are kept up to date.
+    bool aliasesLoaded;
+    //! The contents written through us, to find duplicates.
+    Internal::DigestIndex digests;
+    //! The links pointing to each member.
+    QHash<QByteArray, QList<QByteArray> > aliases;
+
+    //! An open handle in the pool, mode is what it was opened with, less QIODevice::Truncate.
+    struct PooledHandle
+    {
+        QSharedPointer<ProtectedFile> file;
+        //! The private part of file, its lock must not be taken under our mutex.
+        ProtectedFilePrivate *d;
+        QIODevice::OpenMode mode;
+    };
+    //! The handles of openMember() by UTF-8 pathname, least recently used evicted first.
+    QCache<QByteArray, PooledHandle> handles;
+    //! Every live handle of member() and openMember(), they are closed before the store is deleted.
+    QSet<ProtectedFilePrivate *> members;
 };
 
 } //namespace MssfQt
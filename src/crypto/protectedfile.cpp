@@ -28,12 +28,24 @@
 #include "protectedfile_p.h"
 #include "mssfstorage.h"
 #include "mssfstorage_p.h"
+#include "storagemetrics_p.h"
+#include "readahead_p.h"
+#include "hashtree_p.h"
 
 
 #include <QtCore/QByteArray>
 #include <QtCore/QDateTime>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QReadLocker>
+#include <QtCore/QWriteLocker>
+#include <QtCore/QtAlgorithms>
 
 #include <utime.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #ifdef MAEMO
 //use the V1 libraries for maemo
@@ -49,6 +61,226 @@ using namespace mssf;
 
 using namespace MssfQt;
 
+//! Ranges closer than this are read together, reading the gap is cheaper than another read.
+static const quint64 MergeGap = 4 * 1024;
+
+//! The amount read at a time when a chunked digest is computed from scratch.
+static const int ChunkedDigestRead = 64 * 1024;
+
+//! The amount sendTo() reads, checks and writes at a time.
+static const quint64 SendChunk = 64 * 1024;
+
+namespace
+{
+//! Orders extent indexes by the offset of the extent.
+class ExtentOrder
+{
+public:
+    ExtentOrder(const QVector<ProtectedFile::Extent> &extents)
+        : extents(extents)
+    {
+    }
+
+    bool operator()(int a, int b) const
+    {
+        return extents.at(a).offset < extents.at(b).offset;
+    }
+
+private:
+    const QVector<ProtectedFile::Extent> &extents;
+};
+
+//! The indexes of extents sorted by offset.
+QVector<int> sortedExtents(const QVector<ProtectedFile::Extent> &extents)
+{
+    QVector<int> order(extents.count());
+    for (int i = 0; i < order.count(); i++)
+        order[i] = i;
+    qStableSort(order.begin(), order.end(), ExtentOrder(extents));
+    return order;
+}
+
+//! Write all of data to fd. \returns The bytes written, less than len if fd would block, -1 if none could be.
+qint64 writeOut(int fd, const char *data, quint64 len)
+{
+    quint64 done = 0;
+    while (done < len)
+    {
+        ssize_t count = ::write(fd, data + done, len - done);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // e.g. a full non-blocking socket, the caller goes on from where this stopped
+            return (done > 0 ? (qint64)done : -1);
+        }
+        done += count;
+    }
+    return done;
+}
+
+/*!
+  * \class GiftPipe
+  * \brief Moves checked chunks to a descriptor without copying them again.
+  *
+  * Every chunk is read into pages of its own, which are gifted to a pipe with vmsplice() and
+  * spliced on to the descriptor, so the pages that were checked are the ones that go out and
+  * nothing can change them afterwards. Descriptors that cannot be spliced to get the chunks
+  * with write() instead.
+  */
+class GiftPipe
+{
+public:
+    GiftPipe()
+    {
+        if (pipe2(fds, O_CLOEXEC) != 0)
+            fds[0] = fds[1] = -1;
+    }
+
+    ~GiftPipe()
+    {
+        close();
+    }
+
+    //! Pages of their own for a chunk of len bytes, NULL if there is no memory.
+    static char *allocate(quint64 len)
+    {
+        void *pages = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return (pages == MAP_FAILED ? NULL : static_cast<char *>(pages));
+    }
+
+    //! Give up the pages of a chunk, the pipe keeps what it still references.
+    static void release(char *chunk, quint64 len)
+    {
+        munmap(chunk, len);
+    }
+
+    //! Send len bytes of a chunk from \ref allocate, which must not be written to afterwards.
+    //! \returns As writeOut().
+    qint64 send(int fd, char *data, quint64 len)
+    {
+        quint64 done = 0;
+        while (done < len && fds[0] >= 0)
+        {
+            struct iovec iov;
+            iov.iov_base = data + done;
+            iov.iov_len = len - done;
+            ssize_t in = vmsplice(fds[1], &iov, 1, SPLICE_F_GIFT);
+            if (in < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                close();
+                break;
+            }
+
+            ssize_t out = 0;
+            while (out < in)
+            {
+                ssize_t count = splice(fds[0], NULL, fd, NULL, in - out, SPLICE_F_MOVE);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                    break;
+                out += count;
+            }
+            done += out;
+
+            if (out < in)
+            {
+                // what is left in the pipe is dropped with it
+                int error = errno;
+                close();
+                if (error != EINVAL)
+                {
+                    // e.g. a full non-blocking socket, the caller goes on from where this stopped
+                    errno = error;
+                    return (done > 0 ? (qint64)done : -1);
+                }
+            }
+        }
+
+        if (done < len)
+        {
+            qint64 count = writeOut(fd, data + done, len - done);
+            if (count > 0)
+                done += count;
+        }
+        return (done > 0 ? (qint64)done : -1);
+    }
+
+private:
+    void close()
+    {
+        if (fds[0] < 0)
+            return;
+        ::close(fds[0]);
+        ::close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
+
+    int fds[2];
+};
+
+/*!
+  * \brief Send a range of a pinned signed member, checking every block against its tree first.
+  * \returns The bytes sent, -1 if none could be. The data sent has always been verified.
+  */
+qint64 sendVerified(int to, int from, const Internal::MutableHashTree &tree, quint64 offset, quint64 len)
+{
+    quint32 blockSize = tree.blockSize();
+    quint64 size = tree.size();
+    quint64 perRead = qMax<quint64>(blockSize, SendChunk - SendChunk % blockSize);
+    GiftPipe pipe;
+
+    quint64 sent = 0;
+    while (sent < len)
+    {
+        // whole blocks are read, so that they can be checked before any of it goes out
+        quint64 pos = offset + sent;
+        quint64 start = pos - pos % blockSize;
+        quint64 stop = qMin(start + perRead, size);
+        char *chunk = GiftPipe::allocate(perRead);
+        if (!chunk)
+            break;
+        if (pread(from, chunk, stop - start, start) != (ssize_t)(stop - start))
+        {
+            GiftPipe::release(chunk, perRead);
+            errno = EIO;
+            break;
+        }
+
+        bool valid = true;
+        for (quint64 at = start; at < stop && valid; at += blockSize)
+        {
+            quintptr length = qMin<quint64>(blockSize, stop - at);
+            valid = (Internal::HashTree::leafHash(chunk + (at - start), length) == tree.leaf(at / blockSize));
+        }
+        if (!valid)
+        {
+            GiftPipe::release(chunk, perRead);
+            errno = EIO;
+            break;
+        }
+
+        quint64 wanted = qMin(stop, offset + len) - pos;
+        qint64 count = pipe.send(to, chunk + (pos - start), wanted);
+        GiftPipe::release(chunk, perRead);
+        if (count > 0)
+            sent += count;
+        if (count != (qint64)wanted)
+            break;
+    }
+    return (sent > 0 ? (qint64)sent : -1);
+}
+
+//! Reads the changed blocks back for a tracked hash tree.
+qint64 readBlock(quint64 at, char *buf, quintptr len, void *context)
+{
+    return static_cast<ProtectedFilePrivate *>(context)->readBackend(at, buf, len);
+}
+}
+
 ProtectedFile::ProtectedFile(ProtectedFilePrivate *other)
     : d_ptr(other)
 {
@@ -56,7 +288,13 @@ ProtectedFile::ProtectedFile(ProtectedFilePrivate *other)
 
 ProtectedFilePrivate::ProtectedFilePrivate(p_file *file)
     : file(file),
-      ownerPointer(NULL)
+      storage(NULL),
+      writable(false),
+      ownerPointer(NULL),
+      hashTree(NULL),
+      hashTreeStored(false),
+      coalesceBlock(0),
+      pendingStart(0)
 {
 }
 
@@ -66,7 +304,37 @@ ProtectedFile::~ProtectedFile()
 
 ProtectedFilePrivate::~ProtectedFilePrivate()
 {
+    // the worker may still be reading from the file
+    readAhead.clear();
+    if (file && file->is_open())
+        flushPending();
+    delete hashTree; hashTree = NULL;
     delete file; file = NULL;
+    if (storage)
+        storage->forget(this);
+}
+
+void ProtectedFilePrivate::detach()
+{
+    close();
+
+    // the backend handle refers to its store, it cannot be kept either
+    QWriteLocker locker(&lock);
+    delete file; file = NULL;
+    storage = NULL;
+}
+
+QMutex *ProtectedFilePrivate::storeMutex() const
+{
+    return (storage ? &storage->mutex : NULL);
+}
+
+bool ProtectedFilePrivate::detached() const
+{
+    if (file)
+        return false;
+    errno = EBADF;
+    return true;
 }
 
 bool ProtectedFile::open(QFile::Permissions flags)
@@ -76,6 +344,7 @@ bool ProtectedFile::open(QFile::Permissions flags)
 
 bool ProtectedFilePrivate::open(QFile::Permissions flags)
 {
+    MSSFQT_MEASURE(FileOpen);
     //make the owner the same as user
     if (flags.testFlag(QFile::ReadOwner))
         flags |= QFile::ReadUser;
@@ -84,7 +353,63 @@ bool ProtectedFilePrivate::open(QFile::Permissions flags)
     if (flags.testFlag(QFile::ExeOwner))
         flags |= QFile::ExeUser;
 
-    return file->p_open(flags);
+    dropPrefetched();
+    QWriteLocker locker(&lock);
+    if (detached())
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return false;
+    }
+    if (file->is_open())
+        flushPending();
+    pending.clear();
+    delete hashTree; hashTree = NULL;
+    QMutexLocker storeLocker(storeMutex());
+    bool ok = file->p_open(flags);
+    writable = (ok && flags.testFlag(QFile::WriteUser));
+    if (writable)
+        changed();
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
+}
+
+bool ProtectedFile::open(QIODevice::OpenMode mode)
+{
+    return d_ptr->open(mode);
+}
+
+bool ProtectedFilePrivate::open(QIODevice::OpenMode mode)
+{
+    MSSFQT_MEASURE(FileOpen);
+    int flags = O_RDONLY;
+    if ((mode & QIODevice::ReadWrite) == QIODevice::ReadWrite)
+        flags = O_RDWR | O_CREAT;
+    else if (mode & QIODevice::WriteOnly)
+        flags = O_WRONLY | O_CREAT;
+
+    if (mode & QIODevice::Truncate)
+        flags |= O_TRUNC;
+    if (mode & QIODevice::Append)
+        flags |= O_APPEND;
+
+    dropPrefetched();
+    QWriteLocker locker(&lock);
+    if (detached())
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return false;
+    }
+    if (file->is_open())
+        flushPending();
+    pending.clear();
+    delete hashTree; hashTree = NULL;
+    QMutexLocker storeLocker(storeMutex());
+    bool ok = file->p_open(flags);
+    writable = (ok && (flags & (O_WRONLY | O_RDWR)));
+    if (writable)
+        changed();
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 QByteArray ProtectedFile::read(quint64 at, quintptr len)
@@ -94,19 +419,452 @@ QByteArray ProtectedFile::read(quint64 at, quintptr len)
 
 QByteArray ProtectedFilePrivate::read(quint64 at, quintptr len)
 {
-    QByteArray bytes(len, 0);
-    file->p_read(at, bytes.data(), len);
+    QByteArray bytes;
+    read(at, len, bytes);
     return bytes;
 }
 
+qint64 ProtectedFile::readInto(quint64 at, char *buf, quintptr len)
+{
+    return d_ptr->readInto(at, buf, len);
+}
+
+qint64 ProtectedFilePrivate::readInto(quint64 at, char *buf, quintptr len)
+{
+    QSharedPointer<Internal::ReadAhead> prefetcher = readAheadFor();
+    if (prefetcher)
+        return prefetcher->read(at, buf, len);
+    return readFile(at, buf, len);
+}
+
+qint64 ProtectedFilePrivate::readFile(quint64 at, char *buf, quintptr len)
+{
+    flushBeforeRead();
+    QReadLocker locker(&lock);
+    return readBackend(at, buf, len);
+}
+
+qint64 ProtectedFilePrivate::readBackend(quint64 at, char *buf, quintptr len)
+{
+    MSSFQT_MEASURE(FileRead);
+    if (detached())
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return -1;
+    }
+    ssize_t count = file->p_read(at, buf, len);
+    MSSFQT_MEASURE_BYTES(count);
+    MSSFQT_MEASURE_RESULT(count >= 0);
+    return count;
+}
+
+qint64 ProtectedFile::read(quint64 at, quintptr len, QByteArray &out)
+{
+    return d_ptr->read(at, len, out);
+}
+
+qint64 ProtectedFilePrivate::read(quint64 at, quintptr len, QByteArray &out)
+{
+    // a reserved capacity is not given back when the array shrinks
+    out.reserve(qMax((int)len, out.capacity()));
+    out.resize(len);
+
+    qint64 count = readInto(at, out.data(), len);
+    out.resize(count > 0 ? count : 0);
+    return count;
+}
+
 qptrdiff ProtectedFile::write(quint64 at, QByteArray &data)
 {
-    return d_ptr->write(at, data);
+    return d_ptr->write(at, data.constData(), data.size());
+}
+
+qptrdiff ProtectedFile::write(quint64 at, const QByteArray &data)
+{
+    return d_ptr->write(at, data.constData(), data.size());
+}
+
+qptrdiff ProtectedFile::write(quint64 at, const char *data, quintptr len)
+{
+    return d_ptr->write(at, data, len);
+}
+
+qptrdiff ProtectedFilePrivate::write(quint64 at, const char *data, quintptr len)
+{
+    qptrdiff count;
+    {
+        QWriteLocker locker(&lock);
+        count = (coalesceBlock > 0 ? coalesce(at, data, len) : writeBackend(at, data, len));
+    }
+
+    // drop what was prefetched before the write, the lock kept the worker out during it
+    dropPrefetched();
+    return count;
+}
+
+qptrdiff ProtectedFilePrivate::writeBackend(quint64 at, const char *data, quintptr len)
+{
+    MSSFQT_MEASURE(FileWrite);
+    if (detached())
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return -1;
+    }
+    QMutexLocker storeLocker(storeMutex());
+    qptrdiff count = file->p_write(at, (void *)data, len);
+    touched(at, count);
+    changed();
+    MSSFQT_MEASURE_BYTES(count);
+    MSSFQT_MEASURE_RESULT(count >= 0);
+    return count;
+}
+
+qptrdiff ProtectedFilePrivate::coalesce(quint64 at, const char *data, quintptr len)
+{
+    // only a write that continues the pending one is merged with it
+    if (!pending.isEmpty() && at != pendingStart + pending.size())
+    {
+        if (!flushPending())
+            return -1;
+    }
+    if (pending.isEmpty())
+        pendingStart = at;
+
+    quint64 end = at + len;
+    quint64 aligned = end - end % coalesceBlock;
+    if (aligned <= pendingStart)
+    {
+        pending.append(data, len);
+        return len;
+    }
+
+    // at least one block is complete, hand everything up to the last boundary to the backend
+    quintptr now = aligned - at;
+    if (pending.isEmpty())
+    {
+        if (writeBackend(at, data, now) != (qptrdiff)now)
+            return -1;
+    }
+    else
+    {
+        int held = pending.size();
+        pending.append(data, now);
+        qptrdiff count = writeBackend(pendingStart, pending.constData(), pending.size());
+        if (count != pending.size())
+        {
+            // this write failed as a whole, but what was accepted earlier must not get lost
+            qptrdiff written = qMax<qptrdiff>(count, 0);
+            pending = (written < held ? pending.mid(written, held - written) : QByteArray());
+            pendingStart += written;
+            return -1;
+        }
+    }
+
+    pending = QByteArray(data + (aligned - at), end - aligned);
+    pendingStart = aligned;
+    return len;
+}
+
+bool ProtectedFilePrivate::flushPending()
+{
+    if (pending.isEmpty())
+        return true;
+
+    qptrdiff count = writeBackend(pendingStart, pending.constData(), pending.size());
+    if (count == pending.size())
+    {
+        pending.clear();
+        return true;
+    }
+
+    // keep what did not reach the file for the next flush, a short write means the disk is full
+    if (count >= 0)
+    {
+        pending.remove(0, count);
+        pendingStart += count;
+        errno = ENOSPC;
+    }
+    return false;
+}
+
+void ProtectedFilePrivate::flushBeforeRead()
+{
+    {
+        QReadLocker locker(&lock);
+        if (pending.isEmpty())
+            return;
+    }
+
+    // the coalesced data must reach the file before it can be read back
+    QWriteLocker locker(&lock);
+    flushPending();
+}
+
+bool ProtectedFile::flush()
+{
+    return d_ptr->flush();
+}
+
+bool ProtectedFilePrivate::flush()
+{
+    QWriteLocker locker(&lock);
+    return flushPending();
 }
 
-qptrdiff ProtectedFilePrivate::write(quint64 at, QByteArray &data)
+void ProtectedFile::setWriteCoalescing(int blockSize)
 {
-    return file->p_write(at, (void *)data.constData(), data.length());
+    d_ptr->setWriteCoalescing(blockSize);
+}
+
+void ProtectedFilePrivate::setWriteCoalescing(int blockSize)
+{
+    QWriteLocker locker(&lock);
+    flushPending();
+    coalesceBlock = qMax(blockSize, 0);
+}
+
+int ProtectedFile::writeCoalescing() const
+{
+    return d_ptr->writeCoalescing();
+}
+
+int ProtectedFilePrivate::writeCoalescing() const
+{
+    QReadLocker locker(&lock);
+    return coalesceBlock;
+}
+
+qint64 ProtectedFile::readv(QVector<ProtectedFile::Extent> &extents)
+{
+    return d_ptr->readv(extents);
+}
+
+qint64 ProtectedFilePrivate::readv(QVector<ProtectedFile::Extent> &extents)
+{
+    QVector<int> order = sortedExtents(extents);
+    QByteArray span;
+    qint64 total = 0;
+    bool failed = false;
+
+    int first = 0;
+    while (first < order.count())
+    {
+        // grow the span while the next range starts in it or close after it
+        const ProtectedFile::Extent &start = extents.at(order.at(first));
+        quint64 spanStart = start.offset;
+        quint64 spanEnd = start.offset + start.length;
+        int last = first;
+        while (last + 1 < order.count() && extents.at(order.at(last + 1)).offset <= spanEnd + MergeGap)
+        {
+            last++;
+            const ProtectedFile::Extent &next = extents.at(order.at(last));
+            spanEnd = qMax(spanEnd, next.offset + next.length);
+        }
+
+        if (first == last)
+        {
+            // nothing to share, read straight into the caller's memory
+            ProtectedFile::Extent &only = extents[order.at(first)];
+            only.transferred = readInto(only.offset, only.data, only.length);
+            if (only.transferred < 0)
+                failed = true;
+            else
+                total += only.transferred;
+            first++;
+            continue;
+        }
+
+        qint64 count = read(spanStart, spanEnd - spanStart, span);
+        for (int i = first; i <= last; i++)
+        {
+            ProtectedFile::Extent &extent = extents[order.at(i)];
+            if (count < 0)
+            {
+                extent.transferred = -1;
+                continue;
+            }
+
+            // the span may have ended early at the end of the file
+            qint64 from = extent.offset - spanStart;
+            qint64 available = qBound((qint64)0, count - from, (qint64)extent.length);
+            if (available > 0)
+                memcpy(extent.data, span.constData() + from, available);
+            extent.transferred = available;
+            total += available;
+        }
+        if (count < 0)
+            failed = true;
+        first = last + 1;
+    }
+
+    return (failed ? -1 : total);
+}
+
+qint64 ProtectedFile::sendTo(int fd, quint64 offset, quint64 len)
+{
+    return d_ptr->sendTo(fd, offset, len);
+}
+
+qint64 ProtectedFilePrivate::sendTo(int fd, quint64 offset, quint64 len)
+{
+    MSSFQT_MEASURE(FileSendTo);
+    flushBeforeRead();
+    QReadLocker locker(&lock);
+    if (detached())
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return -1;
+    }
+    if (storage->protection() != MssfStorage::Signed)
+    {
+        errno = EINVAL;
+        MSSFQT_MEASURE_RESULT(false);
+        return -1;
+    }
+
+    // status() would take the lock again
+    struct stat st;
+    bool ok;
+    {
+        QMutexLocker storeLocker(storeMutex());
+        ok = (file->p_stat(&st) == 0);
+    }
+    if (!ok)
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return -1;
+    }
+    quint64 size = st.st_size;
+    if (offset >= size || len == 0)
+        return 0;
+    len = qMin(len, size - offset);
+
+    QString pathname = name();
+    QScopedPointer<Internal::MutableHashTree> tree(storage->loadHashTree(pathname, size));
+    qint64 sent = -1;
+    if (!tree)
+    {
+        sent = sendRead(fd, offset, len);
+    }
+    else
+    {
+        // from here on only the descriptor is used, whatever the name points to later
+        int pinned = ::open(QFile::encodeName(pathname).constData(), O_RDONLY | O_CLOEXEC);
+        if (pinned >= 0)
+        {
+            // the tree only fits the file it was loaded for
+            if (fstat(pinned, &st) == 0 && (quint64)st.st_size == size)
+                sent = sendVerified(fd, pinned, *tree, offset, len);
+            else
+                errno = EIO;
+
+            int saved = errno;
+            ::close(pinned);
+            errno = saved;
+        }
+    }
+
+    MSSFQT_MEASURE_BYTES(sent);
+    MSSFQT_MEASURE_RESULT(sent >= 0);
+    return sent;
+}
+
+qint64 ProtectedFilePrivate::sendRead(int fd, quint64 offset, quint64 len)
+{
+    GiftPipe pipe;
+    quint64 sent = 0;
+    while (sent < len)
+    {
+        char *chunk = GiftPipe::allocate(SendChunk);
+        if (!chunk)
+            break;
+        qint64 count = readBackend(offset + sent, chunk, qMin(len - sent, SendChunk));
+        qint64 written = (count > 0 ? pipe.send(fd, chunk, count) : 0);
+        GiftPipe::release(chunk, SendChunk);
+        if (count <= 0)
+            break;
+
+        if (written > 0)
+            sent += written;
+        if (written != count)
+            break;
+    }
+    return (sent > 0 ? (qint64)sent : -1);
+}
+
+qint64 ProtectedFile::writev(QVector<ProtectedFile::Extent> &extents)
+{
+    return d_ptr->writev(extents);
+}
+
+qint64 ProtectedFilePrivate::writev(QVector<ProtectedFile::Extent> &extents)
+{
+    QVector<int> order = sortedExtents(extents);
+    for (int i = 0; i < extents.count(); i++)
+        extents[i].transferred = -1;
+
+    for (int i = 1; i < order.count(); i++)
+    {
+        const ProtectedFile::Extent &previous = extents.at(order.at(i - 1));
+        if (previous.offset + previous.length > extents.at(order.at(i)).offset)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    QWriteLocker locker(&lock);
+    if (!flushPending())
+        return -1;
+
+    QByteArray span;
+    qint64 total = 0;
+    bool failed = false;
+
+    int first = 0;
+    while (first < order.count())
+    {
+        const ProtectedFile::Extent &start = extents.at(order.at(first));
+        quint64 spanEnd = start.offset + start.length;
+        int last = first;
+        while (last + 1 < order.count() && extents.at(order.at(last + 1)).offset == spanEnd)
+        {
+            last++;
+            spanEnd += extents.at(order.at(last)).length;
+        }
+
+        const char *source = start.data;
+        if (first != last)
+        {
+            span.resize(0);
+            for (int i = first; i <= last; i++)
+                span.append(extents.at(order.at(i)).data, extents.at(order.at(i)).length);
+            source = span.constData();
+        }
+
+        qint64 count = writeBackend(start.offset, source, spanEnd - start.offset);
+
+        // hand the written bytes back to the ranges in file order
+        qint64 remaining = count;
+        for (int i = first; i <= last; i++)
+        {
+            ProtectedFile::Extent &extent = extents[order.at(i)];
+            if (count < 0)
+                continue;
+            extent.transferred = qMin(remaining, (qint64)extent.length);
+            remaining -= extent.transferred;
+        }
+
+        if (count < 0)
+            failed = true;
+        else
+            total += count;
+        first = last + 1;
+    }
+
+    locker.unlock();
+    dropPrefetched();
+    return (failed ? -1 : total);
 }
 
 bool ProtectedFile::trunc(quint64 at)
@@ -116,17 +874,103 @@ bool ProtectedFile::trunc(quint64 at)
 
 bool ProtectedFilePrivate::trunc(quint64 at)
 {
-    return (file->p_trunc(at) == 0 ? true : false);
+    bool ok;
+    {
+        MSSFQT_MEASURE(FileTrunc);
+        QWriteLocker locker(&lock);
+        QMutexLocker storeLocker(storeMutex());
+        ok = (flushPending() && !detached() && file->p_trunc(at) == 0);
+        if (ok && hashTree)
+            hashTree->touch(at, 0, at);
+        if (ok)
+            changed();
+        MSSFQT_MEASURE_RESULT(ok);
+    }
+
+    dropPrefetched();
+    return ok;
 }
 
-void ProtectedFile::close()
+bool ProtectedFile::close()
 {
-    d_ptr->close();
+    return d_ptr->close();
 }
 
-void ProtectedFilePrivate::close()
+bool ProtectedFilePrivate::close()
 {
+    MSSFQT_MEASURE(FileClose);
+    dropPrefetched();
+
+    QWriteLocker locker(&lock);
+    if (detached())
+        return false;
+    bool ok = (!file->is_open() || flushPending());
+    int error = errno;
+    pending.clear();
+
+    // the changed blocks can only be read back while the file is open
+    bool writeTree = false;
+    if (hashTree && hashTree->isDirty() && file->is_open())
+    {
+        if (hashTree->update(readBlock, this))
+        {
+            writeTree = hashTreeStored;
+        }
+        else
+        {
+            delete hashTree; hashTree = NULL;
+        }
+    }
+
+    // closing records the new hash and size of a written file in the index of the store
+    QMutexLocker storeLocker(storeMutex());
+    bool wasWritable = (writable && file->is_open());
     file->p_close();
+    writable = false;
+    if (wasWritable)
+        changed();
+    storeLocker.unlock();
+
+    if (writeTree && storage)
+    {
+        QString pathname = name();
+        if (Internal::HashTree::writeFiles(pathname, hashTree->blockSize(), hashTree->size(), hashTree->tree(), hashTree->root()))
+            storage->addFile(Internal::HashTree::rootName(pathname));
+    }
+
+    errno = error;
+    return ok;
+}
+
+void ProtectedFile::setReadAhead(quintptr maxBytes)
+{
+    d_ptr->setReadAhead(maxBytes);
+}
+
+void ProtectedFilePrivate::setReadAhead(quintptr maxBytes)
+{
+    QSharedPointer<Internal::ReadAhead> previous;
+    {
+        QWriteLocker locker(&lock);
+        previous = readAhead;
+        readAhead.clear();
+        if (maxBytes > 0)
+            readAhead = QSharedPointer<Internal::ReadAhead>(new Internal::ReadAhead(this, maxBytes));
+    }
+
+    // its worker may wait for the lock, it is stopped once a reader still using it is done
+    previous.clear();
+}
+
+quintptr ProtectedFile::readAheadLimit() const
+{
+    return d_ptr->readAheadLimit();
+}
+
+quintptr ProtectedFilePrivate::readAheadLimit() const
+{
+    QReadLocker locker(&lock);
+    return (readAhead ? readAhead->limit() : 0);
 }
 
 bool ProtectedFile::isOpen()
@@ -136,7 +980,13 @@ bool ProtectedFile::isOpen()
 
 bool ProtectedFilePrivate::isOpen()
 {
-    return file->is_open();
+    QReadLocker locker(&lock);
+    return (file && file->is_open());
+}
+
+bool ProtectedFilePrivate::isOpenUnlocked() const
+{
+    return (file && file->is_open());
 }
 
 bool ProtectedFile::status(struct stat *st)
@@ -146,7 +996,13 @@ bool ProtectedFile::status(struct stat *st)
 
 bool ProtectedFilePrivate::status(struct stat *st)
 {
-    return (file->p_stat(st) == 0 ? true : false);
+    MSSFQT_MEASURE(FileStatus);
+    flushBeforeRead();
+    QReadLocker locker(&lock);
+    QMutexLocker storeLocker(storeMutex());
+    bool ok = (!detached() && file->p_stat(st) == 0);
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 QByteArray ProtectedFile::digest()
@@ -156,9 +1012,117 @@ QByteArray ProtectedFile::digest()
 
 QByteArray ProtectedFilePrivate::digest()
 {
+    MSSFQT_MEASURE(FileDigest);
+    flushBeforeRead();
+    QReadLocker locker(&lock);
+    if (detached())
+        return QByteArray();
     return QByteArray(file->digest());
 }
 
+bool ProtectedFile::trackChunkedDigest(int blockSize)
+{
+    return d_ptr->trackChunkedDigest(blockSize);
+}
+
+bool ProtectedFilePrivate::trackChunkedDigest(int blockSize)
+{
+    QWriteLocker locker(&lock);
+    flushPending();
+    delete hashTree; hashTree = NULL;
+    hashTreeStored = false;
+    if (blockSize <= 0)
+        return true;
+
+    struct stat st;
+    if (detached())
+        return false;
+    if (!file->is_open())
+    {
+        errno = EBADF;
+        return false;
+    }
+    if (file->p_stat(&st) != 0)
+        return false;
+
+    if (loadHashTree(blockSize, st.st_size))
+        return true;
+
+    Internal::HashTreeBuilder builder(blockSize);
+    QByteArray chunk(ChunkedDigestRead, 0);
+    forever
+    {
+        qint64 count = readBackend(builder.size(), chunk.data(), chunk.size());
+        if (count < 0)
+            return false;
+        builder.addData(chunk.constData(), count);
+        if (count < chunk.size())
+            break;
+    }
+
+    QByteArray root;
+    QByteArray leaves = builder.finish(&root);
+    leaves.truncate(Internal::HashTree::levelCounts(builder.size(), blockSize).first() * Internal::HashTree::DigestSize);
+    hashTree = new Internal::MutableHashTree(blockSize, builder.size(), leaves);
+    return true;
+}
+
+bool ProtectedFilePrivate::loadHashTree(quint32 blockSize, quint64 size)
+{
+    QScopedPointer<Internal::MutableHashTree> loaded(storage->loadHashTree(name(), size));
+    if (!loaded || loaded->blockSize() != blockSize)
+        return false;
+
+    hashTree = loaded.take();
+    hashTreeStored = true;
+    return true;
+}
+
+QByteArray ProtectedFile::chunkedDigest()
+{
+    return d_ptr->chunkedDigest();
+}
+
+QByteArray ProtectedFilePrivate::chunkedDigest()
+{
+    QWriteLocker locker(&lock);
+    if (!hashTree)
+        return QByteArray();
+
+    flushPending();
+    if (hashTree->isDirty())
+    {
+        if (!file || !file->is_open() || !hashTree->update(readBlock, this))
+            return QByteArray();
+    }
+    return hashTree->root();
+}
+
+QSharedPointer<Internal::ReadAhead> ProtectedFilePrivate::readAheadFor()
+{
+    QReadLocker locker(&lock);
+    return readAhead;
+}
+
+void ProtectedFilePrivate::dropPrefetched()
+{
+    QSharedPointer<Internal::ReadAhead> prefetcher = readAheadFor();
+    if (prefetcher)
+        prefetcher->invalidate();
+}
+
+void ProtectedFilePrivate::changed()
+{
+    if (storage)
+        storage->memberChanged(file->name());
+}
+
+void ProtectedFilePrivate::touched(quint64 at, qint64 count)
+{
+    if (hashTree && count > 0)
+        hashTree->touch(at, count, qMax<quint64>(hashTree->size(), at + count));
+}
+
 QString ProtectedFile::name()
 {
     return d_ptr->name();
@@ -166,6 +1130,8 @@ QString ProtectedFile::name()
 
 QString ProtectedFilePrivate::name()
 {
+    if (detached())
+        return QString();
     return QLatin1String(file->name());
 }
 
@@ -176,7 +1142,18 @@ QSharedPointer<MssfStorage> ProtectedFile::owner()
 
 QSharedPointer<MssfStorage> ProtectedFilePrivate::owner()
 {
+    // called by concurrent readers, which only hold the lock for reading
+    QMutexLocker locker(&ownerMutex);
+
+    // members of a store from MssfStorage::open() already know their owner, for the others
+    // wrap the backend store without taking ownership of it
     if (!ownerPointer)
+    {
+        QSharedPointer<MssfStorage> pool = poolOwner.toStrongRef();
+        if (pool)
+            return pool;
+    }
+    if (!ownerPointer && storage)
         ownerPointer = QSharedPointer<MssfStorage>(new MssfStorage(new MssfStoragePrivate(file->owner())));
     return ownerPointer;
 }
@@ -188,7 +1165,22 @@ bool ProtectedFile::rename(QString newName)
 
 bool ProtectedFilePrivate::rename(QString newName)
 {
-    return (file->p_rename(newName.toUtf8().constData()) == 0 ? true : false);
+    MSSFQT_MEASURE(FileRename);
+    QWriteLocker locker(&lock);
+    if (detached())
+    {
+        MSSFQT_MEASURE_RESULT(false);
+        return false;
+    }
+
+    QByteArray from(file->name());
+    QByteArray to = newName.toUtf8();
+    QMutexLocker storeLocker(storeMutex());
+    bool ok = (file->p_rename(to.constData()) == 0);
+    if (ok && storage)
+        storage->memberRenamed(from, to);
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 bool ProtectedFile::chmod(QFile::Permissions flags)
@@ -198,6 +1190,7 @@ bool ProtectedFile::chmod(QFile::Permissions flags)
 
 bool ProtectedFilePrivate::chmod(QFile::Permissions flags)
 {
+    MSSFQT_MEASURE(FileChmod);
     //make the owner the same as user
     if (flags.testFlag(QFile::ReadOwner))
         flags |= QFile::ReadUser;
@@ -206,7 +1199,13 @@ bool ProtectedFilePrivate::chmod(QFile::Permissions flags)
     if (flags.testFlag(QFile::ExeOwner))
         flags |= QFile::ExeUser;
 
-    return (file->p_chmod(flags) == 0 ? true : false);
+    QWriteLocker locker(&lock);
+    QMutexLocker storeLocker(storeMutex());
+    bool ok = (!detached() && file->p_chmod(flags) == 0);
+    if (ok)
+        changed();
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 bool ProtectedFile::chown(uid_t uid, gid_t gid)
@@ -216,7 +1215,14 @@ bool ProtectedFile::chown(uid_t uid, gid_t gid)
 
 bool ProtectedFilePrivate::chown(uid_t uid, gid_t gid)
 {
-    return (file->p_chown(uid, gid) == 0 ? true : false);
+    MSSFQT_MEASURE(FileChown);
+    QWriteLocker locker(&lock);
+    QMutexLocker storeLocker(storeMutex());
+    bool ok = (!detached() && file->p_chown(uid, gid) == 0);
+    if (ok)
+        changed();
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
 
 bool ProtectedFile::utime(const QDateTime &accessTime, const QDateTime &modifiedTime)
@@ -226,8 +1232,15 @@ bool ProtectedFile::utime(const QDateTime &accessTime, const QDateTime &modified
 
 bool ProtectedFilePrivate::utime(const QDateTime &accessTime, const QDateTime &modifiedTime)
 {
+    MSSFQT_MEASURE(FileUtime);
+    QWriteLocker locker(&lock);
     struct utimbuf bufTime;
     bufTime.actime = accessTime.toTime_t();
     bufTime.modtime = modifiedTime.toTime_t();
-    return (file->p_utime(&bufTime) == 0 ? true : false);
+    QMutexLocker storeLocker(storeMutex());
+    bool ok = (!detached() && file->p_utime(&bufTime) == 0);
+    if (ok)
+        changed();
+    MSSFQT_MEASURE_RESULT(ok);
+    return ok;
 }
@@ -31,6 +31,7 @@
 #include <QtCore/QFile>
 #include <QtCore/QSharedPointer>
 #include <QtCore/QScopedPointer>
+#include <QtCore/QVector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -45,12 +46,39 @@ class MssfStorage;
 class MssfStoragePrivate;
 class ProtectedFilePrivate;
 
+/*!
+  * \class ProtectedFile
+  * \brief A handle to a member of a store, created by \ref MssfStorage::member.
+  *
+  * Reads are positional and do not share a cursor, so any number of threads may read through
+  * one handle at the same time. Writes, trunc, open, close and the calls that change the
+  * attributes of the file wait for the reads in progress and run alone.
+  *
+  * The backend calls that may change the index of the store, open, write, trunc, close, rename
+  * and the attribute changes, also take the lock of the store, so a handle may be used while other
+  * threads use its store. Reads only use what the backend set up when the file was opened and do
+  * not wait for the store.
+  *
+  * A handle may outlive its store. It is closed when the store is deleted, and every call fails
+  * with errno EBADF from then on.
+  */
 class MSSFQTSHARED_EXPORT ProtectedFile
 {
     friend class MssfStoragePrivate;
 
 public:
 
+    /*!
+      * \struct Extent
+      * \brief A range of the file and the memory it is read into or written from. \sa readv, writev
+      */
+    struct Extent {
+        quint64 offset;         /*!< offset      - Where the range starts in the file. */
+        quintptr length;        /*!< length      - The size of the range. */
+        char *data;             /*!< data        - The memory, at least length bytes. */
+        qint64 transferred;     /*!< transferred - (out) The bytes read or written, -1 on error. */
+    };
+
     /*!
       * \brief Destructor
       */
@@ -68,6 +96,17 @@ public:
       */
     bool open(QFile::Permissions flags);
 
+    /*!
+      * \brief Open file
+      * \param mode How the file is to be accessed. ReadOnly, WriteOnly, ReadWrite, Truncate and
+      * Append are supported, the file is created if it is opened for writing.
+      * \returns true if the file could be opened/created
+      *
+      * This is an overloaded method provided for convenience, the mode is translated into the
+      * open(2) flags that the protected storage understands. \sa open(QFile::Permissions)
+      */
+    bool open(QIODevice::OpenMode mode);
+
     /*!
       * \brief Read data from a file
       * \param at The offset from which to read
@@ -76,6 +115,92 @@ public:
       */
     QByteArray read(quint64 at, quintptr len);
 
+    /*!
+      * \brief Read data from a file into a buffer
+      * \param at The offset from which to read
+      * \param buf Where to store the data, must hold at least len bytes
+      * \param len The number of bytes to read
+      * \returns The number of bytes read, less than len at the end of the file, or -1 on error.
+      */
+    qint64 readInto(quint64 at, char *buf, quintptr len);
+
+    /*!
+      * \brief Read data from a file into a reused array
+      * \param at The offset from which to read
+      * \param len The number of bytes to read
+      * \param out (out) Resized to the bytes actually read, empty on error
+      * \returns The number of bytes read, or -1 on error.
+      *
+      * The capacity of out is kept, so reading into the same array again only allocates if more
+      * data is asked for than before.
+      */
+    qint64 read(quint64 at, quintptr len, QByteArray &out);
+
+    /*!
+      * \brief Read many ranges in one call
+      * \param extents The ranges to read, in any order. Their transferred fields are set.
+      * \returns The total number of bytes read, or -1 if a read failed.
+      *
+      * The ranges are sorted and the ones that overlap or are less than 4 KiB apart are read
+      * with a single read, so every part of the file is decrypted and verified once.
+      */
+    qint64 readv(QVector<Extent> &extents);
+
+    /*!
+      * \brief Send a verified range of a signed member to a descriptor
+      * \param fd The descriptor to send to, typically a socket.
+      * \param offset Where the range starts in the file.
+      * \param len The length of the range, it is cut short at the end of the file.
+      * \returns The number of bytes sent, less than len if fd would block, or -1 with errno set.
+      *
+      * Only for members of signed stores, whose contents are stored as they are, errno is EINVAL
+      * for others. Nothing reaches fd before it has been checked. If the member has a hash tree,
+      * \sa MssfStorage::buildHashTree, the file is opened and held open, so renaming another file
+      * over it makes no difference, and it is read a block at a time: each block is checked against
+      * the tree and only then sent. Without a tree the range is read through this handle, which must
+      * be open, as \ref read does, and the backend checked the file when it was opened.
+      *
+      * The checked chunks are not copied again: their pages are gifted to a pipe with vmsplice()
+      * and spliced to fd, which avoids the copy into the socket buffer. Descriptors that cannot be
+      * spliced to are written to instead.
+      *
+      * A block that does not match stops the transfer with errno EIO, the data before it has been
+      * sent and is valid.
+      *
+      * Changes made through this handle must be closed, and thus recorded in the store, first.
+      */
+    qint64 sendTo(int fd, quint64 offset, quint64 len);
+
+    /*!
+      * \brief Write many ranges in one call
+      * \param extents The ranges to write, in any order, they must not overlap. Their
+      * transferred fields are set.
+      * \returns The total number of bytes written, or -1 if a write failed or the ranges overlap.
+      *
+      * Ranges that follow each other directly are combined into a single write.
+      */
+    qint64 writev(QVector<Extent> &extents);
+
+    /*!
+      * \brief Prefetch the data of sequential reads on a worker thread
+      * \param maxBytes The most data read ahead of the reader, 0 turns the read-ahead off.
+      *
+      * A read that starts where the previous one ended is sequential. The data after it is then
+      * read and decrypted on a worker thread while the caller works on what it got, in a window
+      * that starts at 64 KiB and doubles with each sequential read up to maxBytes. Any other read
+      * drops the prefetched data and starts over, as do writes, truncation and close.
+      *
+      * Off by default. The read-ahead follows a single sequential reader, concurrent readers wait
+      * for each other while it is on. Do not use it while the member is written through another
+      * handle.
+      */
+    void setReadAhead(quintptr maxBytes);
+
+    /*!
+      * \brief The read-ahead limit \sa setReadAhead
+      */
+    quintptr readAheadLimit() const;
+
     /*!
       * \brief Write data to a file
       * \param at The offset to which to write
@@ -85,6 +210,46 @@ public:
       */
     qptrdiff write(quint64 at, QByteArray &data);
 
+    /*!
+      * \overload
+      */
+    qptrdiff write(quint64 at, const QByteArray &data);
+
+    /*!
+      * \brief Write raw data to a file
+      * \param at The offset to which to write
+      * \param data The data to write
+      * \param len The number of bytes to write
+      * \returns The number of bytes actually written, -1 on error.
+      */
+    qptrdiff write(quint64 at, const char *data, quintptr len);
+
+    /*!
+      * \brief Gather small sequential writes into whole blocks
+      * \param blockSize The block size of the backend, 0 writes everything straight away.
+      *
+      * The encrypted backend re-encrypts a partially written block on every write. With the
+      * coalescing on, a write that continues the previous one is held back until it completes a
+      * block, and only the data up to the last block boundary is handed to the backend. Reads,
+      * other writes, \ref trunc and \ref close write out the pending data first. If the backend
+      * does not take it, the data is kept and the error is reported by \ref flush, which can be
+      * called again, or by \ref close, which drops it.
+      *
+      * Off by default.
+      */
+    void setWriteCoalescing(int blockSize);
+
+    /*!
+      * \brief The coalescing block size \sa setWriteCoalescing
+      */
+    int writeCoalescing() const;
+
+    /*!
+      * \brief Hand the writes held back by \ref setWriteCoalescing to the backend
+      * \returns false if the pending data could not be written, errno is set.
+      */
+    bool flush();
+
     /*!
       * \brief Truncate the file
       * \param at The new size of the file
@@ -94,10 +259,12 @@ public:
 
     /*!
       * \brief Close the file
+      * \returns false if writes held back by \ref setWriteCoalescing could not be written, they
+      * are lost. errno is set.
       *
       * The contents of the file are flushed to the disk.
       */
-    void close();
+    bool close();
 
     /*!
       * \brief Is the file currently open
@@ -118,10 +285,37 @@ public:
     /*!
       * \brief Get the digest of the file
       * \returns A base64 encoded hash computed of the current contents of the file,
-      * terminated with a NULL.
+      * terminated with a NULL. \sa chunkedDigest
       */
     QByteArray digest();
 
+    /*!
+      * \brief Keep a chunked digest of the contents up to date
+      * \param blockSize The size of the hashed blocks, 0 stops the tracking.
+      * \returns false if the file is not open or could not be read, errno is set.
+      *
+      * The chunked digest is the root of the block hash tree of \ref MssfStorage::buildHashTree.
+      * The tracking starts from the stored tree of the member if it has one with this block size,
+      * otherwise the file is read and hashed once. From then on \ref write, \ref writev and
+      * \ref trunc only mark the blocks they touch, these and the nodes above them are rehashed
+      * when the digest is asked for or the file is closed. If the member has a stored tree, close
+      * writes the updated tree and adds its root to the store, which then only needs a commit.
+      *
+      * The tracking stops when the file is opened again, files opened for appending are not
+      * supported.
+      *
+      * This is a second digest next to the one of the backend, it does not make writing any
+      * cheaper: the backend still hashes the whole file when it is closed, and for \ref digest.
+      */
+    bool trackChunkedDigest(int blockSize = 4096);
+
+    /*!
+      * \brief The root of the tracked block hash tree \sa trackChunkedDigest
+      * \returns The SHA1 of the root, empty if the digest is not tracked or a changed block could
+      * not be read.
+      */
+    QByteArray chunkedDigest();
+
     /*!
       * \brief The name shown to outside
       * \returns The public name, not necessarily the place where the actual contents are stored.
@@ -131,6 +325,8 @@ public:
     /*!
       * \brief Return a pointer to the owning pstore
       * \returns A reference to the pstore this file belongs to
+      *
+      * If the store was opened with \ref MssfStorage::open this is the shared handle of the store.
       */
     QSharedPointer<MssfStorage> owner();
 
@@ -27,7 +27,13 @@
 #define PROTECTEDFILE_P_H
 
 #include <QtCore/QFile>
+#include <QtCore/QMutex>
+#include <QtCore/QReadWriteLock>
 #include <QtCore/QSharedPointer>
+#include <QtCore/QVector>
+#include <QtCore/QWeakPointer>
+
+#include "protectedfile.h"
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -45,6 +51,12 @@ class p_file;
 namespace MssfQt
 {
 
+namespace Internal
+{
+class ReadAhead;
+class MutableHashTree;
+}
+
 class MssfStorage;
 class MssfStoragePrivate;
 
@@ -57,20 +69,55 @@ public:
 
     bool open(QFile::Permissions flags);
 
+    bool open(QIODevice::OpenMode mode);
+
     QByteArray read(quint64 at, quintptr len);
 
-    qptrdiff write(quint64 at, QByteArray &data);
+    qint64 readInto(quint64 at, char *buf, quintptr len);
+
+    //! Read straight from the backend, bypassing the read-ahead.
+    qint64 readFile(quint64 at, char *buf, quintptr len);
+
+    //! \ref readFile for callers that already hold the lock.
+    qint64 readBackend(quint64 at, char *buf, quintptr len);
+
+    void setReadAhead(quintptr maxBytes);
+
+    quintptr readAheadLimit() const;
+
+    qint64 read(quint64 at, quintptr len, QByteArray &out);
+
+    qint64 readv(QVector<ProtectedFile::Extent> &extents);
+
+    qint64 sendTo(int fd, quint64 offset, quint64 len);
+
+    qint64 writev(QVector<ProtectedFile::Extent> &extents);
+
+    qptrdiff write(quint64 at, const char *data, quintptr len);
+
+    bool flush();
+
+    void setWriteCoalescing(int blockSize);
+
+    int writeCoalescing() const;
 
     bool trunc(quint64 at);
 
-    void close();
+    bool close();
 
     bool isOpen();
 
+    //! \ref isOpen without the lock, for the store, which must not wait for a handle that waits for it.
+    bool isOpenUnlocked() const;
+
     bool status(struct stat *st);
 
     QByteArray digest();
 
+    bool trackChunkedDigest(int blockSize);
+
+    QByteArray chunkedDigest();
+
     QString name();
 
     QSharedPointer<MssfStorage> owner();
@@ -83,8 +130,49 @@ public:
 
     bool utime(const QDateTime &accessTime, const QDateTime &modifiedTime);
 
+    //! The store is being deleted, close the file and release everything that refers to the store.
+    void detach();
+
 private:
 
+    //! The mutex of the store, held by every backend call that may change its index. NULL once detached.
+    QMutex *storeMutex() const;
+
+    //! true, with errno set to EBADF, once \ref detach has run.
+    bool detached() const;
+
+    //! \ref sendTo through the reads of the backend, which verified the file when it was opened.
+    //! The lock must be held.
+    qint64 sendRead(int fd, quint64 offset, quint64 len);
+
+    //! Start from the stored tree of the member, if it matches.
+    bool loadHashTree(quint32 blockSize, quint64 size);
+
+    //! A copy of readAhead for a call that does not hold the lock.
+    QSharedPointer<Internal::ReadAhead> readAheadFor();
+
+    //! Drop the prefetched data after a change, called without the lock, which the worker needs.
+    void dropPrefetched();
+
+    //! Let the store drop what it cached of the member, it has been changed.
+    void changed();
+
+    //! Mark a written range in the tracked tree.
+    void touched(quint64 at, qint64 count);
+
+    //! Write to the backend, the lock must be held for writing.
+    qptrdiff writeBackend(quint64 at, const char *data, quintptr len);
+
+    //! Add a write to the pending data and write out the blocks it completes.
+    qptrdiff coalesce(quint64 at, const char *data, quintptr len);
+
+    //! Write out the pending data, the lock must be held for writing. What could not be
+    //! written is kept.
+    bool flushPending();
+
+    //! Write out the pending data, if any, before the file is read. Takes the lock itself.
+    void flushBeforeRead();
+
 #ifdef MAEMO
     /*!
       * \brief Constructor private to allow only to reference a file within the storage area
@@ -102,8 +190,31 @@ private:
     //! The protected file that is wrapped
     mssf::p_file *file;
 #endif
+    //! The store that created the handle, NULL once it is gone.
+    MssfStoragePrivate *storage;
+    //! Opened for writing, closing records the new contents in the store.
+    bool writable;
+    //! Shared by the positional reads, exclusive for everything that changes the file or the handle.
+    //! Taken before the mutex of the store, never while holding it.
+    mutable QReadWriteLock lock;
+    //! Guards ownerPointer, which is created on first use.
+    QMutex ownerMutex;
     //! A pointer to the owner of this protected file.
     QSharedPointer<MssfStorage> ownerPointer;
+    //! The owner of a pooled handle, which must not keep its own pool alive.
+    QWeakPointer<MssfStorage> poolOwner;
+    //! The prefetcher of sequential reads, null unless enabled. Replaced under the lock, used
+    //! through a copy taken under it.
+    QSharedPointer<Internal::ReadAhead> readAhead;
+    //! The tracked block hash tree, NULL unless enabled.
+    Internal::MutableHashTree *hashTree;
+    //! true if hashTree came from the files of the member and is written back on close.
+    bool hashTreeStored;
+    //! The block size writes are coalesced to, 0 if they are not.
+    int coalesceBlock;
+    //! Written data not yet handed to the backend, never reaching past a block boundary.
+    QByteArray pending;
+    quint64 pendingStart;
 };
 
 } //namespace MssfQt
@@ -0,0 +1,254 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "protectedfiledevice.h"
+#include "protectedfiledevice_p.h"
+#include "protectedfile.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+
+using namespace MssfQt;
+
+static const int DefaultBlockSize = 64 * 1024;
+//! The most blocks read at a time while reading sequentially.
+static const int MaxReadAhead = 8;
+
+ProtectedFileDevice::ProtectedFileDevice(ProtectedFile *file, QObject *parent)
+    : QIODevice(parent),
+      d_ptr(new ProtectedFileDevicePrivate(file))
+{
+}
+
+ProtectedFileDevicePrivate::ProtectedFileDevicePrivate(ProtectedFile *file)
+    : file(file),
+      openedFile(false),
+      blockSize(DefaultBlockSize),
+      size(0),
+      blockStart(0),
+      blockLength(0),
+      lastReadEnd(-1),
+      readAhead(1),
+      pendingStart(0)
+{
+}
+
+ProtectedFileDevice::~ProtectedFileDevice()
+{
+    close();
+}
+
+ProtectedFile *ProtectedFileDevice::file() const
+{
+    return d_ptr->file;
+}
+
+void ProtectedFileDevice::setBlockSize(int bytes)
+{
+    if (bytes > 0)
+        d_ptr->blockSize = bytes;
+}
+
+int ProtectedFileDevice::blockSize() const
+{
+    return d_ptr->blockSize;
+}
+
+bool ProtectedFileDevice::open(OpenMode mode)
+{
+    if (isOpen() || !d_ptr->file)
+        return false;
+
+    d_ptr->openedFile = false;
+    if (!d_ptr->file->isOpen())
+    {
+        if (!d_ptr->file->open(mode))
+        {
+            setErrorString(qt_error_string(errno));
+            return false;
+        }
+        d_ptr->openedFile = true;
+    }
+
+    struct stat st;
+    d_ptr->size = (d_ptr->file->status(&st) ? st.st_size : 0);
+    d_ptr->dropBlock();
+    d_ptr->pending.clear();
+    d_ptr->lastReadEnd = -1;
+    d_ptr->readAhead = 1;
+
+    // QIODevice would keep a buffer of its own
+    QIODevice::open(mode | QIODevice::Unbuffered);
+    if (mode & QIODevice::Append)
+        seek(d_ptr->size);
+    return true;
+}
+
+void ProtectedFileDevice::close()
+{
+    if (!isOpen())
+        return;
+
+    if (!d_ptr->flushWrites())
+        setErrorString(qt_error_string(errno));
+
+    if (d_ptr->openedFile && !d_ptr->file->close())
+        setErrorString(qt_error_string(errno));
+    d_ptr->openedFile = false;
+    d_ptr->dropBlock();
+
+    QIODevice::close();
+}
+
+qint64 ProtectedFileDevice::size() const
+{
+    return d_ptr->size;
+}
+
+bool ProtectedFileDevice::flush()
+{
+    if (d_ptr->flushWrites())
+        return true;
+    setErrorString(qt_error_string(errno));
+    return false;
+}
+
+qint64 ProtectedFileDevice::readData(char *data, qint64 maxSize)
+{
+    // what was written must be readable back
+    if (!d_ptr->flushWrites())
+    {
+        setErrorString(qt_error_string(errno));
+        return -1;
+    }
+
+    qint64 at = pos();
+    qint64 end = qMin(at + maxSize, d_ptr->size);
+    if (at >= end)
+        return 0;
+
+    if (at == d_ptr->lastReadEnd)
+        d_ptr->readAhead = qMin(d_ptr->readAhead * 2, MaxReadAhead);
+    else
+        d_ptr->readAhead = 1;
+
+    qint64 total = 0;
+    while (at < end)
+    {
+        qint64 blockEnd = d_ptr->blockStart + d_ptr->blockLength;
+        if (at >= d_ptr->blockStart && at < blockEnd)
+        {
+            qint64 chunk = qMin(end, blockEnd) - at;
+            memcpy(data + total, d_ptr->block.constData() + (at - d_ptr->blockStart), chunk);
+            total += chunk;
+            at += chunk;
+            continue;
+        }
+
+        qint64 window = (qint64)d_ptr->blockSize * d_ptr->readAhead;
+        if (end - at >= window)
+        {
+            // large reads go straight to the caller
+            qint64 count = d_ptr->file->readInto(at, data + total, end - at);
+            if (count < 0)
+            {
+                setErrorString(qt_error_string(errno));
+                return (total > 0 ? total : -1);
+            }
+            total += count;
+            at += count;
+            break;
+        }
+
+        d_ptr->blockStart = at;
+        d_ptr->blockLength = d_ptr->file->read(at, qMin(window, d_ptr->size - at), d_ptr->block);
+        if (d_ptr->blockLength < 0)
+        {
+            d_ptr->blockLength = 0;
+            setErrorString(qt_error_string(errno));
+            return (total > 0 ? total : -1);
+        }
+        if (d_ptr->blockLength == 0)
+            break;
+    }
+
+    d_ptr->lastReadEnd = at;
+    return total;
+}
+
+qint64 ProtectedFileDevice::writeData(const char *data, qint64 maxSize)
+{
+    qint64 at = pos();
+    ProtectedFileDevicePrivate *d = d_ptr.data();
+
+    if (!d->pending.isEmpty() && at != d->pendingStart + d->pending.size() && !d->flushWrites())
+    {
+        setErrorString(qt_error_string(errno));
+        return -1;
+    }
+
+    if (d->pending.isEmpty())
+        d->pendingStart = at;
+    d->pending.append(data, maxSize);
+
+    // the read buffer may hold the old contents
+    if (at < d->blockStart + d->blockLength && at + maxSize > d->blockStart)
+        d->dropBlock();
+    d->size = qMax(d->size, at + maxSize);
+
+    // like a buffered QFile the data has been taken, a failure shows up on flush() or close()
+    if (d->pending.size() >= d->blockSize && !d->flushWrites())
+        setErrorString(qt_error_string(errno));
+    return maxSize;
+}
+
+bool ProtectedFileDevicePrivate::flushWrites()
+{
+    if (pending.isEmpty())
+        return true;
+
+    qptrdiff written = file->write(pendingStart, pending);
+    if (written < 0)
+        return false;
+
+    if (written < pending.size())
+    {
+        // keep the rest for the next attempt
+        pending.remove(0, written);
+        pendingStart += written;
+        return false;
+    }
+
+    pending.clear();
+    return true;
+}
+
+void ProtectedFileDevicePrivate::dropBlock()
+{
+    // keep the memory for the next fill
+    blockStart = 0;
+    blockLength = 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef PROTECTEDFILEDEVICE_H
+#define PROTECTEDFILEDEVICE_H
+
+#include "mssf-qt_global.h"
+
+#include <QtCore/QIODevice>
+#include <QtCore/QScopedPointer>
+
+namespace MssfQt
+{
+
+class ProtectedFile;
+class ProtectedFileDevicePrivate;
+
+/*!
+  * \class ProtectedFileDevice
+  * \brief A QIODevice reading and writing a \ref ProtectedFile.
+  *
+  * This allows the standard Qt readers and writers, such as QDataStream, QTextStream or
+  * QImageReader, to stream from and to a protected member instead of getting the whole member
+  * with \ref MssfStorage::getFile first.
+  *
+  * Reads are served from a block buffer. While the device is read sequentially, the amount read
+  * ahead grows up to 8 blocks at a time, and it drops back to a single block after a seek.
+  * Consecutive writes are collected into one write of at least a block, which is done when the
+  * buffer is full, when a write is not contiguous with it, before a read and by \ref flush.
+  *
+  * The device is random access and opened unbuffered, the buffering is done here.
+  */
+class MSSFQTSHARED_EXPORT ProtectedFileDevice : public QIODevice
+{
+    Q_OBJECT
+
+public:
+
+    /*!
+      * \brief Constructor
+      * \param file The file to access, it is not deleted by the device.
+      * \param parent The parent object of this.
+      */
+    ProtectedFileDevice(ProtectedFile *file, QObject *parent = 0);
+
+    /*!
+      * \brief Destructor, closes the device.
+      */
+    ~ProtectedFileDevice();
+
+    /*!
+      * \brief The wrapped file
+      */
+    ProtectedFile *file() const;
+
+    /*!
+      * \brief Set the size of the read and write buffers
+      * \param bytes The block size, 64 KiB by default. Takes effect on the next buffer fill.
+      */
+    void setBlockSize(int bytes);
+
+    /*!
+      * \brief The size of the read and write buffers
+      */
+    int blockSize() const;
+
+    /*!
+      * \brief Open the device
+      * \param mode The access mode. The file is opened with it unless it is open already.
+      * \returns true on success, false otherwise. \sa ProtectedFile::open(QIODevice::OpenMode)
+      */
+    bool open(OpenMode mode);
+
+    /*!
+      * \brief Write the pending data and close the device
+      *
+      * The file is only closed if it was opened by \ref open.
+      */
+    void close();
+
+    /*!
+      * \brief The size of the file, including the data not yet written
+      */
+    qint64 size() const;
+
+    /*!
+      * \brief Write the collected data to the file
+      * \returns true on success, false otherwise.
+      */
+    bool flush();
+
+protected:
+
+    qint64 readData(char *data, qint64 maxSize);
+
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    //! internal private implementation
+    QScopedPointer<ProtectedFileDevicePrivate> d_ptr;
+};
+
+} //namespace MssfQt
+
+#endif // PROTECTEDFILEDEVICE_H
@@ -0,0 +1,68 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef PROTECTEDFILEDEVICE_P_H
+#define PROTECTEDFILEDEVICE_P_H
+
+#include <QtCore/QByteArray>
+
+namespace MssfQt
+{
+
+class ProtectedFile;
+
+class ProtectedFileDevicePrivate
+{
+public:
+
+    ProtectedFileDevicePrivate(ProtectedFile *file);
+
+    //! Write the collected data.
+    bool flushWrites();
+
+    //! Forget the read buffer.
+    void dropBlock();
+
+    ProtectedFile *file;
+    //! true if the device opened the file and has to close it.
+    bool openedFile;
+    int blockSize;
+    //! The file size including the data not yet written.
+    qint64 size;
+    //! The read buffer holds the bytes [blockStart, blockStart + blockLength), it is reused.
+    QByteArray block;
+    qint64 blockStart;
+    qint64 blockLength;
+    //! Where the last read ended, to detect sequential reading, and the blocks read ahead now.
+    qint64 lastReadEnd;
+    int readAhead;
+    //! The collected writes, to be written at pendingStart.
+    QByteArray pending;
+    qint64 pendingStart;
+};
+
+} //namespace MssfQt
+
+#endif // PROTECTEDFILEDEVICE_P_H
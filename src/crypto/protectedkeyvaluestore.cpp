@@ -0,0 +1,566 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "protectedkeyvaluestore.h"
+#include "protectedkeyvaluestore_p.h"
+#include "mssfstorage.h"
+#include "protectedfile.h"
+
+#include <QtCore/QMutexLocker>
+#include <QtCore/QStringList>
+#include <QtCore/QtAlgorithms>
+#include <QtCore/QtConcurrentRun>
+
+using namespace MssfQt;
+
+//! Collect about this much before writing without being asked to.
+static const int FlushThreshold = 64 * 1024;
+static const int MaxSmallSegments = 16;
+static const quint32 DefaultSegmentSize = 256 * 1024;
+
+ProtectedKeyValueStore::ProtectedKeyValueStore(const QSharedPointer<MssfStorage> &store, const QString &prefix)
+    : d_ptr(new ProtectedKeyValueStorePrivate(store, prefix))
+{
+}
+
+ProtectedKeyValueStorePrivate::ProtectedKeyValueStorePrivate(const QSharedPointer<MssfStorage> &store, const QString &prefix)
+    : mutex(QMutex::Recursive),
+      store(store),
+      prefix(prefix),
+      valid(false),
+      maxSegmentSize(DefaultSegmentSize),
+      nextSegment(0),
+      bufferDead(0),
+      closing(false)
+{
+    valid = (store && load());
+}
+
+ProtectedKeyValueStore::~ProtectedKeyValueStore()
+{
+}
+
+ProtectedKeyValueStorePrivate::~ProtectedKeyValueStorePrivate()
+{
+    {
+        QMutexLocker locker(&mutex);
+        closing = true;
+        flush();
+    }
+    // the compaction takes the lock itself
+    compaction.waitForFinished();
+
+    qDeleteAll(readers);
+    readers.clear();
+}
+
+bool ProtectedKeyValueStore::isValid() const
+{
+    return d_ptr->valid;
+}
+
+QString ProtectedKeyValueStorePrivate::segmentName(int segment) const
+{
+    return prefix + QLatin1Char('.') + QString::number(segment);
+}
+
+bool ProtectedKeyValueStorePrivate::load()
+{
+    QString mask = prefix + QLatin1String(".*");
+    QList<int> numbers;
+    foreach(const QString &name, store->getFiles(mask))
+    {
+        bool ok = false;
+        QString suffix = name.mid(prefix.length() + 1);
+        int segment = suffix.toInt(&ok);
+        if (ok && segment >= 0 && suffix == QString::number(segment))
+            numbers.append(segment);
+    }
+    qSort(numbers);
+
+    bool dropped = false;
+    foreach(int segment, numbers)
+    {
+        QByteArray data = store->getFile(segmentName(segment));
+        if (data.isEmpty())
+        {
+            // a segment that cannot be read was written by a flush or compaction that did not
+            // get to commit, the records in it were never acknowledged
+            struct stat st;
+            if (!store->statFile(segmentName(segment), &st) || st.st_size > 0)
+            {
+                store->removeFile(segmentName(segment));
+                dropped = true;
+                continue;
+            }
+        }
+        scan(segment, data);
+    }
+    if (dropped)
+        store->commit();
+
+    if (!numbers.isEmpty())
+        nextSegment = numbers.last() + 1;
+    return true;
+}
+
+void ProtectedKeyValueStorePrivate::scan(int segment, const QByteArray &data)
+{
+    Segment &accounting = segments[segment];
+    quint32 at = 0;
+    quint32 keyLength, valueLength;
+    quint8 flags;
+
+    // later records replace earlier ones, and the segments are scanned oldest first
+    forever
+    {
+        quint32 size = Internal::KeyValueRecord::decode(data, at, &keyLength, &valueLength, &flags);
+        if (size == 0)
+            break;
+
+        QByteArray key = data.mid(at + HeaderSize, keyLength);
+        if (index.contains(key))
+        {
+            retire(key);
+            index.remove(key);
+        }
+
+        if (flags & Tombstone)
+        {
+            accounting.dead += size;
+        }
+        else
+        {
+            Location location;
+            location.segment = segment;
+            location.offset = at + HeaderSize + keyLength;
+            location.length = valueLength;
+            index.insert(key, location);
+        }
+        at += size;
+    }
+
+    accounting.size = at;
+}
+
+void ProtectedKeyValueStorePrivate::retire(const QByteArray &key)
+{
+    QHash<QByteArray, Location>::const_iterator it = index.constFind(key);
+    if (it == index.constEnd())
+        return;
+
+    quint32 size = HeaderSize + key.size() + it.value().length;
+    if (it.value().segment == Pending)
+        bufferDead += size;
+    else
+        segments[it.value().segment].dead += size;
+}
+
+QByteArray ProtectedKeyValueStore::get(const QByteArray &key)
+{
+    return d_ptr->get(key);
+}
+
+QByteArray ProtectedKeyValueStorePrivate::get(const QByteArray &key)
+{
+    QMutexLocker locker(&mutex);
+    QHash<QByteArray, Location>::const_iterator it = index.constFind(key);
+    if (it == index.constEnd())
+        return QByteArray();
+
+    const Location &location = it.value();
+    if (location.segment == Pending)
+        return buffer.mid(location.offset, location.length);
+
+    ProtectedFile *file = reader(location.segment);
+    if (!file)
+        return QByteArray();
+    return file->read(location.offset, location.length);
+}
+
+void ProtectedKeyValueStore::put(const QByteArray &key, const QByteArray &value)
+{
+    d_ptr->put(key, value);
+}
+
+void ProtectedKeyValueStorePrivate::put(const QByteArray &key, const QByteArray &value)
+{
+    QMutexLocker locker(&mutex);
+    retire(key);
+
+    Location location;
+    location.segment = Pending;
+    location.offset = buffer.size() + HeaderSize + key.size();
+    location.length = value.size();
+
+    Internal::KeyValueRecord::append(buffer, key, value, 0);
+    index.insert(key, location);
+    pendingKeys.append(key);
+
+    if (buffer.size() >= FlushThreshold)
+        flush();
+}
+
+bool ProtectedKeyValueStore::remove(const QByteArray &key)
+{
+    return d_ptr->remove(key);
+}
+
+bool ProtectedKeyValueStorePrivate::remove(const QByteArray &key)
+{
+    QMutexLocker locker(&mutex);
+    if (!index.contains(key))
+        return false;
+
+    retire(key);
+    index.remove(key);
+
+    int before = buffer.size();
+    Internal::KeyValueRecord::append(buffer, key, QByteArray(), Tombstone);
+    bufferDead += buffer.size() - before;
+
+    if (buffer.size() >= FlushThreshold)
+        flush();
+    return true;
+}
+
+bool ProtectedKeyValueStore::contains(const QByteArray &key) const
+{
+    return d_ptr->contains(key);
+}
+
+bool ProtectedKeyValueStorePrivate::contains(const QByteArray &key) const
+{
+    QMutexLocker locker(&mutex);
+    return index.contains(key);
+}
+
+int ProtectedKeyValueStore::count() const
+{
+    return d_ptr->count();
+}
+
+int ProtectedKeyValueStorePrivate::count() const
+{
+    QMutexLocker locker(&mutex);
+    return index.count();
+}
+
+QList<QByteArray> ProtectedKeyValueStore::keys() const
+{
+    return d_ptr->keys();
+}
+
+QList<QByteArray> ProtectedKeyValueStorePrivate::keys() const
+{
+    QMutexLocker locker(&mutex);
+    return index.keys();
+}
+
+int ProtectedKeyValueStore::iterate(ProtectedKeyValueStore::Visitor visitor, void *context)
+{
+    return d_ptr->iterate(visitor, context);
+}
+
+int ProtectedKeyValueStorePrivate::iterate(ProtectedKeyValueStore::Visitor visitor, void *context)
+{
+    if (!visitor)
+        return 0;
+
+    QMutexLocker locker(&mutex);
+    int visited = 0;
+    // get() may not change the index, so iterating it directly is safe
+    QHash<QByteArray, Location>::const_iterator it;
+    for (it = index.constBegin(); it != index.constEnd(); ++it)
+    {
+        visited++;
+        if (!visitor(it.key(), get(it.key()), context))
+            break;
+    }
+    return visited;
+}
+
+bool ProtectedKeyValueStore::flush()
+{
+    return d_ptr->flush();
+}
+
+bool ProtectedKeyValueStorePrivate::flush()
+{
+    QMutexLocker locker(&mutex);
+    if (buffer.isEmpty())
+        return true;
+    if (!valid)
+        return false;
+
+    // committed segments are never written again, a crash before the commit below leaves the new
+    // segment unreadable and the committed ones intact
+    int number = nextSegment++;
+    if (!store->putFile(segmentName(number), buffer))
+    {
+        store->removeFile(segmentName(number));
+        return false;
+    }
+
+    foreach(const QByteArray &key, pendingKeys)
+    {
+        QHash<QByteArray, Location>::iterator it = index.find(key);
+        if (it == index.end() || it.value().segment != Pending)
+            continue;
+        it.value().segment = number;
+    }
+
+    Segment &segment = segments[number];
+    segment.size = buffer.size();
+    segment.dead = bufferDead;
+    buffer.clear();
+    pendingKeys.clear();
+    bufferDead = 0;
+
+    store->commit();
+    maybeCompact();
+    return true;
+}
+
+void ProtectedKeyValueStore::setSegmentSize(quint32 bytes)
+{
+    d_ptr->setSegmentSize(bytes);
+}
+
+void ProtectedKeyValueStorePrivate::setSegmentSize(quint32 bytes)
+{
+    QMutexLocker locker(&mutex);
+    maxSegmentSize = qMax(bytes, (quint32)FlushThreshold);
+}
+
+quint32 ProtectedKeyValueStore::segmentSize() const
+{
+    return d_ptr->segmentSize();
+}
+
+quint32 ProtectedKeyValueStorePrivate::segmentSize() const
+{
+    QMutexLocker locker(&mutex);
+    return maxSegmentSize;
+}
+
+quint64 ProtectedKeyValueStore::garbageBytes() const
+{
+    return d_ptr->garbageBytes();
+}
+
+quint64 ProtectedKeyValueStorePrivate::garbageBytes() const
+{
+    QMutexLocker locker(&mutex);
+    quint64 dead = 0;
+    foreach(const Segment &segment, segments)
+        dead += segment.dead;
+    return dead;
+}
+
+ProtectedFile *ProtectedKeyValueStorePrivate::reader(int segment)
+{
+    ProtectedFile *file = readers.value(segment);
+    if (file)
+        return file;
+
+    file = store->member(segmentName(segment));
+    if (!file)
+        return NULL;
+    if (!file->open(QIODevice::ReadOnly))
+    {
+        delete file;
+        return NULL;
+    }
+
+    readers.insert(segment, file);
+    return file;
+}
+
+void ProtectedKeyValueStorePrivate::closeReader(int segment)
+{
+    ProtectedFile *file = readers.take(segment);
+    if (!file)
+        return;
+    file->close();
+    delete file;
+}
+
+void ProtectedKeyValueStorePrivate::maybeCompact()
+{
+    if (closing || compaction.isRunning())
+        return;
+
+    quint64 size = 0;
+    quint64 dead = 0;
+    foreach(const Segment &segment, segments)
+    {
+        size += segment.size;
+        dead += segment.dead;
+    }
+
+    // every flush adds a small segment, packing them bounds the number of members
+    if ((dead >= maxSegmentSize && dead * 2 > size)
+            || (quint64)segments.count() > MaxSmallSegments + 2 * (size / maxSegmentSize))
+        compactAsync();
+}
+
+bool ProtectedKeyValueStore::compact()
+{
+    return d_ptr->compactAsync().result();
+}
+
+QFuture<bool> ProtectedKeyValueStore::compactAsync()
+{
+    return d_ptr->compactAsync();
+}
+
+QFuture<bool> ProtectedKeyValueStorePrivate::compactAsync()
+{
+    // held until the future is stored, so the compaction cannot see an outdated one
+    QMutexLocker locker(&mutex);
+    if (!compaction.isRunning())
+        compaction = QtConcurrent::run(this, &ProtectedKeyValueStorePrivate::compact);
+    return compaction;
+}
+
+bool ProtectedKeyValueStorePrivate::compact()
+{
+    QList<int> victims;
+    QHash<QByteArray, Location> snapshot;
+    int first;
+    quint32 limit;
+
+    {
+        QMutexLocker locker(&mutex);
+        if (!valid || !flush())
+            return false;
+
+        victims = segments.keys();
+        if (victims.isEmpty())
+            return true;
+
+        snapshot = index;
+        quint64 live = 0;
+        QHash<QByteArray, Location>::const_iterator it;
+        for (it = snapshot.constBegin(); it != snapshot.constEnd(); ++it)
+            live += HeaderSize + it.key().size() + it.value().length;
+
+        // the copies get the numbers up to this, and writes made meanwhile go after them so that
+        // they win when the segments are scanned again
+        limit = maxSegmentSize;
+        first = nextSegment;
+        nextSegment = first + live / limit + 1;
+    }
+
+    // copy without holding the lock, the old segments stay readable until the copies are installed
+    QHash<QByteArray, Location> moved;
+    QMap<int, Segment> written;
+    QByteArray output;
+    int current = first;
+    bool ok = true;
+
+    foreach(int segment, victims)
+    {
+        QByteArray data = store->getFile(segmentName(segment));
+        quint32 at = 0;
+        quint32 keyLength, valueLength;
+        quint8 flags;
+
+        forever
+        {
+            quint32 size = Internal::KeyValueRecord::decode(data, at, &keyLength, &valueLength, &flags);
+            if (size == 0)
+                break;
+
+            // tombstones can go, every older segment is compacted as well
+            if (!(flags & Tombstone))
+            {
+                QByteArray key = data.mid(at + HeaderSize, keyLength);
+                QHash<QByteArray, Location>::const_iterator it = snapshot.constFind(key);
+                if (it != snapshot.constEnd() && it.value().segment == segment
+                        && it.value().offset == at + HeaderSize + keyLength)
+                {
+                    Location location;
+                    location.segment = current;
+                    location.offset = output.size() + HeaderSize + keyLength;
+                    location.length = valueLength;
+                    moved.insert(key, location);
+                    output.append(data.constData() + at, size);
+                }
+            }
+            at += size;
+
+            if ((quint32)output.size() >= limit)
+            {
+                if (!store->putFile(segmentName(current), output))
+                    ok = false;
+                written[current].size = output.size();
+                output.clear();
+                current++;
+            }
+        }
+    }
+
+    if (!output.isEmpty())
+    {
+        if (!store->putFile(segmentName(current), output))
+            ok = false;
+        written[current].size = output.size();
+    }
+
+    QMutexLocker locker(&mutex);
+    if (!ok)
+    {
+        foreach(int segment, written.keys())
+            store->removeFile(segmentName(segment));
+        return false;
+    }
+
+    QHash<QByteArray, Location>::const_iterator it;
+    for (it = moved.constBegin(); it != moved.constEnd(); ++it)
+    {
+        QHash<QByteArray, Location>::iterator now = index.find(it.key());
+        Location before = snapshot.value(it.key());
+        if (now != index.end() && now.value().segment == before.segment && now.value().offset == before.offset)
+            now.value() = it.value();
+        else
+            written[it.value().segment].dead += HeaderSize + it.key().size() + it.value().length;
+    }
+
+    foreach(int segment, victims)
+    {
+        closeReader(segment);
+        segments.remove(segment);
+        store->removeFile(segmentName(segment));
+    }
+
+    QMap<int, Segment>::const_iterator copy;
+    for (copy = written.constBegin(); copy != written.constEnd(); ++copy)
+        segments.insert(copy.key(), copy.value());
+
+    store->commit();
+    return true;
+}
@@ -0,0 +1,187 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef PROTECTEDKEYVALUESTORE_H
+#define PROTECTEDKEYVALUESTORE_H
+
+#include "mssf-qt_global.h"
+
+#include <QtCore/QFuture>
+#include <QtCore/QList>
+#include <QtCore/QScopedPointer>
+#include <QtCore/QSharedPointer>
+
+class QByteArray;
+class QString;
+
+namespace MssfQt
+{
+
+class MssfStorage;
+class ProtectedKeyValueStorePrivate;
+
+/*!
+  * \class ProtectedKeyValueStore
+  * \brief A map of small records packed into a few protected members.
+  *
+  * Storing every small record as a member of its own costs an index entry, a file and an
+  * encryption per record. This class appends the records instead to segment members named
+  * prefix.N, each holding many records, and keeps an index of the records in memory.
+  *
+  * Changes are collected in memory and written as a new segment by \ref flush, or once enough
+  * of them have been collected, followed by a single commit of the store. Committed segments are
+  * never written again, so a crash loses at most the changes of the flush it interrupted. The space
+  * of overwritten and removed records is reclaimed by compaction, which copies the live records
+  * into new segments. Compaction is started in the background when more than half of the segment
+  * space is garbage or the small segments of the flushes pile up, and can also be requested with
+  * \ref compact or \ref compactAsync.
+  *
+  * All members are safe to call from several threads. The store should be encrypted, the
+  * members of a signed store are readable by everyone.
+  */
+class MSSFQTSHARED_EXPORT ProtectedKeyValueStore
+{
+public:
+
+    /*!
+      * \typedef Visitor
+      * \brief Called by \ref iterate for every record.
+      * \returns true to continue, false to stop the iteration.
+      */
+    typedef bool (*Visitor)(const QByteArray &key, const QByteArray &value, void *context);
+
+    /*!
+      * \brief Constructor, reads the index of the existing segments
+      * \param store The store that holds the segments.
+      * \param prefix The name of the segments without the number, must not be used by other members.
+      */
+    ProtectedKeyValueStore(const QSharedPointer<MssfStorage> &store, const QString &prefix);
+
+    /*!
+      * \brief Destructor, waits for a running compaction and flushes the pending changes.
+      */
+    ~ProtectedKeyValueStore();
+
+    /*!
+      * \brief Were the existing segments read
+      * \returns false if the store is missing or a segment could not be read.
+      */
+    bool isValid() const;
+
+    /*!
+      * \brief Get the value of a record
+      * \param key The key of the record.
+      * \returns The value, or QByteArray() if there is no such record.
+      */
+    QByteArray get(const QByteArray &key);
+
+    /*!
+      * \brief Add or replace a record
+      * \param key The key of the record.
+      * \param value The new value.
+      *
+      * The record is written by the next \ref flush.
+      */
+    void put(const QByteArray &key, const QByteArray &value);
+
+    /*!
+      * \brief Remove a record
+      * \param key The key of the record.
+      * \returns true if the record existed.
+      */
+    bool remove(const QByteArray &key);
+
+    /*!
+      * \brief Check if a record exists
+      */
+    bool contains(const QByteArray &key) const;
+
+    /*!
+      * \brief The number of records
+      */
+    int count() const;
+
+    /*!
+      * \brief The keys of all records, in no particular order
+      */
+    QList<QByteArray> keys() const;
+
+    /*!
+      * \brief Call a visitor for every record, in no particular order
+      * \param visitor The function to call.
+      * \param context Passed to the visitor as is.
+      * \returns The number of records visited.
+      *
+      * The store is locked during the iteration, the visitor must not call back into it.
+      */
+    int iterate(Visitor visitor, void *context);
+
+    /*!
+      * \brief Write the pending changes and commit the store
+      * \returns true on success, false otherwise. The changes are kept pending on failure.
+      */
+    bool flush();
+
+    /*!
+      * \brief Set the size of the segments written by compaction
+      * \param bytes The size, 256 KiB by default.
+      *
+      * Compaction packs the records into segments of about this size.
+      */
+    void setSegmentSize(quint32 bytes);
+
+    /*!
+      * \brief The size of the segments written by compaction
+      */
+    quint32 segmentSize() const;
+
+    /*!
+      * \brief The bytes taken by overwritten and removed records in the segments
+      */
+    quint64 garbageBytes() const;
+
+    /*!
+      * \brief Copy the live records into new segments and remove the old ones
+      * \returns true on success. Blocks until done.
+      */
+    bool compact();
+
+    /*!
+      * \brief Compact in a background thread \sa compact
+      * \returns The future result, or the one of the compaction already running.
+      *
+      * The records stay readable and writable while the compaction runs.
+      */
+    QFuture<bool> compactAsync();
+
+private:
+    Q_DISABLE_COPY(ProtectedKeyValueStore)
+    //! internal private implementation
+    QScopedPointer<ProtectedKeyValueStorePrivate> d_ptr;
+};
+
+} //namespace MssfQt
+
+#endif // PROTECTEDKEYVALUESTORE_H
@@ -0,0 +1,146 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef PROTECTEDKEYVALUESTORE_P_H
+#define PROTECTEDKEYVALUESTORE_P_H
+
+#include "protectedkeyvaluestore.h"
+#include "keyvaluerecord_p.h"
+
+#include <QtCore/QByteArray>
+#include <QtCore/QFuture>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMap>
+#include <QtCore/QMutex>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QString>
+
+namespace MssfQt
+{
+
+class MssfStorage;
+class ProtectedFile;
+
+class ProtectedKeyValueStorePrivate
+{
+public:
+
+    ProtectedKeyValueStorePrivate(const QSharedPointer<MssfStorage> &store, const QString &prefix);
+
+    ~ProtectedKeyValueStorePrivate();
+
+    //! Where the value of a record is.
+    struct Location {
+        //! The segment number, Pending if the record is still in the write buffer.
+        int segment;
+        quint32 offset;
+        quint32 length;
+    };
+
+    //! The accounting of one segment member.
+    struct Segment {
+        Segment() : size(0), dead(0) {}
+        //! The bytes of complete records.
+        quint32 size;
+        //! The bytes of overwritten and removed records.
+        quint32 dead;
+    };
+
+    enum {
+        Pending = -1,
+        HeaderSize = Internal::KeyValueRecord::HeaderSize,
+        Tombstone = Internal::KeyValueRecord::Tombstone
+    };
+
+    QString segmentName(int segment) const;
+
+    //! Read all segments into the index.
+    bool load();
+
+    //! Add the records of one segment to the index.
+    void scan(int segment, const QByteArray &data);
+
+    //! Count the current record of key as garbage.
+    void retire(const QByteArray &key);
+
+    QByteArray get(const QByteArray &key);
+
+    void put(const QByteArray &key, const QByteArray &value);
+
+    bool remove(const QByteArray &key);
+
+    bool contains(const QByteArray &key) const;
+
+    int count() const;
+
+    QList<QByteArray> keys() const;
+
+    int iterate(ProtectedKeyValueStore::Visitor visitor, void *context);
+
+    bool flush();
+
+    void setSegmentSize(quint32 bytes);
+
+    quint32 segmentSize() const;
+
+    quint64 garbageBytes() const;
+
+    //! An open read handle of a segment, kept until the segment is removed.
+    ProtectedFile *reader(int segment);
+
+    void closeReader(int segment);
+
+    //! Start a background compaction if it is worth it and none is running.
+    void maybeCompact();
+
+    //! The body of compact(), runs in the thread pool.
+    bool compact();
+
+    QFuture<bool> compactAsync();
+
+    //! Guards everything below, not held while a compaction copies records. Recursive as a flush may start a compaction.
+    mutable QMutex mutex;
+    QSharedPointer<MssfStorage> store;
+    QString prefix;
+    bool valid;
+    quint32 maxSegmentSize;
+    QHash<QByteArray, Location> index;
+    //! The segments by number, oldest first.
+    QMap<int, Segment> segments;
+    int nextSegment;
+    //! Encoded records not yet written and the keys whose records are in there.
+    QByteArray buffer;
+    QList<QByteArray> pendingKeys;
+    quint32 bufferDead;
+    QHash<int, ProtectedFile *> readers;
+    QFuture<bool> compaction;
+    //! Set by the destructor, no new compaction is started then.
+    bool closing;
+};
+
+} //namespace MssfQt
+
+#endif // PROTECTEDKEYVALUESTORE_P_H
@@ -0,0 +1,327 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "protectedlog.h"
+#include "protectedlog_p.h"
+#include "mssfstorage.h"
+
+#include <QtCore/QMutexLocker>
+#include <QtCore/QStringList>
+#include <QtCore/QtAlgorithms>
+#include <QtCore/QtEndian>
+
+using namespace MssfQt;
+
+static const quint32 CheckpointMagic = 0x4d514c43;  // "MQLC"
+//! Write a block once this many record bytes are pending.
+static const int FlushThreshold = 16 * 1024;
+static const quint32 DefaultCheckpointInterval = 256 * 1024;
+
+ProtectedLog::ProtectedLog(const QSharedPointer<MssfStorage> &store, const QString &pathname)
+    : d_ptr(new ProtectedLogPrivate(store, pathname))
+{
+}
+
+ProtectedLogPrivate::ProtectedLogPrivate(const QSharedPointer<MssfStorage> &store, const QString &pathname)
+    : mutex(QMutex::Recursive),
+      store(store),
+      pathname(pathname),
+      valid(false),
+      interval(DefaultCheckpointInterval),
+      sealed(0),
+      next(0),
+      unsealed(0),
+      chain(DigestSize, 0),
+      records(0),
+      bufferCount(0)
+{
+    valid = (store && recover());
+}
+
+ProtectedLog::~ProtectedLog()
+{
+}
+
+ProtectedLogPrivate::~ProtectedLogPrivate()
+{
+    if (valid)
+        checkpoint();
+}
+
+bool ProtectedLog::isValid() const
+{
+    return d_ptr->valid;
+}
+
+QString ProtectedLogPrivate::segmentName(int segment) const
+{
+    return pathname + QLatin1Char('.') + QString::number(segment);
+}
+
+QString ProtectedLogPrivate::checkpointName() const
+{
+    return pathname + QLatin1String(".checkpoint");
+}
+
+QList<int> ProtectedLogPrivate::segmentNumbers() const
+{
+    QList<int> numbers;
+    foreach(const QString &name, store->getFiles(pathname + QLatin1String(".*")))
+    {
+        bool ok = false;
+        QString suffix = name.mid(pathname.length() + 1);
+        int segment = suffix.toInt(&ok);
+        if (ok && segment >= 0 && suffix == QString::number(segment))
+            numbers.append(segment);
+    }
+    qSort(numbers);
+    return numbers;
+}
+
+bool ProtectedLogPrivate::recover()
+{
+    // a checkpoint torn by a crash is refused by the store, then the whole log is verified instead
+    QByteArray saved;
+    if (store->containsFile(checkpointName()))
+        saved = store->getFile(checkpointName());
+
+    if (!saved.isEmpty())
+    {
+        const uchar *bytes = reinterpret_cast<const uchar *>(saved.constData());
+        if (saved.size() != CheckpointSize || qFromBigEndian<quint32>(bytes) != CheckpointMagic)
+            return false;
+
+        sealed = qFromBigEndian<quint32>(bytes + 4);
+        records = qFromBigEndian<quint64>(bytes + 8);
+        chain = saved.mid(16, DigestSize);
+    }
+
+    QList<int> segments = segmentNumbers();
+    next = sealed;
+    if (!segments.isEmpty())
+        next = qMax(next, segments.last() + 1);
+
+    // the sealed blocks are trusted as they are, only the ones written after the checkpoint are read
+    bool changed = false;
+    bool broken = false;
+    foreach(int segment, segments)
+    {
+        if (segment < sealed)
+            continue;
+
+        // every member holds one block, nothing is returned if the store refuses it
+        QByteArray data = broken ? QByteArray() : store->getFile(segmentName(segment));
+        quint32 count = 0;
+        quint32 length = Internal::LogBlock::size(data.left(BlockHeaderSize), &count);
+        if (length == 0 || length != (quint32)data.size() || !Internal::LogBlock::verify(data, chain))
+        {
+            // a block that was not committed before a crash breaks the chain, it and everything
+            // after it is lost
+            store->removeFile(segmentName(segment));
+            broken = true;
+            changed = true;
+            continue;
+        }
+
+        chain = Internal::LogBlock::digest(data);
+        records += count;
+        unsealed += length;
+    }
+
+    if (changed)
+        store->commit();
+    return true;
+}
+
+bool ProtectedLog::append(const QByteArray &record)
+{
+    return d_ptr->append(record);
+}
+
+bool ProtectedLogPrivate::append(const QByteArray &record)
+{
+    QMutexLocker locker(&mutex);
+    Internal::LogBlock::appendRecord(buffer, record);
+    bufferCount++;
+
+    if (buffer.size() >= FlushThreshold)
+        return flush();
+    return true;
+}
+
+bool ProtectedLogPrivate::writeBlock()
+{
+    if (buffer.isEmpty())
+        return true;
+    if (!valid)
+        return false;
+
+    QByteArray block = Internal::LogBlock::encode(buffer, bufferCount, chain);
+
+    // every block is a member of its own that is never written again, the store index is only
+    // committed by the next checkpoint; keep the records pending if this fails
+    QString name = segmentName(next);
+    if (!store->putFile(name, block))
+    {
+        store->removeFile(name);
+        return false;
+    }
+
+    next++;
+    unsealed += block.size();
+    chain = Internal::LogBlock::digest(block);
+    records += bufferCount;
+    buffer.clear();
+    bufferCount = 0;
+    return true;
+}
+
+bool ProtectedLog::flush()
+{
+    return d_ptr->flush();
+}
+
+bool ProtectedLogPrivate::flush()
+{
+    QMutexLocker locker(&mutex);
+    if (!writeBlock())
+        return false;
+    if (unsealed >= interval)
+        return checkpoint();
+    return true;
+}
+
+bool ProtectedLog::checkpoint()
+{
+    return d_ptr->checkpoint();
+}
+
+bool ProtectedLogPrivate::checkpoint()
+{
+    QMutexLocker locker(&mutex);
+    if (!writeBlock())
+        return false;
+    if (sealed == next)
+        return true;
+
+    sealed = next;
+    unsealed = 0;
+
+    uchar header[16];
+    qToBigEndian<quint32>(CheckpointMagic, header);
+    qToBigEndian<quint32>(sealed, header + 4);
+    qToBigEndian<quint64>(records, header + 8);
+    QByteArray saved(reinterpret_cast<const char *>(header), sizeof(header));
+    saved.append(chain);
+
+    // the blocks are committed even if this fails, they are then verified again on the next open
+    bool ok = store->putFile(checkpointName(), saved);
+    store->commit();
+    if (!ok)
+        return false;
+
+    return true;
+}
+
+void ProtectedLog::setCheckpointInterval(quint32 bytes)
+{
+    d_ptr->setCheckpointInterval(bytes);
+}
+
+void ProtectedLogPrivate::setCheckpointInterval(quint32 bytes)
+{
+    QMutexLocker locker(&mutex);
+    interval = qMax(bytes, (quint32)FlushThreshold);
+}
+
+quint32 ProtectedLog::checkpointInterval() const
+{
+    return d_ptr->checkpointInterval();
+}
+
+quint32 ProtectedLogPrivate::checkpointInterval() const
+{
+    QMutexLocker locker(&mutex);
+    return interval;
+}
+
+quint64 ProtectedLog::count() const
+{
+    return d_ptr->count();
+}
+
+quint64 ProtectedLogPrivate::count() const
+{
+    QMutexLocker locker(&mutex);
+    return records + bufferCount;
+}
+
+qint64 ProtectedLog::replay(ProtectedLog::RecordVisitor visitor, void *context)
+{
+    return d_ptr->replay(visitor, context);
+}
+
+qint64 ProtectedLogPrivate::replay(ProtectedLog::RecordVisitor visitor, void *context)
+{
+    QMutexLocker locker(&mutex);
+    if (!visitor || !valid || !writeBlock())
+        return -1;
+
+    // numbers are not contiguous, a missing block breaks the chain instead
+    QByteArray previous(DigestSize, 0);
+    qint64 visited = 0;
+
+    foreach(int segment, segmentNumbers())
+    {
+        QByteArray data = store->getFile(segmentName(segment));
+        int at = 0;
+        while (at < data.size())
+        {
+            quint32 count = 0;
+            quint32 length = Internal::LogBlock::size(data.mid(at, BlockHeaderSize), &count);
+            if (length == 0 || at + length > (quint32)data.size())
+                return -1;
+
+            QByteArray block = QByteArray::fromRawData(data.constData() + at, length);
+            QList<QByteArray> blockRecords;
+            if (!Internal::LogBlock::verify(block, previous) || !Internal::LogBlock::records(block, count, &blockRecords))
+                return -1;
+            previous = Internal::LogBlock::digest(block);
+
+            foreach(const QByteArray &record, blockRecords)
+            {
+                visited++;
+                if (!visitor(record, context))
+                    return visited;
+            }
+            at += length;
+        }
+    }
+
+    // blocks missing at the end leave the chain intact, but not the count
+    if (visited != (qint64)records)
+        return -1;
+    return visited;
+}
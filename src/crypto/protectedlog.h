@@ -0,0 +1,150 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef PROTECTEDLOG_H
+#define PROTECTEDLOG_H
+
+#include "mssf-qt_global.h"
+
+#include <QtCore/QScopedPointer>
+#include <QtCore/QSharedPointer>
+
+class QByteArray;
+class QString;
+
+namespace MssfQt
+{
+
+class MssfStorage;
+class ProtectedLogPrivate;
+
+/*!
+  * \class ProtectedLog
+  * \brief An append only log of records in protected members.
+  *
+  * The records are written in blocks, each to a member of its own named pathname.N. Every block
+  * carries a SHA1 digest chained over all the blocks before it, which finds a torn or corrupted
+  * block, a lost block and blocks out of order. The digest is not keyed, protection against
+  * deliberate changes comes from the store: the blocks and the checkpoint are ordinary protected
+  * members.
+  *
+  * Appends are collected in memory and written as one block when enough of them are pending or
+  * on \ref flush. A block member is written once and never changed, so a flush costs the size of
+  * its block only. The store index is committed by a checkpoint, which also saves the chain digest
+  * to the protected member pathname.checkpoint; the blocks written after the last checkpoint are
+  * lost if the process ends without one. A checkpoint is made once \ref checkpointInterval bytes
+  * of blocks have been written since the last one.
+  *
+  * Opening a log does not read the checkpointed blocks. Only the blocks written after the last
+  * checkpoint are verified against the chain, or the whole log if the checkpoint cannot be read.
+  * A block that is broken or that the store refuses to open is dropped together with everything
+  * after it.
+  */
+class MSSFQTSHARED_EXPORT ProtectedLog
+{
+public:
+
+    /*!
+      * \typedef RecordVisitor
+      * \brief Called by \ref replay for every record.
+      * \returns true to continue, false to stop.
+      */
+    typedef bool (*RecordVisitor)(const QByteArray &record, void *context);
+
+    /*!
+      * \brief Constructor, opens or creates the log and recovers the records after the last checkpoint
+      * \param store The store holding the log.
+      * \param pathname The name of the log, the members are named after it.
+      */
+    ProtectedLog(const QSharedPointer<MssfStorage> &store, const QString &pathname);
+
+    /*!
+      * \brief Destructor, writes a checkpoint.
+      */
+    ~ProtectedLog();
+
+    /*!
+      * \brief Could the log be opened
+      * \returns false if the store is missing or the checkpoint could not be read.
+      */
+    bool isValid() const;
+
+    /*!
+      * \brief Append a record
+      * \param record The contents of the record.
+      * \returns false if pending records had to be written and that failed.
+      */
+    bool append(const QByteArray &record);
+
+    /*!
+      * \brief Write the pending records as a block
+      * \returns true on success, false otherwise.
+      *
+      * A checkpoint is made if the blocks written since the last one reach the \ref checkpointInterval.
+      */
+    bool flush();
+
+    /*!
+      * \brief Write the pending records and make a checkpoint
+      * \returns true on success, false otherwise.
+      */
+    bool checkpoint();
+
+    /*!
+      * \brief Set the size of the blocks written after which a checkpoint is made
+      * \param bytes The size, 256 KiB by default.
+      */
+    void setCheckpointInterval(quint32 bytes);
+
+    /*!
+      * \brief The size of the blocks written after which a checkpoint is made
+      */
+    quint32 checkpointInterval() const;
+
+    /*!
+      * \brief The number of records in the log, including the pending ones
+      */
+    quint64 count() const;
+
+    /*!
+      * \brief Read the whole log and verify the chain
+      * \param visitor Called for every record, oldest first.
+      * \param context Passed to the visitor as is.
+      * \returns The number of records visited, or -1 if a block is missing or the chain is broken.
+      * Blocks missing at the end are found by comparing the number of records with \ref count.
+      *
+      * The log is locked while the visitor runs, it must not append to the log.
+      */
+    qint64 replay(RecordVisitor visitor, void *context);
+
+private:
+    Q_DISABLE_COPY(ProtectedLog)
+    //! internal private implementation
+    QScopedPointer<ProtectedLogPrivate> d_ptr;
+};
+
+} //namespace MssfQt
+
+#endif // PROTECTEDLOG_H
@@ -0,0 +1,108 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef PROTECTEDLOG_P_H
+#define PROTECTEDLOG_P_H
+
+#include "protectedlog.h"
+#include "logblock_p.h"
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QString>
+
+namespace MssfQt
+{
+
+class MssfStorage;
+
+class ProtectedLogPrivate
+{
+public:
+
+    ProtectedLogPrivate(const QSharedPointer<MssfStorage> &store, const QString &pathname);
+
+    ~ProtectedLogPrivate();
+
+    enum {
+        BlockHeaderSize = Internal::LogBlock::HeaderSize,
+        DigestSize = Internal::LogBlock::DigestSize,
+        //! [magic][first unsealed block][record count][chain digest]
+        CheckpointSize = 16 + DigestSize
+    };
+
+    QString segmentName(int segment) const;
+
+    QString checkpointName() const;
+
+    //! The numbers of the existing block members, ascending.
+    QList<int> segmentNumbers() const;
+
+    //! Read the checkpoint and verify the blocks written after it.
+    bool recover();
+
+    //! Write the pending records as one block member, without a checkpoint or a commit.
+    bool writeBlock();
+
+    bool append(const QByteArray &record);
+
+    bool flush();
+
+    bool checkpoint();
+
+    void setCheckpointInterval(quint32 bytes);
+
+    quint32 checkpointInterval() const;
+
+    quint64 count() const;
+
+    qint64 replay(ProtectedLog::RecordVisitor visitor, void *context);
+
+    //! Recursive as a flush may make a checkpoint.
+    mutable QMutex mutex;
+    QSharedPointer<MssfStorage> store;
+    QString pathname;
+    bool valid;
+    quint32 interval;
+    //! The block members below this are covered by the checkpoint.
+    int sealed;
+    //! The number the next written block gets, numbers are never reused.
+    int next;
+    //! The bytes of the blocks written after the checkpoint.
+    quint32 unsealed;
+    //! The digest of the last written block, all zero for an empty log.
+    QByteArray chain;
+    //! The records written so far.
+    quint64 records;
+    //! Encoded records not yet written.
+    QByteArray buffer;
+    quint32 bufferCount;
+};
+
+} //namespace MssfQt
+
+#endif // PROTECTEDLOG_P_H
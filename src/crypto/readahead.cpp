@@ -0,0 +1,208 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "readahead_p.h"
+#include "protectedfile_p.h"
+
+#include <QtCore/QMutexLocker>
+#include <QtCore/QtConcurrentRun>
+
+#include <string.h>
+
+using namespace MssfQt;
+using namespace MssfQt::Internal;
+
+ReadAhead::ReadAhead(ProtectedFilePrivate *file, quintptr limit)
+    : file(file),
+      maxBytes(limit),
+      dataStart(0),
+      dataEnd(0),
+      target(0),
+      expected(0),
+      window(qMin<quintptr>(Chunk, limit)),
+      running(false),
+      cancelled(false),
+      ended(false)
+{
+}
+
+ReadAhead::~ReadAhead()
+{
+    QMutexLocker locker(&mutex);
+    stop(locker);
+}
+
+quintptr ReadAhead::limit() const
+{
+    return maxBytes;
+}
+
+qint64 ReadAhead::read(quint64 at, char *buf, quintptr len)
+{
+    QMutexLocker locker(&mutex);
+    bool sequential = (at == expected);
+
+    quintptr done = 0;
+    if (sequential)
+    {
+        done = take(at, buf, len);
+    }
+    else
+    {
+        stop(locker);
+        chunks.clear();
+        dataStart = dataEnd = target = at;
+        window = qMin<quintptr>(Chunk, maxBytes);
+        ended = false;
+    }
+
+    if (done < len)
+    {
+        // beyond what the worker has or will have, it would only read the same data again
+        stop(locker);
+        chunks.clear();
+
+        qint64 count = file->readFile(at + done, buf + done, len - done);
+        if (count < 0)
+        {
+            dataStart = dataEnd = target = expected = at + done;
+            return (done > 0 ? (qint64)done : -1);
+        }
+
+        ended = ((quintptr)count < len - done);
+        done += count;
+        dataStart = dataEnd = target = at + done;
+    }
+
+    discard(at + done);
+    expected = at + done;
+
+    if (sequential && !ended)
+    {
+        window = qMin<quintptr>(window * 2, maxBytes);
+        target = qMax<quint64>(target, expected + window);
+        if (!running && dataEnd < target)
+        {
+            running = true;
+            worker = QtConcurrent::run(this, &ReadAhead::fetch);
+        }
+    }
+
+    return done;
+}
+
+void ReadAhead::invalidate()
+{
+    QMutexLocker locker(&mutex);
+    stop(locker);
+    chunks.clear();
+    dataStart = dataEnd = target = expected;
+    window = qMin<quintptr>(Chunk, maxBytes);
+    ended = false;
+}
+
+void ReadAhead::fetch()
+{
+    QMutexLocker locker(&mutex);
+    while (!cancelled && dataEnd < target)
+    {
+        quint64 from = dataEnd;
+        quintptr length = qMin<quint64>(Chunk, target - from);
+
+        // the reader works on the earlier chunks meanwhile
+        locker.unlock();
+        QByteArray chunk;
+        chunk.resize(length);
+        qint64 count = file->readFile(from, chunk.data(), length);
+        locker.relock();
+
+        if (cancelled)
+            break;
+
+        if (count > 0)
+        {
+            chunk.resize(count);
+            chunks.enqueue(chunk);
+            dataEnd += count;
+        }
+        ended = (count < (qint64)length);
+        changed.wakeAll();
+        if (ended)
+            break;
+    }
+
+    running = false;
+    changed.wakeAll();
+}
+
+quintptr ReadAhead::take(quint64 at, char *buf, quintptr len)
+{
+    quintptr done = 0;
+    while (done < len)
+    {
+        quint64 pos = at + done;
+        if (pos < dataStart)
+            break;
+
+        if (pos >= dataEnd)
+        {
+            // only wait for data the worker is going to read
+            if (!running || pos >= target)
+                break;
+            changed.wait(&mutex);
+            continue;
+        }
+
+        quint64 start = dataStart;
+        int i = 0;
+        while (start + chunks.at(i).size() <= pos)
+            start += chunks.at(i++).size();
+
+        const QByteArray &chunk = chunks.at(i);
+        quintptr offset = pos - start;
+        quintptr count = qMin<quint64>(len - done, chunk.size() - offset);
+        memcpy(buf + done, chunk.constData() + offset, count);
+        done += count;
+    }
+    return done;
+}
+
+void ReadAhead::discard(quint64 at)
+{
+    while (!chunks.isEmpty() && dataStart + chunks.head().size() <= at)
+        dataStart += chunks.dequeue().size();
+}
+
+void ReadAhead::stop(QMutexLocker &locker)
+{
+    if (!running)
+        return;
+
+    cancelled = true;
+    locker.unlock();
+    worker.waitForFinished();
+    locker.relock();
+    cancelled = false;
+}
@@ -0,0 +1,125 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef READAHEAD_P_H
+#define READAHEAD_P_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QFuture>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
+#include <QtCore/QWaitCondition>
+
+namespace MssfQt
+{
+
+class ProtectedFilePrivate;
+
+namespace Internal
+{
+
+/*!
+  * \class ReadAhead
+  * \brief Prefetches the data following sequential reads of a \ref ProtectedFile.
+  *
+  * A read that starts where the previous one ended is sequential. It is served from the
+  * prefetched data, waiting for the worker if the data is on its way, and the worker is then
+  * asked to keep the next window filled. The window starts at \ref Chunk and doubles with every
+  * sequential read up to the limit, which also caps the data held. Any other read drops the
+  * prefetched data and reads directly.
+  *
+  * The worker reads under the shared lock of the file like any other reader. Whatever changes
+  * the file calls \ref invalidate afterwards, which drops the data read before the change.
+  */
+class ReadAhead
+{
+public:
+
+    enum {
+        //! The size of a single read of the worker and the initial window.
+        Chunk = 64 * 1024
+    };
+
+    /*!
+      * \brief Constructor
+      * \param file The file to read from, it must outlive this.
+      * \param limit The most bytes prefetched ahead of the reader.
+      */
+    ReadAhead(ProtectedFilePrivate *file, quintptr limit);
+
+    /*!
+      * \brief Destructor, waits for the worker.
+      */
+    ~ReadAhead();
+
+    quintptr limit() const;
+
+    //! Read, from the prefetched data as far as possible. \sa ProtectedFile::readInto
+    qint64 read(quint64 at, char *buf, quintptr len);
+
+    //! Wait for the worker to stop and drop the prefetched data, the file has changed.
+    void invalidate();
+
+private:
+
+    //! The worker, reads chunks until the target is reached.
+    void fetch();
+
+    //! Copy the prefetched data at at, waiting for the worker if needed. \returns The bytes copied.
+    quintptr take(quint64 at, char *buf, quintptr len);
+
+    //! Drop the chunks that end before at.
+    void discard(quint64 at);
+
+    //! Stop the worker, called with the mutex held through locker.
+    void stop(QMutexLocker &locker);
+
+    ProtectedFilePrivate *file;
+    quintptr maxBytes;
+    mutable QMutex mutex;
+    //! Signalled when the worker adds a chunk or stops.
+    QWaitCondition changed;
+    QFuture<void> worker;
+    //! The prefetched data, contiguous from dataStart to dataEnd.
+    QQueue<QByteArray> chunks;
+    quint64 dataStart;
+    quint64 dataEnd;
+    //! Where the worker stops.
+    quint64 target;
+    //! Where the next sequential read starts.
+    quint64 expected;
+    //! The current window size.
+    quintptr window;
+    bool running;
+    bool cancelled;
+    //! The worker hit the end of the file or an error, the reader finds out by itself.
+    bool ended;
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+#endif // READAHEAD_P_H
@@ -0,0 +1,223 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "storagecache_p.h"
+
+#include <QtCore/QMutexLocker>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+
+using namespace MssfQt;
+using namespace MssfQt::Internal;
+
+//! The memory of a cache entry is locked in whole pages.
+static quint32 pageRound(quint32 length)
+{
+    static const quint32 pageSize = sysconf(_SC_PAGESIZE);
+    if (length == 0)
+        return pageSize;
+    return ((length + pageSize - 1) / pageSize) * pageSize;
+}
+
+//! memset() that the compiler is not allowed to optimise away.
+static void secureZero(char *buffer, quint32 length)
+{
+    volatile char *p = buffer;
+    while (length--)
+        *p++ = 0;
+}
+
+StorageCache::StorageCache(quint32 limit)
+    : head(NULL),
+      tail(NULL),
+      maxBytes(limit),
+      usedBytes(0),
+      hits(0),
+      misses(0),
+      evictions(0)
+{
+}
+
+StorageCache::~StorageCache()
+{
+    clear();
+}
+
+void StorageCache::setLimit(quint32 limit)
+{
+    QMutexLocker locker(&mutex);
+    maxBytes = limit;
+    trim(maxBytes);
+}
+
+quint32 StorageCache::limit() const
+{
+    QMutexLocker locker(&mutex);
+    return maxBytes;
+}
+
+bool StorageCache::find(const QByteArray &key, QByteArray *data)
+{
+    QMutexLocker locker(&mutex);
+    Entry *entry = entries.value(key, NULL);
+    if (!entry)
+    {
+        misses++;
+        return false;
+    }
+
+    hits++;
+    unlink(entry);
+    pushFront(entry);
+    *data = QByteArray(entry->buffer, entry->length);
+    return true;
+}
+
+void StorageCache::insert(const QByteArray &key, const QByteArray &data)
+{
+    QMutexLocker locker(&mutex);
+
+    Entry *old = entries.take(key);
+    if (old)
+    {
+        unlink(old);
+        release(old);
+    }
+
+    quint32 footprint = pageRound(data.size());
+    if (footprint > maxBytes)
+        return;
+
+    trim(maxBytes - footprint);
+
+    void *buffer = mmap(NULL, footprint, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        return;
+
+    // plaintext that cannot be kept out of swap is not cached at all
+    if (mlock(buffer, footprint) != 0)
+    {
+        munmap(buffer, footprint);
+        return;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(buffer, footprint, MADV_DONTDUMP);
+#endif
+
+    Entry *entry = new Entry;
+    entry->key = key;
+    entry->buffer = static_cast<char *>(buffer);
+    entry->length = data.size();
+    entry->footprint = footprint;
+    memcpy(entry->buffer, data.constData(), data.size());
+
+    pushFront(entry);
+    entries.insert(key, entry);
+    usedBytes += footprint;
+}
+
+void StorageCache::remove(const QByteArray &key)
+{
+    QMutexLocker locker(&mutex);
+    Entry *entry = entries.take(key);
+    if (!entry)
+        return;
+
+    unlink(entry);
+    release(entry);
+}
+
+void StorageCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    while (head)
+    {
+        Entry *entry = head;
+        unlink(entry);
+        release(entry);
+    }
+    entries.clear();
+}
+
+MssfStorage::CacheStatistics StorageCache::statistics() const
+{
+    QMutexLocker locker(&mutex);
+    MssfStorage::CacheStatistics stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.evictions = evictions;
+    stats.entries = entries.count();
+    stats.bytes = usedBytes;
+    return stats;
+}
+
+void StorageCache::unlink(Entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        tail = entry->prev;
+
+    entry->prev = entry->next = NULL;
+}
+
+void StorageCache::pushFront(Entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = head;
+    if (head)
+        head->prev = entry;
+    head = entry;
+    if (!tail)
+        tail = entry;
+}
+
+void StorageCache::release(Entry *entry)
+{
+    usedBytes -= entry->footprint;
+    secureZero(entry->buffer, entry->footprint);
+    munlock(entry->buffer, entry->footprint);
+    munmap(entry->buffer, entry->footprint);
+    delete entry;
+}
+
+void StorageCache::trim(quint32 limit)
+{
+    while (tail && usedBytes > limit)
+    {
+        Entry *entry = tail;
+        unlink(entry);
+        entries.remove(entry->key);
+        release(entry);
+        evictions++;
+    }
+}
@@ -0,0 +1,137 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef STORAGECACHE_P_H
+#define STORAGECACHE_P_H
+
+#include "mssfstorage.h"
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+
+namespace MssfQt
+{
+
+namespace Internal
+{
+
+/*!
+  * \class StorageCache
+  * \brief A bounded LRU cache of decrypted store members.
+  *
+  * Every cached buffer lives in its own anonymous mapping that is locked into RAM, so plaintext
+  * never reaches the swap, and the buffer is wiped before it is unmapped. Entries whose memory
+  * cannot be locked are simply not cached.
+  */
+class StorageCache
+{
+public:
+
+    /*!
+      * \brief Constructor
+      * \param limit The maximum number of bytes of locked memory the cache may use.
+      */
+    StorageCache(quint32 limit);
+
+    /*!
+      * \brief Destructor, wipes and releases all entries.
+      */
+    ~StorageCache();
+
+    /*!
+      * \brief Change the byte budget, evicting entries if needed.
+      */
+    void setLimit(quint32 limit);
+
+    /*!
+      * \brief The byte budget of the cache.
+      */
+    quint32 limit() const;
+
+    /*!
+      * \brief Look up a member.
+      * \param key The UTF-8 pathname of the member.
+      * \param data (out) The cached contents, untouched on a miss.
+      * \returns true on a hit, false otherwise.
+      */
+    bool find(const QByteArray &key, QByteArray *data);
+
+    /*!
+      * \brief Add or replace a member.
+      * \param key The UTF-8 pathname of the member.
+      * \param data The plaintext contents.
+      */
+    void insert(const QByteArray &key, const QByteArray &data);
+
+    /*!
+      * \brief Drop a single member, NOP if it is not cached.
+      */
+    void remove(const QByteArray &key);
+
+    /*!
+      * \brief Drop all members.
+      */
+    void clear();
+
+    /*!
+      * \brief Current hit/miss counters and usage.
+      */
+    MssfStorage::CacheStatistics statistics() const;
+
+private:
+
+    //! A cached member, chained into the LRU list with the most recently used first.
+    struct Entry
+    {
+        QByteArray key;
+        char *buffer;
+        quint32 length;
+        quint32 footprint;
+        Entry *prev;
+        Entry *next;
+    };
+
+    void unlink(Entry *entry);
+    void pushFront(Entry *entry);
+    void release(Entry *entry);
+    void trim(quint32 limit);
+
+    mutable QMutex mutex;
+    QHash<QByteArray, Entry *> entries;
+    Entry *head;
+    Entry *tail;
+    quint32 maxBytes;
+    quint32 usedBytes;
+    quint64 hits;
+    quint64 misses;
+    quint64 evictions;
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+#endif // STORAGECACHE_P_H
@@ -0,0 +1,274 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "storagemetrics.h"
+#include "storagemetrics_p.h"
+
+#ifdef MSSFQT_METRICS
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QThreadStorage>
+#endif
+
+#include <string.h>
+
+using namespace MssfQt;
+
+static const char *const operationNames[StorageMetrics::OperationCount] = {
+    "storage.remove_all_files",
+    "storage.get_files",
+    "storage.get_ufiles",
+    "storage.contains_file",
+    "storage.contains_link",
+    "storage.add_link",
+    "storage.add_file",
+    "storage.put_file",
+    "storage.remove_file",
+    "storage.remove_link",
+    "storage.rename",
+    "storage.read_link",
+    "storage.verify_file",
+    "storage.get_file",
+    "storage.verify_content",
+    "storage.commit",
+    "storage.member",
+    "storage.stat_file",
+    "storage.stat_files",
+    "storage.usage",
+    "storage.remove_files",
+    "storage.rename_prefix",
+    "storage.open_member",
+    "file.open",
+    "file.read",
+    "file.write",
+    "file.trunc",
+    "file.close",
+    "file.status",
+    "file.digest",
+    "file.rename",
+    "file.chmod",
+    "file.chown",
+    "file.utime",
+    "file.send_to"
+};
+
+#ifdef MSSFQT_METRICS
+
+namespace
+{
+//! The counters of one thread, only ever written by that thread.
+struct ThreadMetrics
+{
+    ThreadMetrics();
+    ~ThreadMetrics();
+
+    //! 64 bit counters are not written atomically everywhere, a snapshot must not read them half done.
+    //! Only contended while another thread takes a snapshot, taken after the registry mutex.
+    QMutex mutex;
+    StorageMetrics::OperationStats ops[StorageMetrics::OperationCount];
+};
+
+//! All live thread blocks plus the totals of the threads that have exited.
+struct MetricsRegistry
+{
+    MetricsRegistry()
+    {
+        memset(retired, 0, sizeof(retired));
+        memset(baseline, 0, sizeof(baseline));
+    }
+
+    QMutex mutex;
+    QList<ThreadMetrics *> threads;
+    StorageMetrics::OperationStats retired[StorageMetrics::OperationCount];
+    //! Subtracted from every snapshot, set by reset() so other threads' blocks need not be written.
+    StorageMetrics::OperationStats baseline[StorageMetrics::OperationCount];
+};
+}
+
+Q_GLOBAL_STATIC(MetricsRegistry, metricsRegistry)
+Q_GLOBAL_STATIC(QThreadStorage<ThreadMetrics *>, threadMetrics)
+
+static void accumulate(StorageMetrics::OperationStats *to, const StorageMetrics::OperationStats *from)
+{
+    for (int i = 0; i < StorageMetrics::OperationCount; i++)
+    {
+        to[i].calls += from[i].calls;
+        to[i].failures += from[i].failures;
+        to[i].bytes += from[i].bytes;
+        for (int b = 0; b < StorageMetrics::LatencyBuckets; b++)
+            to[i].latency[b] += from[i].latency[b];
+    }
+}
+
+ThreadMetrics::ThreadMetrics()
+{
+    memset(ops, 0, sizeof(ops));
+
+    MetricsRegistry *registry = metricsRegistry();
+    if (!registry)
+        return;
+    QMutexLocker locker(&registry->mutex);
+    registry->threads.append(this);
+}
+
+ThreadMetrics::~ThreadMetrics()
+{
+    // may run after the registry is gone when the process exits
+    MetricsRegistry *registry = metricsRegistry();
+    if (!registry)
+        return;
+    QMutexLocker locker(&registry->mutex);
+    registry->threads.removeAll(this);
+    QMutexLocker opsLocker(&mutex);
+    accumulate(registry->retired, ops);
+}
+
+static int latencyBucket(quint64 usec)
+{
+    int bucket = 0;
+    while (usec && bucket < StorageMetrics::LatencyBuckets - 1)
+    {
+        usec >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+Internal::ScopedMeasure::ScopedMeasure(StorageMetrics::Operation op)
+    : op(op),
+      bytes(0),
+      failed(false)
+{
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+Internal::ScopedMeasure::~ScopedMeasure()
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    quint64 usec = (quint64)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    QThreadStorage<ThreadMetrics *> *storage = threadMetrics();
+    if (!storage)
+        return;
+    if (!storage->hasLocalData())
+        storage->setLocalData(new ThreadMetrics);
+
+    ThreadMetrics *thread = storage->localData();
+    QMutexLocker locker(&thread->mutex);
+    StorageMetrics::OperationStats &stats = thread->ops[op];
+    stats.calls++;
+    stats.bytes += bytes;
+    if (failed)
+        stats.failures++;
+    stats.latency[latencyBucket(usec)]++;
+}
+
+void Internal::ScopedMeasure::addBytes(qint64 count)
+{
+    if (count > 0)
+        bytes += count;
+}
+
+void Internal::ScopedMeasure::setResult(bool ok)
+{
+    failed = !ok;
+}
+
+#endif // MSSFQT_METRICS
+
+bool StorageMetrics::isEnabled()
+{
+#ifdef MSSFQT_METRICS
+    return true;
+#else
+    return false;
+#endif
+}
+
+QVector<StorageMetrics::OperationStats> StorageMetrics::snapshot()
+{
+    QVector<OperationStats> result;
+
+#ifdef MSSFQT_METRICS
+    MetricsRegistry *registry = metricsRegistry();
+    if (!registry)
+        return result;
+
+    OperationStats total[OperationCount];
+    memset(total, 0, sizeof(total));
+
+    {
+        QMutexLocker locker(&registry->mutex);
+        accumulate(total, registry->retired);
+        foreach(ThreadMetrics *thread, registry->threads)
+        {
+            QMutexLocker opsLocker(&thread->mutex);
+            accumulate(total, thread->ops);
+        }
+
+        for (int i = 0; i < OperationCount; i++)
+        {
+            total[i].calls -= registry->baseline[i].calls;
+            total[i].failures -= registry->baseline[i].failures;
+            total[i].bytes -= registry->baseline[i].bytes;
+            for (int b = 0; b < LatencyBuckets; b++)
+                total[i].latency[b] -= registry->baseline[i].latency[b];
+        }
+    }
+
+    result.resize(OperationCount);
+    for (int i = 0; i < OperationCount; i++)
+        result[i] = total[i];
+#endif
+
+    return result;
+}
+
+void StorageMetrics::reset()
+{
+#ifdef MSSFQT_METRICS
+    MetricsRegistry *registry = metricsRegistry();
+    if (!registry)
+        return;
+
+    QMutexLocker locker(&registry->mutex);
+    memset(registry->baseline, 0, sizeof(registry->baseline));
+    accumulate(registry->baseline, registry->retired);
+    foreach(ThreadMetrics *thread, registry->threads)
+    {
+        QMutexLocker opsLocker(&thread->mutex);
+        accumulate(registry->baseline, thread->ops);
+    }
+#endif
+}
+
+const char *StorageMetrics::operationName(StorageMetrics::Operation op)
+{
+    if (op < 0 || op >= OperationCount)
+        return "";
+    return operationNames[op];
+}
@@ -0,0 +1,136 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef STORAGEMETRICS_H
+#define STORAGEMETRICS_H
+
+#include "mssf-qt_global.h"
+
+#include <QtCore/QVector>
+
+namespace MssfQt
+{
+
+/*!
+  * \class StorageMetrics
+  * \brief Process wide counters of the \ref MssfStorage and \ref ProtectedFile operations.
+  *
+  * The counters are only collected if the library was built with CONFIG+=metrics, otherwise
+  * the instrumentation is compiled out and \ref snapshot returns an empty vector.
+  *
+  * Every thread counts into its own block under a lock of its own, which only a snapshot ever
+  * competes for. A snapshot adds up consistent blocks, but calls still running in other threads
+  * are not counted until they finish.
+  */
+class MSSFQTSHARED_EXPORT StorageMetrics
+{
+public:
+
+    /*!
+      * \enum Operation
+      * \brief The measured entry points.
+      */
+    enum Operation {
+        StorageRemoveAllFiles,
+        StorageGetFiles,
+        StorageGetUFiles,
+        StorageContainsFile,
+        StorageContainsLink,
+        StorageAddLink,
+        StorageAddFile,
+        StoragePutFile,         /*!< Also counts the streaming putFile, bytes are the bytes written. */
+        StorageRemoveFile,
+        StorageRemoveLink,
+        StorageRename,
+        StorageReadLink,
+        StorageVerifyFile,
+        StorageGetFile,         /*!< Also counts the streaming getFile, bytes are the bytes read. */
+        StorageVerifyContent,
+        StorageCommit,
+        StorageMember,
+        StorageStatFile,
+        StorageStatFiles,
+        StorageUsage,
+        StorageRemoveFiles,
+        StorageRenamePrefix,
+        StorageOpenMember,      /*!< Counts pooled handles as well, failures are failed opens. */
+        FileOpen,
+        FileRead,
+        FileWrite,
+        FileTrunc,
+        FileClose,
+        FileStatus,
+        FileDigest,
+        FileRename,
+        FileChmod,
+        FileChown,
+        FileUtime,
+        FileSendTo,             /*!< Bytes are the bytes sent. */
+        OperationCount          /*!< The number of operations, not an operation. */
+    };
+
+    enum {
+        //! Bucket 0 counts calls under 1 microsecond, bucket i calls of [2^(i-1), 2^i) microseconds.
+        LatencyBuckets = 28
+    };
+
+    /*!
+      * \struct OperationStats
+      * \brief The counters of one operation.
+      */
+    struct OperationStats {
+        quint64 calls;                      /*!< calls    - Number of completed calls. */
+        quint64 failures;                   /*!< failures - Number of calls that reported an error. */
+        quint64 bytes;                      /*!< bytes    - Payload bytes read or written. */
+        quint64 latency[LatencyBuckets];    /*!< latency  - Log2 histogram of the call durations. */
+    };
+
+    /*!
+      * \brief Are the metrics compiled in
+      * \returns true if the library was built with CONFIG+=metrics.
+      */
+    static bool isEnabled();
+
+    /*!
+      * \brief Get the current counters
+      * \returns One entry per \ref Operation, indexed by it, or an empty vector if the metrics are
+      * not compiled in.
+      */
+    static QVector<OperationStats> snapshot();
+
+    /*!
+      * \brief Start counting from zero again.
+      */
+    static void reset();
+
+    /*!
+      * \brief A stable name of an operation, suitable for exporting.
+      */
+    static const char *operationName(StorageMetrics::Operation op);
+};
+
+} //namespace MssfQt
+
+#endif // STORAGEMETRICS_H
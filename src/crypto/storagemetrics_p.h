@@ -0,0 +1,82 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef STORAGEMETRICS_P_H
+#define STORAGEMETRICS_P_H
+
+#include "storagemetrics.h"
+
+#ifdef MSSFQT_METRICS
+
+#include <time.h>
+
+namespace MssfQt
+{
+
+namespace Internal
+{
+
+/*!
+  * \class ScopedMeasure
+  * \brief Times an operation from construction to destruction and records it.
+  */
+class ScopedMeasure
+{
+public:
+    ScopedMeasure(StorageMetrics::Operation op);
+    ~ScopedMeasure();
+
+    //! Count payload bytes, negative values (errors) are ignored.
+    void addBytes(qint64 count);
+
+    //! Record whether the operation succeeded.
+    void setResult(bool ok);
+
+private:
+    StorageMetrics::Operation op;
+    struct timespec start;
+    quint64 bytes;
+    bool failed;
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+//! Measure the enclosing scope as the given StorageMetrics::Operation.
+#define MSSFQT_MEASURE(op) MssfQt::Internal::ScopedMeasure mssfqtMeasure(MssfQt::StorageMetrics::op)
+#define MSSFQT_MEASURE_BYTES(count) mssfqtMeasure.addBytes(count)
+#define MSSFQT_MEASURE_RESULT(ok) mssfqtMeasure.setResult(ok)
+
+#else
+
+// the arguments are side effect free, they are only named to keep the compiler quiet
+#define MSSFQT_MEASURE(op)
+#define MSSFQT_MEASURE_BYTES(count) ((void)(count))
+#define MSSFQT_MEASURE_RESULT(ok) ((void)(ok))
+
+#endif // MSSFQT_METRICS
+
+#endif // STORAGEMETRICS_P_H
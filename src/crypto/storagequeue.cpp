@@ -0,0 +1,131 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "storagequeue_p.h"
+
+#include <QtCore/QMutexLocker>
+#include <QtCore/QThread>
+
+using namespace MssfQt::Internal;
+
+StorageTask::StorageTask(const QByteArray &pathname, bool barrier)
+    : pathname(pathname),
+      barrier(barrier),
+      queue(NULL)
+{
+}
+
+StorageTask::~StorageTask()
+{
+}
+
+void StorageTask::run()
+{
+    execute();
+    // the pool deletes the task once this returns
+    queue->finished(this);
+}
+
+StorageQueue::StorageQueue()
+    : pending(0),
+      barrierRunning(false)
+{
+    pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+StorageQueue::~StorageQueue()
+{
+    // finishing tasks start their successors before returning, so this waits for everything
+    pool.waitForDone();
+}
+
+void StorageQueue::submit(StorageTask *task)
+{
+    QMutexLocker locker(&mutex);
+    task->queue = this;
+
+    if (task->barrier || barrierRunning || !held.isEmpty())
+    {
+        held.enqueue(task);
+        drain();
+        return;
+    }
+
+    schedule(task);
+}
+
+void StorageQueue::finished(StorageTask *task)
+{
+    QMutexLocker locker(&mutex);
+
+    if (task->barrier)
+    {
+        barrierRunning = false;
+    }
+    else
+    {
+        QQueue<StorageTask *> &strand = strands[task->pathname];
+        strand.dequeue();
+        pending--;
+
+        if (strand.isEmpty())
+            strands.remove(task->pathname);
+        else
+            pool.start(strand.head());
+    }
+
+    drain();
+}
+
+void StorageQueue::schedule(StorageTask *task)
+{
+    QQueue<StorageTask *> &strand = strands[task->pathname];
+    strand.enqueue(task);
+    pending++;
+
+    if (strand.count() == 1)
+        pool.start(task);
+}
+
+void StorageQueue::drain()
+{
+    while (!barrierRunning && !held.isEmpty())
+    {
+        StorageTask *next = held.head();
+        if (next->barrier)
+        {
+            if (pending > 0)
+                return;
+
+            held.dequeue();
+            barrierRunning = true;
+            pool.start(next);
+            return;
+        }
+
+        held.dequeue();
+        schedule(next);
+    }
+}
@@ -0,0 +1,136 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef STORAGEQUEUE_P_H
+#define STORAGEQUEUE_P_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
+#include <QtCore/QRunnable>
+#include <QtCore/QThreadPool>
+
+namespace MssfQt
+{
+
+namespace Internal
+{
+
+class StorageQueue;
+
+/*!
+  * \class StorageTask
+  * \brief A unit of work for a \ref StorageQueue.
+  *
+  * A task either operates on a single member, identified by its pathname, or is a barrier that
+  * operates on the whole store.
+  */
+class StorageTask : public QRunnable
+{
+    friend class StorageQueue;
+
+public:
+
+    /*!
+      * \brief Constructor
+      * \param pathname The UTF-8 name of the member the task operates on, ignored for barriers.
+      * \param barrier true if the task operates on the whole store.
+      */
+    StorageTask(const QByteArray &pathname, bool barrier = false);
+
+    /*!
+      * \brief Destructor
+      */
+    virtual ~StorageTask();
+
+protected:
+
+    /*!
+      * \brief Do the actual work and report the result, called on a worker thread.
+      */
+    virtual void execute() = 0;
+
+private:
+
+    void run();
+
+    QByteArray pathname;
+    bool barrier;
+    StorageQueue *queue;
+};
+
+/*!
+  * \class StorageQueue
+  * \brief Runs the asynchronous operations of one store on worker threads.
+  *
+  * Tasks on the same member run one at a time in submission order, tasks on different members
+  * may run in parallel as far as the queue is concerned; the tasks of MssfStorage still wait for
+  * the lock of the store. A barrier runs alone: it waits for every task submitted before it, and
+  * every task submitted after it waits for the barrier.
+  */
+class StorageQueue
+{
+    friend class StorageTask;
+
+public:
+
+    /*!
+      * \brief Constructor
+      */
+    StorageQueue();
+
+    /*!
+      * \brief Destructor, waits for all submitted tasks to complete.
+      */
+    ~StorageQueue();
+
+    /*!
+      * \brief Queue a task, the queue takes ownership of it.
+      */
+    void submit(StorageTask *task);
+
+private:
+
+    void finished(StorageTask *task);
+    void schedule(StorageTask *task);
+    void drain();
+
+    QMutex mutex;
+    QThreadPool pool;
+    //! Tasks per member, the head of each queue is the one running.
+    QHash<QByteArray, QQueue<StorageTask *> > strands;
+    //! Tasks held back by a barrier, in submission order.
+    QQueue<StorageTask *> held;
+    //! Number of tasks in strands.
+    int pending;
+    bool barrierRunning;
+};
+
+} // namespace Internal
+
+} // namespace MssfQt
+
+#endif // STORAGEQUEUE_P_H
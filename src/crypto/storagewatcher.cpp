@@ -0,0 +1,292 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "storagewatcher.h"
+#include "storagewatcher_p.h"
+#include "mssfstorage.h"
+#include "mssfstorage_p.h"
+#include "protectedfile.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QScopedPointer>
+#include <QtCore/QSocketNotifier>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+using namespace MssfQt;
+
+//! The events that may mean a new index or new member contents.
+static const quint32 WatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+
+StorageWatcher::StorageWatcher(const QSharedPointer<MssfStorage> &store, QObject *parent)
+    : QObject(parent),
+      d_ptr(new StorageWatcherPrivate(store))
+{
+    if (d_ptr->fd < 0 || !d_ptr->store)
+        return;
+
+    d_ptr->notifier = new QSocketNotifier(d_ptr->fd, QSocketNotifier::Read, this);
+    connect(d_ptr->notifier, SIGNAL(activated(int)), this, SLOT(inotifyActivated()));
+}
+
+StorageWatcherPrivate::StorageWatcherPrivate(const QSharedPointer<MssfStorage> &store)
+    : store(store),
+      fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+      notifier(NULL)
+{
+    memset(&indexStatus, 0, sizeof(indexStatus));
+
+    if (fd < 0 || !store)
+        return;
+
+    QFileInfo index(store->filename());
+    indexDirectory = index.absolutePath();
+    indexName = index.fileName();
+
+    snapshot(store.data());
+}
+
+StorageWatcher::~StorageWatcher()
+{
+}
+
+StorageWatcherPrivate::~StorageWatcherPrivate()
+{
+    // the notifier is a child of the watcher and already gone
+    if (fd >= 0)
+        ::close(fd);
+}
+
+QSharedPointer<MssfStorage> StorageWatcher::storage() const
+{
+    return d_ptr->store;
+}
+
+bool StorageWatcher::isValid() const
+{
+    return (d_ptr->notifier != NULL);
+}
+
+void StorageWatcher::inotifyActivated()
+{
+    bool indexChanged = false;
+    bool overflow = false;
+    QSet<QString> touched;
+
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    forever
+    {
+        ssize_t length = ::read(d_ptr->fd, buffer, sizeof(buffer));
+        if (length <= 0)
+            break;
+
+        for (char *p = buffer; p < buffer + length; )
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // events were dropped, anything may have changed
+                overflow = true;
+                continue;
+            }
+
+            if (event->len == 0)
+                continue;
+
+            QString directory = d_ptr->directories.value(event->wd);
+            QString name = QFile::decodeName(event->name);
+
+            if (directory == d_ptr->indexDirectory && name == d_ptr->indexName)
+            {
+                indexChanged = true;
+                continue;
+            }
+
+            QString path = directory + QLatin1Char('/') + name;
+            if (d_ptr->memberFiles.contains(path))
+                touched.insert(path);
+        }
+    }
+
+    // after an overflow only comparing everything tells what changed
+    if (overflow && d_ptr->indexRewritten())
+        indexChanged = true;
+
+    QStringList changed;
+    if (indexChanged || overflow)
+        changed = d_ptr->rescan();
+
+    foreach(const QString &path, touched)
+        if (!changed.contains(path))
+            changed.append(path);
+
+    foreach(const QString &pathname, changed)
+        d_ptr->invalidate(pathname);
+
+    if (indexChanged)
+        emit committed();
+
+    foreach(const QString &pathname, changed)
+        emit memberChanged(pathname);
+}
+
+void StorageWatcherPrivate::snapshot(MssfStorage *current)
+{
+    indexRewritten();
+    time_t now = ::time(NULL);
+
+    QStringList names = current->getFiles();
+
+    members.clear();
+    foreach(const QString &name, names)
+    {
+        MemberState state;
+        state.exists = current->statFile(name, &state.status);
+        if (!state.exists)
+            memset(&state.status, 0, sizeof(state.status));
+
+        // timestamps are coarse, a rewrite within the same tick keeps size and times unchanged
+        state.racy = state.exists && state.status.st_mtime >= now - 1;
+        if (state.racy)
+            state.digest = digestOf(current, name);
+
+        members.insert(name, state);
+    }
+
+    addWatches(names);
+}
+
+QByteArray StorageWatcherPrivate::digestOf(MssfStorage *current, const QString &pathname)
+{
+    QScopedPointer<ProtectedFile> file(current->member(pathname));
+    if (file.isNull() || !file->open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    QByteArray digest = file->digest();
+    file->close();
+    return digest;
+}
+
+bool StorageWatcherPrivate::differs(const MemberState &before, const MemberState &after)
+{
+    if (before.exists != after.exists)
+        return true;
+
+    const struct stat &a = before.status;
+    const struct stat &b = after.status;
+    if (a.st_ino != b.st_ino || a.st_size != b.st_size || a.st_mode != b.st_mode
+            || a.st_mtim.tv_sec != b.st_mtim.tv_sec || a.st_mtim.tv_nsec != b.st_mtim.tv_nsec
+            || a.st_ctim.tv_sec != b.st_ctim.tv_sec || a.st_ctim.tv_nsec != b.st_ctim.tv_nsec)
+        return true;
+
+    // only the contents tell a rewrite of a racy member apart
+    if (before.racy)
+        return (before.digest.isEmpty() || before.digest != after.digest);
+
+    return false;
+}
+
+bool StorageWatcherPrivate::indexRewritten()
+{
+    struct stat st;
+    if (::stat(QFile::encodeName(store->filename()).constData(), &st) != 0)
+        memset(&st, 0, sizeof(st));
+
+    bool rewritten = (st.st_ino != indexStatus.st_ino || st.st_size != indexStatus.st_size
+            || st.st_mtim.tv_sec != indexStatus.st_mtim.tv_sec || st.st_mtim.tv_nsec != indexStatus.st_mtim.tv_nsec);
+    indexStatus = st;
+    return rewritten;
+}
+
+void StorageWatcherPrivate::addWatches(const QStringList &names)
+{
+    QSet<QString> wanted;
+    wanted.insert(indexDirectory);
+
+    // the members of a signed store are the actual files, encrypted member files have internal names
+    if (store->protection() == MssfStorage::Signed)
+    {
+        foreach(const QString &name, names)
+        {
+            memberFiles.insert(name);
+            wanted.insert(QFileInfo(name).absolutePath());
+        }
+    }
+
+    QList<QString> watched = directories.values();
+    foreach(const QString &directory, wanted)
+    {
+        if (watched.contains(directory))
+            continue;
+
+        int wd = inotify_add_watch(fd, QFile::encodeName(directory).constData(), WatchMask);
+        if (wd >= 0)
+            directories.insert(wd, directory);
+    }
+}
+
+QStringList StorageWatcherPrivate::rescan()
+{
+    MssfStorage current(store->name(), store->d_ptr->owner(), store->visibility(), store->protection());
+    QHash<QString, MemberState> previous = members;
+
+    snapshot(&current);
+
+    QStringList changed;
+    QHash<QString, MemberState>::iterator it;
+    for (it = members.begin(); it != members.end(); ++it)
+    {
+        if (!previous.contains(it.key()))
+        {
+            changed.append(it.key());
+            continue;
+        }
+
+        const MemberState &before = previous[it.key()];
+        if (before.racy && it.value().exists && !it.value().racy)
+            it.value().digest = digestOf(&current, it.key());
+
+        if (differs(before, it.value()))
+            changed.append(it.key());
+    }
+
+    QHash<QString, MemberState>::const_iterator old;
+    for (old = previous.constBegin(); old != previous.constEnd(); ++old)
+        if (!members.contains(old.key()))
+            changed.append(old.key());
+
+    return changed;
+}
+
+void StorageWatcherPrivate::invalidate(const QString &pathname)
+{
+    store->d_ptr->invalidateCached(pathname);
+}
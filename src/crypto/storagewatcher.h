@@ -0,0 +1,117 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef STORAGEWATCHER_H
+#define STORAGEWATCHER_H
+
+#include "mssf-qt_global.h"
+
+#include <QtCore/QObject>
+#include <QtCore/QScopedPointer>
+#include <QtCore/QSharedPointer>
+
+class QString;
+
+namespace MssfQt
+{
+
+class MssfStorage;
+class StorageWatcherPrivate;
+
+/*!
+  * \class StorageWatcher
+  * \brief Notifies about changes made to a store, typically by other processes.
+  *
+  * The watcher uses inotify on the store index file and, for signed stores, on the member files.
+  * When the index is rewritten the store is re-read, compared with its previous state and
+  * \ref committed is emitted, followed by \ref memberChanged for every member that was added,
+  * removed or changed. Writes to the files of a signed store are reported straight away, as they
+  * happen, without waiting for a commit.
+  *
+  * A member counts as changed when its inode, size, mode or modification and change times differ.
+  * Timestamps are too coarse to tell apart two writes made in quick succession, so the contents
+  * of members written within a second of a rescan are compared by their backend digest as well.
+  * If the kernel drops events, the whole store is rescanned and compared.
+  *
+  * The plaintext cache of the watched store is invalidated for every reported member. The index
+  * held in memory by the watched store is not reloaded, open the store again to see the new
+  * contents.
+  *
+  * Commits made through this process are reported as well.
+  */
+class MSSFQTSHARED_EXPORT StorageWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    /*!
+      * \brief Constructor
+      * \param store The store to watch.
+      * \param parent The parent object of this.
+      */
+    StorageWatcher(const QSharedPointer<MssfStorage> &store, QObject *parent = 0);
+
+    /*!
+      * \brief Destructor
+      */
+    ~StorageWatcher();
+
+    /*!
+      * \brief The watched store
+      */
+    QSharedPointer<MssfStorage> storage() const;
+
+    /*!
+      * \brief Is the watcher working
+      * \returns false if inotify could not be set up, no signals will be emitted then.
+      */
+    bool isValid() const;
+
+signals:
+
+    /*!
+      * \brief The store index has been rewritten.
+      */
+    void committed();
+
+    /*!
+      * \brief A member was added, removed or its contents changed.
+      * \param pathname The name of the member.
+      */
+    void memberChanged(const QString &pathname);
+
+private slots:
+
+    void inotifyActivated();
+
+private:
+    //! internal private implementation
+    QScopedPointer<StorageWatcherPrivate> d_ptr;
+};
+
+} //namespace MssfQt
+
+#endif // STORAGEWATCHER_H
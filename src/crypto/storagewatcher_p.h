@@ -0,0 +1,104 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef STORAGEWATCHER_P_H
+#define STORAGEWATCHER_P_H
+
+#include "mssfstorage.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+
+#include <sys/stat.h>
+#include <time.h>
+
+class QSocketNotifier;
+
+namespace MssfQt
+{
+
+class StorageWatcherPrivate
+{
+public:
+
+    //! What is compared to tell whether a member changed.
+    struct MemberState
+    {
+        bool exists;
+        struct stat status;
+        //! The member was written so recently that a later rewrite could keep the timestamps.
+        bool racy;
+        //! The backend digest of the contents, only taken for a racy member.
+        QByteArray digest;
+    };
+
+    StorageWatcherPrivate(const QSharedPointer<MssfStorage> &store);
+
+    ~StorageWatcherPrivate();
+
+    //! Remember the current state of the members of store.
+    void snapshot(MssfStorage *store);
+
+    //! The backend digest of a member, empty if it cannot be read.
+    static QByteArray digestOf(MssfStorage *store, const QString &pathname);
+
+    //! Whether the member differs between the two states.
+    static bool differs(const MemberState &before, const MemberState &after);
+
+    //! Remember the index file status and tell whether it differs from the last one.
+    bool indexRewritten();
+
+    //! Watch the directories of the index and of the signed member files.
+    void addWatches(const QStringList &members);
+
+    //! Re-read the store and return the members that differ from the last snapshot.
+    QStringList rescan();
+
+    //! Drop the cached data of a member in the watched store.
+    void invalidate(const QString &pathname);
+
+    QSharedPointer<MssfStorage> store;
+    //! The inotify instance, -1 if it could not be created.
+    int fd;
+    QSocketNotifier *notifier;
+    //! The watched directories by watch descriptor.
+    QHash<int, QString> directories;
+    //! The directory and the file name of the index file.
+    QString indexDirectory;
+    QString indexName;
+    //! The absolute paths of the signed member files.
+    QSet<QString> memberFiles;
+    //! The state of the members at the last commit.
+    QHash<QString, MemberState> members;
+    //! The status of the index file at the last snapshot.
+    struct stat indexStatus;
+};
+
+} //namespace MssfQt
+
+#endif // STORAGEWATCHER_P_H
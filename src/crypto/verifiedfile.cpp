@@ -0,0 +1,316 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#include "verifiedfile.h"
+#include "verifiedfile_p.h"
+#include "hashtree_p.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QMutexLocker>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+using namespace MssfQt;
+using namespace MssfQt::Internal;
+
+//! Map a whole file read only.
+//! \returns The mapping, NULL with errno set on failure or if the size is not the expected one.
+static const char *mapFile(const QString &pathname, quint64 expected)
+{
+    int fd = ::open(QFile::encodeName(pathname).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0)
+    {
+        if ((quint64)st.st_size == expected)
+            mapped = mmap(NULL, expected, PROT_READ, MAP_SHARED, fd, 0);
+        else
+            errno = EIO;
+    }
+
+    // the mapping keeps the file referenced
+    int saved = errno;
+    ::close(fd);
+    errno = saved;
+
+    return (mapped == MAP_FAILED ? NULL : static_cast<const char *>(mapped));
+}
+
+VerifiedFile::VerifiedFile(const QSharedPointer<MssfStorage> &store, const QString &pathname)
+    : d_ptr(new VerifiedFilePrivate(store, pathname))
+{
+}
+
+VerifiedFilePrivate::VerifiedFilePrivate(const QSharedPointer<MssfStorage> &store, const QString &pathname)
+    : store(store),
+      pathname(pathname),
+      data(NULL),
+      size(0),
+      tree(NULL),
+      treeSize(0),
+      blockSize(0),
+      opened(false)
+{
+}
+
+VerifiedFile::~VerifiedFile()
+{
+}
+
+VerifiedFilePrivate::~VerifiedFilePrivate()
+{
+    close();
+}
+
+bool VerifiedFile::open()
+{
+    QMutexLocker locker(&d_ptr->mutex);
+    return d_ptr->open();
+}
+
+bool VerifiedFilePrivate::open()
+{
+    if (opened)
+        return true;
+
+    if (!store || store->protection() != MssfStorage::Signed)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    // the root is a member, the store checks it against the signed index
+    QByteArray header = store->getFile(HashTree::rootName(pathname));
+    if (!HashTree::decodeHeader(header, &blockSize, &size, &root))
+    {
+        errno = (header.isEmpty() ? ENOENT : EINVAL);
+        return false;
+    }
+
+    counts = HashTree::levelCounts(size, blockSize);
+    offsets.resize(counts.size());
+    quint64 nodes = 0;
+    for (int level = 0; level < counts.size(); level++)
+    {
+        offsets[level] = nodes;
+        nodes += counts.at(level);
+    }
+    treeSize = nodes * HashTree::DigestSize;
+
+    if (size > 0)
+    {
+        data = mapFile(pathname, size);
+        if (!data)
+            return false;
+    }
+
+    tree = mapFile(HashTree::treeName(pathname), treeSize);
+    if (!tree)
+    {
+        int saved = errno;
+        close();
+        errno = saved;
+        return false;
+    }
+
+    opened = true;
+    return true;
+}
+
+void VerifiedFile::close()
+{
+    QMutexLocker locker(&d_ptr->mutex);
+    d_ptr->close();
+}
+
+void VerifiedFilePrivate::close()
+{
+    if (data)
+        munmap(const_cast<char *>(data), size);
+    if (tree)
+        munmap(const_cast<char *>(tree), treeSize);
+
+    data = NULL;
+    tree = NULL;
+    verified.clear();
+    scratch.clear();
+    opened = false;
+}
+
+bool VerifiedFile::isOpen() const
+{
+    return d_ptr->opened;
+}
+
+QString VerifiedFile::name() const
+{
+    return d_ptr->pathname;
+}
+
+qint64 VerifiedFile::size() const
+{
+    return (d_ptr->opened ? (qint64)d_ptr->size : -1);
+}
+
+int VerifiedFile::blockSize() const
+{
+    return (d_ptr->opened ? (int)d_ptr->blockSize : 0);
+}
+
+qint64 VerifiedFile::read(quint64 at, char *buf, quintptr len)
+{
+    QMutexLocker locker(&d_ptr->mutex);
+    if (!d_ptr->opened)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (at >= d_ptr->size)
+        return 0;
+    len = qMin<quint64>(len, d_ptr->size - at);
+
+    quintptr done = 0;
+    while (done < len)
+    {
+        quint64 pos = at + done;
+        quint64 block = pos / d_ptr->blockSize;
+        quint64 start = block * d_ptr->blockSize;
+        int length = d_ptr->blockLength(block);
+
+        // hash a private copy, the mapping may change under us
+        d_ptr->scratch.resize(length);
+        memcpy(d_ptr->scratch.data(), d_ptr->data + start, length);
+        if (!d_ptr->verifyBlock(block, d_ptr->scratch.constData(), length))
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        quintptr offset = pos - start;
+        quintptr count = qMin<quintptr>(len - done, length - offset);
+        memcpy(buf + done, d_ptr->scratch.constData() + offset, count);
+        done += count;
+    }
+
+    return done;
+}
+
+const char *VerifiedFile::map(quint64 at, quintptr len)
+{
+    QMutexLocker locker(&d_ptr->mutex);
+    if (!d_ptr->opened || at > d_ptr->size || len > d_ptr->size - at)
+    {
+        errno = (d_ptr->opened ? EINVAL : EBADF);
+        return NULL;
+    }
+
+    if (len > 0)
+    {
+        quint64 last = (at + len - 1) / d_ptr->blockSize;
+        for (quint64 block = at / d_ptr->blockSize; block <= last; block++)
+        {
+            if (!d_ptr->verifyBlock(block, d_ptr->data + block * d_ptr->blockSize, d_ptr->blockLength(block)))
+            {
+                errno = EIO;
+                return NULL;
+            }
+        }
+    }
+
+    return (d_ptr->data ? d_ptr->data + at : "");
+}
+
+int VerifiedFilePrivate::blockLength(quint64 block) const
+{
+    return (int)qMin<quint64>(blockSize, size - block * blockSize);
+}
+
+QByteArray VerifiedFilePrivate::node(int level, quint64 index) const
+{
+    return QByteArray(tree + (offsets.at(level) + index) * HashTree::DigestSize, HashTree::DigestSize);
+}
+
+quint64 VerifiedFilePrivate::nodeKey(int level, quint64 index)
+{
+    // no tree has more than 2^56 nodes on a level
+    return ((quint64)level << 56) | index;
+}
+
+bool VerifiedFilePrivate::verifyBlock(quint64 block, const char *blockData, int length)
+{
+    QByteArray hash = HashTree::leafHash(blockData, length);
+    QList<QPair<quint64, QByteArray> > path;
+
+    int top = counts.size() - 1;
+    int level = 0;
+    quint64 index = block;
+    forever
+    {
+        // stop at the first node that is already known to be good
+        QHash<quint64, QByteArray>::const_iterator known = verified.constFind(nodeKey(level, index));
+        if (known != verified.constEnd())
+        {
+            if (known.value() != hash)
+                return false;
+            break;
+        }
+
+        path.append(qMakePair(nodeKey(level, index), hash));
+        if (level == top)
+        {
+            if (hash != root)
+                return false;
+            break;
+        }
+
+        quint64 sibling = index ^ 1;
+        QByteArray siblingHash;
+        if (sibling < counts.at(level))
+        {
+            siblingHash = node(level, sibling);
+            path.append(qMakePair(nodeKey(level, sibling), siblingHash));
+        }
+
+        hash = (index & 1) ? HashTree::nodeHash(siblingHash, hash) : HashTree::nodeHash(hash, siblingHash);
+        index >>= 1;
+        level++;
+    }
+
+    // both children of every verified parent are now known to be good
+    for (int i = 0; i < path.count(); i++)
+        verified.insert(path.at(i).first, path.at(i).second);
+    return true;
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef VERIFIEDFILE_H
+#define VERIFIEDFILE_H
+
+#include "mssf-qt_global.h"
+
+#include <QtCore/QScopedPointer>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QString>
+
+namespace MssfQt
+{
+
+class MssfStorage;
+class VerifiedFilePrivate;
+
+/*!
+  * \class VerifiedFile
+  * \brief Random access to a large signed member, verified block by block.
+  *
+  * Opening a member through \ref ProtectedFile checks the digest of the whole file. For a member
+  * with a hash tree, built by \ref MssfStorage::buildHashTree, this class maps the file instead
+  * and verifies only the blocks that are read, against the signed root of the tree. The cost of a
+  * read is then proportional to the bytes read plus one path through the tree, the verified nodes
+  * are remembered so later reads nearby are cheaper still.
+  *
+  * Only signed stores are supported, the members of encrypted stores cannot be mapped.
+  */
+class MSSFQTSHARED_EXPORT VerifiedFile
+{
+public:
+
+    /*!
+      * \brief Constructor
+      * \param store The signed store holding the member and the root of its tree.
+      * \param pathname The name of the member.
+      */
+    VerifiedFile(const QSharedPointer<MssfStorage> &store, const QString &pathname);
+
+    /*!
+      * \brief Destructor, unmaps the file.
+      */
+    ~VerifiedFile();
+
+    /*!
+      * \brief Map the member and its hash tree
+      * \returns false if there is no valid tree for the member or the member has a different
+      * size than it had when the tree was built, errno is set.
+      */
+    bool open();
+
+    /*!
+      * \brief Unmap the member.
+      */
+    void close();
+
+    /*!
+      * \brief Is the member mapped
+      */
+    bool isOpen() const;
+
+    /*!
+      * \brief The name of the member
+      */
+    QString name() const;
+
+    /*!
+      * \brief The size of the member
+      * \returns The size, -1 if the file is not open.
+      */
+    qint64 size() const;
+
+    /*!
+      * \brief The size of the verified blocks
+      * \returns The block size of the tree, 0 if the file is not open.
+      */
+    int blockSize() const;
+
+    /*!
+      * \brief Read and verify a range
+      * \param at The offset to read from.
+      * \param buf The buffer to read into.
+      * \param len The number of bytes to read.
+      * \returns The number of bytes read, short at the end of the file, or -1 with errno set to
+      * EIO if a block does not match the tree. Nothing is copied from a block that fails.
+      *
+      * Every block is copied before it is hashed, so what is returned is what was verified.
+      */
+    qint64 read(quint64 at, char *buf, quintptr len);
+
+    /*!
+      * \brief Verify a range and return it in place
+      * \param at The offset of the range.
+      * \param len The length of the range, it must not reach past the end of the file.
+      * \returns A pointer into the mapping, NULL if the range is invalid or fails verification.
+      *
+      * Avoids the copy made by \ref read, but the range is only verified at the time of the call.
+      * Use it when the file cannot be changed while it is mapped.
+      */
+    const char *map(quint64 at, quintptr len);
+
+private:
+    Q_DISABLE_COPY(VerifiedFile)
+    //! internal private implementation
+    QScopedPointer<VerifiedFilePrivate> d_ptr;
+};
+
+} //namespace MssfQt
+
+#endif // VERIFIEDFILE_H
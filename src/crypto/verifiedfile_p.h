@@ -0,0 +1,90 @@
+/*
+ * This file is part of MSSF
+ *
+ * Copyright (C) 2011 Brian McGillion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * Author: Brian McGillion <brian.mcgillion@symbio.com>
+ *
+ * This is a wrapper library to provide a Qt API.  All rights for the wrapped
+ * libraries remain with their original authors.
+ */
+
+#ifndef VERIFIEDFILE_P_H
+#define VERIFIEDFILE_P_H
+
+#include "mssfstorage.h"
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+namespace MssfQt
+{
+
+class VerifiedFilePrivate
+{
+public:
+
+    VerifiedFilePrivate(const QSharedPointer<MssfStorage> &store, const QString &pathname);
+
+    ~VerifiedFilePrivate();
+
+    bool open();
+
+    void close();
+
+    //! Check one block against the tree, caching the nodes on its path once they are verified.
+    bool verifyBlock(quint64 block, const char *blockData, int length);
+
+    //! The length of a block, the last one may be short.
+    int blockLength(quint64 block) const;
+
+    //! A node read from the tree file, not yet verified.
+    QByteArray node(int level, quint64 index) const;
+
+    //! The key of a node in the verified cache.
+    static quint64 nodeKey(int level, quint64 index);
+
+    QSharedPointer<MssfStorage> store;
+    QString pathname;
+    //! Serialises the users of the verified cache and the scratch block.
+    QMutex mutex;
+    //! The mapped member, NULL if it is empty or not open.
+    const char *data;
+    quint64 size;
+    //! The mapped tree file, NULL if not open.
+    const char *tree;
+    quint64 treeSize;
+    quint32 blockSize;
+    //! The signed root of the tree.
+    QByteArray root;
+    //! The number of nodes on each level and where each level starts, in nodes.
+    QVector<quint64> counts;
+    QVector<quint64> offsets;
+    //! Copies of the nodes that have been verified, so the tree file is read only once per node.
+    QHash<quint64, QByteArray> verified;
+    //! The copy of the block being verified.
+    QByteArray scratch;
+    bool opened;
+};
+
+} //namespace MssfQt
+
+#endif // VERIFIEDFILE_P_H
@@ -26,11 +26,101 @@
 #include <QtCore/QObject>
 #include <QtTest/QtTest>
 
+#include "mssfstorage.h"
+#include "protectedfile.h"
+#include "protectedfiledevice.h"
+#include "protectedkeyvaluestore.h"
+#include "protectedlog.h"
+#include "storagecache_p.h"
+#include "storagequeue_p.h"
+#include "maskmatcher_p.h"
+#include "digestindex_p.h"
+#include "keyvaluerecord_p.h"
+#include "logblock_p.h"
+#include "hashtree_p.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+
+using namespace MssfQt;
+
+//! The store the tests that need the backend work in, emptied before each of them.
+static const char TestStore[] = "mssf-qt-test";
+//! Deduplication only applies to encrypted stores.
+static const char EncryptedTestStore[] = "mssf-qt-test-encrypted";
+
+//! Logs when it starts and ends, with a pause in between.
+class RecordingTask : public Internal::StorageTask
+{
+public:
+    RecordingTask(const QByteArray &pathname, bool barrier, const QString &id, int pause,
+                  QStringList *log, QMutex *mutex)
+        : Internal::StorageTask(pathname, barrier),
+          id(id),
+          pause(pause),
+          log(log),
+          mutex(mutex)
+    {
+    }
+
+protected:
+    void execute()
+    {
+        record(QLatin1String("start ") + id);
+        QTest::qSleep(pause);
+        record(QLatin1String("end ") + id);
+    }
+
+private:
+    void record(const QString &event)
+    {
+        QMutexLocker locker(mutex);
+        log->append(event);
+    }
+
+    QString id;
+    int pause;
+    QStringList *log;
+    QMutex *mutex;
+};
+
 class TestMssfCryptoQt : public QObject
 {
     Q_OBJECT
 private slots:
     void signData();
+    void cachedMemberWrittenThroughHandle();
+    void keyValueStoreSkipsUnreadableSegment();
+    void protectedLogBlockMembers();
+    void deduplicatedOverwrite();
+    void removeFilesCountsShared();
+    void renamePrefixLiteral();
+    void protectedFileDeviceDataStream();
+    void protectedFileDeviceInterleaved();
+    void protectedFileReadv();
+    void protectedFileWritev();
+    void protectedFileReadAhead();
+    void storageCacheFindInsert();
+    void storageCacheEvictsLeastRecentlyUsed();
+    void storageCacheLimit();
+    void storageQueueMemberOrder();
+    void storageQueueBarrier();
+    void maskMatcher_data();
+    void maskMatcher();
+    void digestIndexInsertRemove();
+    void digestIndexDuplicates();
+    void digestIndexRename();
+    void keyValueRecordRoundTrip();
+    void keyValueRecordIncomplete();
+    void logBlockChain();
+    void logBlockDamage();
+    void hashTreeLayout();
+    void hashTreeBuilder();
+    void hashTreeBuilderEdges();
+    void mutableHashTreeUpdate();
+    void mutableHashTreeResize();
+    void mutableHashTreeLoad();
 };
 
 void TestMssfCryptoQt::signData()
@@ -38,5 +128,1006 @@ void TestMssfCryptoQt::signData()
     qDebug() << "Running test case";
 }
 
+void TestMssfCryptoQt::cachedMemberWrittenThroughHandle()
+{
+    MssfStorage store(QLatin1String(TestStore), QString(), MssfStorage::private_vis, MssfStorage::Signed);
+    store.removeAllFiles();
+    store.setCacheLimit(64 * 1024);
+    QVERIFY(store.putFile(QByteArray("member"), QByteArray("old contents")));
+
+    QSharedPointer<ProtectedFile> file = store.openMember(QByteArray("member"), QIODevice::ReadWrite);
+    QVERIFY(file);
+    // cached again after openMember() dropped it
+    QCOMPARE(store.getFile(QByteArray("member")), QByteArray("old contents"));
+
+    QCOMPARE(file->write(0, QByteArray("new")), (qptrdiff)3);
+    file->close();
+    QCOMPARE(store.getFile(QByteArray("member")), QByteArray("new contents"));
+
+    store.removeAllFiles();
+    store.commit();
+}
+
+void TestMssfCryptoQt::keyValueStoreSkipsUnreadableSegment()
+{
+    QString prefix = QDir::temp().filePath(QLatin1String("mssf-qt-test-kv"));
+    QString mask = prefix + QLatin1String(".*");
+    {
+        QSharedPointer<MssfStorage> store(new MssfStorage(QLatin1String(TestStore), QString(),
+                                                          MssfStorage::private_vis, MssfStorage::Signed));
+        store->removeAllFiles();
+        ProtectedKeyValueStore kv(store, prefix);
+        QVERIFY(kv.isValid());
+
+        // every flush writes a segment of its own
+        kv.put("a", "first");
+        QVERIFY(kv.flush());
+        kv.put("b", "second");
+        QVERIFY(kv.flush());
+        QCOMPARE(store->getFiles(mask).count(), 2);
+    }
+
+    // the newest segment no longer matches its digest, as after a crash during the flush
+    QFile segment(prefix + QLatin1String(".1"));
+    QVERIFY(segment.open(QIODevice::Append));
+    QCOMPARE(segment.write("torn"), (qint64)4);
+    segment.close();
+
+    QSharedPointer<MssfStorage> store(new MssfStorage(QLatin1String(TestStore), QString(),
+                                                      MssfStorage::private_vis, MssfStorage::Signed));
+    {
+        ProtectedKeyValueStore kv(store, prefix);
+        QVERIFY(kv.isValid());
+        QCOMPARE(kv.get("a"), QByteArray("first"));
+        QVERIFY(kv.get("b").isEmpty());
+        QCOMPARE(store->getFiles(mask), QStringList() << prefix + QLatin1String(".0"));
+
+        kv.put("c", "third");
+        QVERIFY(kv.flush());
+        QCOMPARE(kv.get("c"), QByteArray("third"));
+    }
+
+    store->removeAllFiles();
+    store->commit();
+}
+
+static bool collectRecord(const QByteArray &record, void *context)
+{
+    static_cast<QList<QByteArray> *>(context)->append(record);
+    return true;
+}
+
+void TestMssfCryptoQt::protectedLogBlockMembers()
+{
+    QString pathname = QDir::temp().filePath(QLatin1String("mssf-qt-test-log"));
+    QString mask = pathname + QLatin1String(".*");
+    QSharedPointer<MssfStorage> store(new MssfStorage(QLatin1String(TestStore), QString(),
+                                                      MssfStorage::private_vis, MssfStorage::Signed));
+    store->removeAllFiles();
+    {
+        ProtectedLog log(store, pathname);
+        QVERIFY(log.isValid());
+        QVERIFY(log.append("one"));
+        QVERIFY(log.flush());
+        QVERIFY(log.append("two"));
+        QVERIFY(log.append("three"));
+        QVERIFY(log.flush());
+        QVERIFY(log.checkpoint());
+        QVERIFY(log.append("four"));
+        QVERIFY(log.flush());
+
+        // one member per block besides the checkpoint, the written ones are not touched again
+        QCOMPARE(store->getFiles(mask).count(), 4);
+        QCOMPARE(log.count(), (quint64)4);
+    }
+
+    ProtectedLog log(store, pathname);
+    QVERIFY(log.isValid());
+    QCOMPARE(log.count(), (quint64)4);
+    QList<QByteArray> records;
+    QCOMPARE(log.replay(collectRecord, &records), (qint64)4);
+    QCOMPARE(records, QList<QByteArray>() << "one" << "two" << "three" << "four");
+
+    store->removeAllFiles();
+    store->commit();
+}
+
+void TestMssfCryptoQt::deduplicatedOverwrite()
+{
+    MssfStorage store(QLatin1String(EncryptedTestStore), QString(), MssfStorage::private_vis, MssfStorage::Encrypted);
+    store.removeAllFiles();
+    store.setDeduplication(true);
+    if (!store.deduplication())
+        QSKIP("The store is not encrypted here", SkipSingle);
+
+    QVERIFY(store.putFile(QByteArray("a"), QByteArray("shared")));
+    QVERIFY(store.putFile(QByteArray("b"), QByteArray("own")));
+    // b exists as a plain member when it turns into a link to a
+    QVERIFY(store.putFile(QByteArray("b"), QByteArray("shared")));
+    QCOMPARE(store.getFile(QByteArray("a")), QByteArray("shared"));
+    QCOMPARE(store.getFile(QByteArray("b")), QByteArray("shared"));
+
+    // b inherits the contents when a goes
+    store.removeFile(QByteArray("a"));
+    QCOMPARE(store.getFile(QByteArray("b")), QByteArray("shared"));
+
+    store.removeAllFiles();
+    store.commit();
+}
+
+void TestMssfCryptoQt::removeFilesCountsShared()
+{
+    MssfStorage store(QLatin1String(EncryptedTestStore), QString(), MssfStorage::private_vis, MssfStorage::Encrypted);
+    store.removeAllFiles();
+    store.setDeduplication(true);
+    if (!store.deduplication())
+        QSKIP("The store is not encrypted here", SkipSingle);
+
+    // a and b share their contents, one of them is a link
+    QVERIFY(store.putFile(QByteArray("dir/a"), QByteArray("shared")));
+    QVERIFY(store.putFile(QByteArray("dir/b"), QByteArray("shared")));
+    QVERIFY(store.putFile(QByteArray("dir/c"), QByteArray("other")));
+    QVERIFY(store.putFile(QByteArray("keep"), QByteArray("shared")));
+
+    QCOMPARE(store.removeFiles(QLatin1String("dir/*")), 3);
+    QVERIFY(store.getFiles(QLatin1String("dir/*")).isEmpty());
+    QCOMPARE(store.getFile(QByteArray("keep")), QByteArray("shared"));
+
+    store.removeAllFiles();
+    store.commit();
+}
+
+void TestMssfCryptoQt::renamePrefixLiteral()
+{
+    MssfStorage store(QLatin1String(TestStore), QString(), MssfStorage::private_vis, MssfStorage::Signed);
+    store.removeAllFiles();
+    QVERIFY(store.putFile(QByteArray("img[1]/a"), QByteArray("first")));
+    QVERIFY(store.putFile(QByteArray("img[1]/b"), QByteArray("second")));
+    // matched by img[1]/* as a mask, but not by the literal prefix
+    QVERIFY(store.putFile(QByteArray("img1/c"), QByteArray("third")));
+
+    QCOMPARE(store.renamePrefix(QLatin1String("img[1]/"), QLatin1String("pic/")), 2);
+    QCOMPARE(store.getFile(QByteArray("pic/a")), QByteArray("first"));
+    QCOMPARE(store.getFile(QByteArray("pic/b")), QByteArray("second"));
+    QCOMPARE(store.getFile(QByteArray("img1/c")), QByteArray("third"));
+    QVERIFY(!store.getFiles().contains(QLatin1String("img[1]/a")));
+
+    store.removeAllFiles();
+    store.commit();
+}
+
+void TestMssfCryptoQt::protectedFileDeviceDataStream()
+{
+    MssfStorage store(QLatin1String(TestStore), QString(), MssfStorage::private_vis, MssfStorage::Signed);
+    store.removeAllFiles();
+
+    QByteArray large(200 * 1024, 0);
+    for (int i = 0; i < large.size(); i++)
+        large[i] = (char)(i * 7);
+
+    // the same stream written to memory is what the member must hold
+    QByteArray expected;
+    {
+        QDataStream out(&expected, QIODevice::WriteOnly);
+        out << (quint32)42 << QString::fromLatin1("protected") << large;
+    }
+
+    QScopedPointer<ProtectedFile> file(store.member(QByteArray("stream")));
+    QVERIFY(file);
+    {
+        ProtectedFileDevice device(file.data());
+        QVERIFY(device.open(QIODevice::WriteOnly));
+        QDataStream out(&device);
+        out << (quint32)42 << QString::fromLatin1("protected") << large;
+        QCOMPARE(out.status(), QDataStream::Ok);
+        device.close();
+    }
+    QCOMPARE(store.getFile(QByteArray("stream")), expected);
+
+    {
+        ProtectedFileDevice device(file.data());
+        QVERIFY(device.open(QIODevice::ReadOnly));
+        QCOMPARE(device.size(), (qint64)expected.size());
+        QDataStream in(&device);
+        quint32 number;
+        QString text;
+        QByteArray data;
+        in >> number >> text >> data;
+        QCOMPARE(in.status(), QDataStream::Ok);
+        QCOMPARE(number, (quint32)42);
+        QCOMPARE(text, QString::fromLatin1("protected"));
+        QVERIFY(data == large);
+        QVERIFY(device.atEnd());
+    }
+
+    file.reset();
+    store.removeAllFiles();
+    store.commit();
+}
+
+void TestMssfCryptoQt::protectedFileDeviceInterleaved()
+{
+    MssfStorage store(QLatin1String(TestStore), QString(), MssfStorage::private_vis, MssfStorage::Signed);
+    store.removeAllFiles();
+
+    QByteArray model;
+    for (int i = 0; i < 200; i++)
+        model.append((char)('a' + i % 26));
+    QVERIFY(store.putFile(QByteArray("device"), model));
+
+    QScopedPointer<ProtectedFile> file(store.member(QByteArray("device")));
+    QVERIFY(file);
+    {
+        ProtectedFileDevice device(file.data());
+        // small blocks so that every path of the buffering is taken
+        device.setBlockSize(16);
+        QVERIFY(device.open(QIODevice::ReadWrite));
+        QCOMPARE(device.size(), (qint64)model.size());
+
+        // sequential reads fill the block and then read further ahead
+        QCOMPARE(device.read(10), model.mid(0, 10));
+        QCOMPARE(device.read(10), model.mid(10, 10));
+        QCOMPARE(device.read(30), model.mid(20, 30));
+        // larger than the read-ahead window, straight to the caller
+        QCOMPARE(device.read(150), model.mid(50, 150));
+        QVERIFY(device.atEnd());
+
+        // a write into the buffered block must be read back
+        QVERIFY(device.seek(52));
+        QCOMPARE(device.write("XYZ", 3), (qint64)3);
+        model.replace(52, 3, "XYZ");
+        QVERIFY(device.seek(50));
+        QCOMPARE(device.read(8), model.mid(50, 8));
+
+        // contiguous small writes are collected, one past the block size flushes them
+        QVERIFY(device.seek(100));
+        for (int i = 0; i < 20; i++)
+        {
+            QCOMPARE(device.write("0123456789" + i % 10, 1), (qint64)1);
+            model[100 + i] = (char)('0' + i % 10);
+        }
+        // not contiguous, the collected data is written first
+        QVERIFY(device.seek(5));
+        QCOMPARE(device.write("-", 1), (qint64)1);
+        model[5] = '-';
+
+        // past the end grows the file
+        QVERIFY(device.seek(195));
+        QCOMPARE(device.write("0123456789", 10), (qint64)10);
+        model.replace(195, 5, "01234");
+        model.append("56789");
+        QCOMPARE(device.size(), (qint64)model.size());
+
+        QVERIFY(device.seek(0));
+        QCOMPARE(device.readAll(), model);
+        device.close();
+    }
+    QCOMPARE(store.getFile(QByteArray("device")), model);
+
+    // Append starts at the end, whatever was read before
+    {
+        ProtectedFileDevice device(file.data());
+        device.setBlockSize(16);
+        QVERIFY(device.open(QIODevice::ReadWrite | QIODevice::Append));
+        QCOMPARE(device.pos(), (qint64)model.size());
+        QCOMPARE(device.write("tail", 4), (qint64)4);
+        device.close();
+    }
+    model.append("tail");
+    QCOMPARE(store.getFile(QByteArray("device")), model);
+
+    file.reset();
+    store.removeAllFiles();
+    store.commit();
+}
+
+//! An extent of the file backed by the memory of buffer.
+static ProtectedFile::Extent extent(quint64 offset, QByteArray &buffer)
+{
+    ProtectedFile::Extent result;
+    result.offset = offset;
+    result.length = buffer.size();
+    result.data = buffer.data();
+    result.transferred = -2;
+    return result;
+}
+
+void TestMssfCryptoQt::protectedFileReadv()
+{
+    MssfStorage store(QLatin1String(TestStore), QString(), MssfStorage::private_vis, MssfStorage::Signed);
+    store.removeAllFiles();
+    QByteArray contents;
+    for (int i = 0; i < 100; i++)
+        contents.append((char)('0' + i % 10));
+    QVERIFY(store.putFile(QByteArray("extents"), contents));
+
+    QScopedPointer<ProtectedFile> file(store.member(QByteArray("extents")));
+    QVERIFY(file);
+    QVERIFY(file->open(QIODevice::ReadOnly));
+
+    // out of order, overlapping, cut short at the end and past it, one far enough for a read of its own
+    QByteArray middle(10, 0), head(5, 0), overlap(4, 0), tail(10, 0), past(5, 0), far(4, 0);
+    QVector<ProtectedFile::Extent> extents;
+    extents << extent(50, middle) << extent(0, head) << extent(3, overlap)
+            << extent(95, tail) << extent(200, past) << extent(100000, far);
+
+    QCOMPARE(file->readv(extents), (qint64)(10 + 5 + 4 + 5));
+    QCOMPARE(extents.at(0).transferred, (qint64)10);
+    QCOMPARE(middle, contents.mid(50, 10));
+    QCOMPARE(extents.at(1).transferred, (qint64)5);
+    QCOMPARE(head, contents.mid(0, 5));
+    QCOMPARE(extents.at(2).transferred, (qint64)4);
+    QCOMPARE(overlap, contents.mid(3, 4));
+    QCOMPARE(extents.at(3).transferred, (qint64)5);
+    QCOMPARE(tail.left(5), contents.mid(95, 5));
+    QCOMPARE(extents.at(4).transferred, (qint64)0);
+    QCOMPARE(extents.at(5).transferred, (qint64)0);
+
+    file->close();
+    file.reset();
+    store.removeAllFiles();
+    store.commit();
+}
+
+void TestMssfCryptoQt::protectedFileWritev()
+{
+    MssfStorage store(QLatin1String(TestStore), QString(), MssfStorage::private_vis, MssfStorage::Signed);
+    store.removeAllFiles();
+    QByteArray contents(30, '.');
+    QVERIFY(store.putFile(QByteArray("extents"), contents));
+
+    QScopedPointer<ProtectedFile> file(store.member(QByteArray("extents")));
+    QVERIFY(file);
+    QVERIFY(file->open(QIODevice::ReadWrite));
+
+    // overlapping ranges are refused before anything is written
+    QByteArray first("11111"), second("22222");
+    QVector<ProtectedFile::Extent> extents;
+    extents << extent(0, first) << extent(3, second);
+    errno = 0;
+    QCOMPARE(file->writev(extents), (qint64)-1);
+    QCOMPARE(errno, EINVAL);
+    QCOMPARE(extents.at(0).transferred, (qint64)-1);
+    QCOMPARE(extents.at(1).transferred, (qint64)-1);
+
+    // adjacent ranges are written together, each gets its own share of the count
+    QByteArray b("BBBBB"), a("AAAAA"), c("CCC"), end("EEEE");
+    extents.clear();
+    extents << extent(5, b) << extent(0, a) << extent(20, c) << extent(28, end);
+    QCOMPARE(file->writev(extents), (qint64)(5 + 5 + 3 + 4));
+    QCOMPARE(extents.at(0).transferred, (qint64)5);
+    QCOMPARE(extents.at(1).transferred, (qint64)5);
+    QCOMPARE(extents.at(2).transferred, (qint64)3);
+    QCOMPARE(extents.at(3).transferred, (qint64)4);
+    QVERIFY(file->close());
+
+    contents.replace(0, 10, "AAAAABBBBB");
+    contents.replace(20, 3, "CCC");
+    contents.replace(28, 2, "EE");
+    contents.append("EE");
+    QCOMPARE(store.getFile(QByteArray("extents")), contents);
+
+    file.reset();
+    store.removeAllFiles();
+    store.commit();
+}
+
+//! Read [from, to) of file sequentially in chunks, as a streaming reader does.
+static QByteArray readSequentially(ProtectedFile *file, quint64 from, quint64 to, quintptr chunk)
+{
+    QByteArray result;
+    QByteArray data;
+    for (quint64 at = from; at < to; at += chunk)
+    {
+        if (file->read(at, qMin<quint64>(chunk, to - at), data) <= 0)
+            break;
+        result.append(data);
+    }
+    return result;
+}
+
+void TestMssfCryptoQt::protectedFileReadAhead()
+{
+    MssfStorage store(QLatin1String(TestStore), QString(), MssfStorage::private_vis, MssfStorage::Signed);
+    store.removeAllFiles();
+    QByteArray model(1024 * 1024, 0);
+    for (int i = 0; i < model.size(); i++)
+        model[i] = (char)(i * 13 + i / 4096);
+    QVERIFY(store.putFile(QByteArray("prefetched"), model));
+
+    QScopedPointer<ProtectedFile> file(store.member(QByteArray("prefetched")));
+    QVERIFY(file);
+    QVERIFY(file->open(QIODevice::ReadWrite));
+    file->setReadAhead(512 * 1024);
+
+    // long enough for the window to grow several times
+    QVERIFY(readSequentially(file.data(), 0, 400 * 1024, 16 * 1024) == model.mid(0, 400 * 1024));
+
+    // a random read drops the prefetched data
+    QByteArray data;
+    QCOMPARE(file->read(900 * 1024 + 17, 4096, data), (qint64)4096);
+    QVERIFY(data == model.mid(900 * 1024 + 17, 4096));
+
+    // a write into the range being prefetched must not be read back stale
+    QVERIFY(readSequentially(file.data(), 400 * 1024, 500 * 1024, 16 * 1024) == model.mid(400 * 1024, 100 * 1024));
+    QCOMPARE(file->write(600 * 1024 + 3, "written", 7), (qptrdiff)7);
+    model.replace(600 * 1024 + 3, 7, "written");
+    QVERIFY(readSequentially(file.data(), 500 * 1024, model.size(), 16 * 1024) == model.mid(500 * 1024));
+
+    QByteArray whole = readSequentially(file.data(), 0, model.size(), 32 * 1024);
+    QVERIFY(file->close());
+    QVERIFY(whole == model);
+    QVERIFY(store.getFile(QByteArray("prefetched")) == whole);
+
+    file.reset();
+    store.removeAllFiles();
+    store.commit();
+}
+
+void TestMssfCryptoQt::storageCacheFindInsert()
+{
+    Internal::StorageCache cache(16 * sysconf(_SC_PAGESIZE));
+    cache.insert("a", "first");
+    QByteArray data;
+    if (!cache.find("a", &data))
+        QSKIP("The cache cannot lock memory here", SkipSingle);
+    QCOMPARE(data, QByteArray("first"));
+
+    cache.insert("a", "second");
+    QVERIFY(cache.find("a", &data));
+    QCOMPARE(data, QByteArray("second"));
+
+    data = "untouched";
+    QVERIFY(!cache.find("b", &data));
+    QCOMPARE(data, QByteArray("untouched"));
+
+    cache.insert("empty", QByteArray());
+    QVERIFY(cache.find("empty", &data));
+    QVERIFY(data.isEmpty());
+
+    cache.remove("a");
+    QVERIFY(!cache.find("a", &data));
+
+    MssfStorage::CacheStatistics stats = cache.statistics();
+    QCOMPARE(stats.hits, (quint64)3);
+    QCOMPARE(stats.misses, (quint64)2);
+    QCOMPARE(stats.entries, 1);
+
+    cache.clear();
+    QCOMPARE(cache.statistics().entries, 0);
+    QCOMPARE(cache.statistics().bytes, (quint32)0);
+}
+
+void TestMssfCryptoQt::storageCacheEvictsLeastRecentlyUsed()
+{
+    // every entry takes a page of locked memory, three fit
+    Internal::StorageCache cache(3 * sysconf(_SC_PAGESIZE));
+    QByteArray data;
+    cache.insert("a", "a");
+    if (!cache.find("a", &data))
+        QSKIP("The cache cannot lock memory here", SkipSingle);
+    cache.insert("b", "b");
+    cache.insert("c", "c");
+
+    // a is used again, b is the oldest now
+    QVERIFY(cache.find("a", &data));
+    cache.insert("d", "d");
+
+    QVERIFY(!cache.find("b", &data));
+    QVERIFY(cache.find("a", &data));
+    QVERIFY(cache.find("c", &data));
+    QVERIFY(cache.find("d", &data));
+    QCOMPARE(cache.statistics().evictions, (quint64)1);
+    QCOMPARE(cache.statistics().entries, 3);
+}
+
+void TestMssfCryptoQt::storageCacheLimit()
+{
+    const quint32 page = sysconf(_SC_PAGESIZE);
+    Internal::StorageCache cache(2 * page);
+    QByteArray data;
+    cache.insert("a", "a");
+    if (!cache.find("a", &data))
+        QSKIP("The cache cannot lock memory here", SkipSingle);
+
+    // larger than the whole budget, not cached and nothing evicted for it
+    cache.insert("big", QByteArray(2 * page + 1, 'x'));
+    QVERIFY(!cache.find("big", &data));
+    QVERIFY(cache.find("a", &data));
+
+    cache.insert("b", "b");
+    cache.setLimit(page);
+    QCOMPARE(cache.limit(), page);
+    QCOMPARE(cache.statistics().entries, 1);
+    QVERIFY(cache.find("b", &data));
+    QVERIFY(!cache.find("a", &data));
+
+    cache.setLimit(0);
+    QCOMPARE(cache.statistics().entries, 0);
+}
+
+void TestMssfCryptoQt::storageQueueMemberOrder()
+{
+    QStringList log;
+    QMutex mutex;
+    QStringList expected;
+    {
+        Internal::StorageQueue queue;
+        // the later tasks are quicker, they must still wait for the earlier ones
+        for (int i = 0; i < 8; i++)
+        {
+            QString id = QString::number(i);
+            queue.submit(new RecordingTask("member", false, id, 16 - 2 * i, &log, &mutex));
+            expected << QLatin1String("start ") + id << QLatin1String("end ") + id;
+        }
+    }
+
+    QCOMPARE(log, expected);
+}
+
+void TestMssfCryptoQt::storageQueueBarrier()
+{
+    QStringList log;
+    QMutex mutex;
+    {
+        Internal::StorageQueue queue;
+        queue.submit(new RecordingTask("x", false, QLatin1String("x1"), 20, &log, &mutex));
+        queue.submit(new RecordingTask("y", false, QLatin1String("y1"), 10, &log, &mutex));
+        queue.submit(new RecordingTask(QByteArray(), true, QLatin1String("barrier"), 10, &log, &mutex));
+        queue.submit(new RecordingTask("x", false, QLatin1String("x2"), 0, &log, &mutex));
+        queue.submit(new RecordingTask("y", false, QLatin1String("y2"), 0, &log, &mutex));
+    }
+
+    QCOMPARE(log.count(), 10);
+    int start = log.indexOf(QLatin1String("start barrier"));
+    int end = log.indexOf(QLatin1String("end barrier"));
+    QCOMPARE(end, start + 1);
+    QVERIFY(log.indexOf(QLatin1String("end x1")) < start);
+    QVERIFY(log.indexOf(QLatin1String("end y1")) < start);
+    QVERIFY(log.indexOf(QLatin1String("start x2")) > end);
+    QVERIFY(log.indexOf(QLatin1String("start y2")) > end);
+}
+
+void TestMssfCryptoQt::maskMatcher_data()
+{
+    QTest::addColumn<QString>("mask");
+    QTest::addColumn<QString>("name");
+    QTest::addColumn<bool>("matches");
+
+    QTest::newRow("empty") << QString() << QString::fromLatin1("a/b") << true;
+    QTest::newRow("star") << QString::fromLatin1("*") << QString::fromLatin1("a/b") << true;
+    QTest::newRow("exact") << QString::fromLatin1("a/b") << QString::fromLatin1("a/b") << true;
+    QTest::newRow("exact other") << QString::fromLatin1("a/b") << QString::fromLatin1("a/bc") << false;
+    QTest::newRow("prefix") << QString::fromLatin1("a/*") << QString::fromLatin1("a/b/c") << true;
+    QTest::newRow("prefix itself") << QString::fromLatin1("a/*") << QString::fromLatin1("a/") << true;
+    QTest::newRow("prefix other") << QString::fromLatin1("a/*") << QString::fromLatin1("b/a") << false;
+    QTest::newRow("question") << QString::fromLatin1("a?c") << QString::fromLatin1("abc") << true;
+    QTest::newRow("question short") << QString::fromLatin1("a?c") << QString::fromLatin1("ac") << false;
+    QTest::newRow("inner star") << QString::fromLatin1("a*c") << QString::fromLatin1("abbc") << true;
+    QTest::newRow("inner star suffix") << QString::fromLatin1("a*c") << QString::fromLatin1("abcd") << false;
+    QTest::newRow("set") << QString::fromLatin1("log.[0-9]") << QString::fromLatin1("log.7") << true;
+    QTest::newRow("set other") << QString::fromLatin1("log.[0-9]") << QString::fromLatin1("log.x") << false;
+    QTest::newRow("two stars") << QString::fromLatin1("a**") << QString::fromLatin1("abc") << true;
+    QTest::newRow("case") << QString::fromLatin1("A*") << QString::fromLatin1("abc") << false;
+}
+
+void TestMssfCryptoQt::maskMatcher()
+{
+    QFETCH(QString, mask);
+    QFETCH(QString, name);
+    QFETCH(bool, matches);
+
+    QCOMPARE(Internal::MaskMatcher(mask).matches(name), matches);
+}
+
+void TestMssfCryptoQt::digestIndexInsertRemove()
+{
+    Internal::DigestIndex index;
+    index.insert("a", "digest 1");
+    QCOMPARE(index.member("digest 1"), QByteArray("a"));
+    QCOMPARE(index.digest("a"), QByteArray("digest 1"));
+
+    // new contents, the old ones are no longer held by a
+    index.insert("a", "digest 2");
+    QVERIFY(index.member("digest 1").isEmpty());
+    QCOMPARE(index.member("digest 2"), QByteArray("a"));
+
+    QCOMPARE(index.remove("a"), QByteArray("digest 2"));
+    QVERIFY(index.member("digest 2").isEmpty());
+    QVERIFY(index.digest("a").isEmpty());
+    QVERIFY(index.remove("a").isEmpty());
+
+    index.insert("b", "digest 3");
+    index.clear();
+    QVERIFY(index.member("digest 3").isEmpty());
+    QVERIFY(index.digest("b").isEmpty());
+}
+
+void TestMssfCryptoQt::digestIndexDuplicates()
+{
+    Internal::DigestIndex index;
+    index.insert("a", "same");
+    index.insert("b", "same");
+    QCOMPARE(index.member("same"), QByteArray("b"));
+
+    // a no longer holds the contents new copies link to, removing it keeps b
+    QCOMPARE(index.remove("a"), QByteArray("same"));
+    QCOMPARE(index.member("same"), QByteArray("b"));
+
+    QCOMPARE(index.remove("b"), QByteArray("same"));
+    QVERIFY(index.member("same").isEmpty());
+}
+
+void TestMssfCryptoQt::digestIndexRename()
+{
+    Internal::DigestIndex index;
+    index.insert("a", "digest 1");
+    index.insert("c", "digest 2");
+
+    index.rename("a", "b");
+    QVERIFY(index.digest("a").isEmpty());
+    QCOMPARE(index.digest("b"), QByteArray("digest 1"));
+    QCOMPARE(index.member("digest 1"), QByteArray("b"));
+
+    // renaming over c replaces its contents
+    index.rename("b", "c");
+    QCOMPARE(index.digest("c"), QByteArray("digest 1"));
+    QCOMPARE(index.member("digest 1"), QByteArray("c"));
+    QVERIFY(index.member("digest 2").isEmpty());
+
+    // a member that is not the holder does not take the digest over
+    index.insert("d", "digest 1");
+    index.rename("c", "e");
+    QCOMPARE(index.member("digest 1"), QByteArray("d"));
+    QCOMPARE(index.digest("e"), QByteArray("digest 1"));
+
+    // unknown members move nothing
+    index.rename("x", "y");
+    QVERIFY(index.digest("y").isEmpty());
+}
+
+void TestMssfCryptoQt::keyValueRecordRoundTrip()
+{
+    QByteArray data;
+    Internal::KeyValueRecord::append(data, "key", "value", 0);
+    Internal::KeyValueRecord::append(data, "gone", QByteArray(), Internal::KeyValueRecord::Tombstone);
+    Internal::KeyValueRecord::append(data, QByteArray(), QByteArray(1000, 'v'), 0);
+
+    quint32 keyLength, valueLength;
+    quint8 flags;
+    quint32 at = 0;
+
+    quint32 size = Internal::KeyValueRecord::decode(data, at, &keyLength, &valueLength, &flags);
+    QCOMPARE(size, (quint32)(Internal::KeyValueRecord::HeaderSize + 3 + 5));
+    QCOMPARE(keyLength, (quint32)3);
+    QCOMPARE(valueLength, (quint32)5);
+    QCOMPARE(flags, (quint8)0);
+    QCOMPARE(data.mid(at + Internal::KeyValueRecord::HeaderSize, keyLength), QByteArray("key"));
+    QCOMPARE(data.mid(at + Internal::KeyValueRecord::HeaderSize + keyLength, valueLength), QByteArray("value"));
+    at += size;
+
+    size = Internal::KeyValueRecord::decode(data, at, &keyLength, &valueLength, &flags);
+    QCOMPARE(size, (quint32)(Internal::KeyValueRecord::HeaderSize + 4));
+    QCOMPARE(valueLength, (quint32)0);
+    QCOMPARE(flags, (quint8)Internal::KeyValueRecord::Tombstone);
+    QCOMPARE(data.mid(at + Internal::KeyValueRecord::HeaderSize, keyLength), QByteArray("gone"));
+    at += size;
+
+    size = Internal::KeyValueRecord::decode(data, at, &keyLength, &valueLength, &flags);
+    QCOMPARE(size, (quint32)(Internal::KeyValueRecord::HeaderSize + 1000));
+    QCOMPARE(keyLength, (quint32)0);
+    QCOMPARE(data.mid(at + Internal::KeyValueRecord::HeaderSize, valueLength), QByteArray(1000, 'v'));
+    at += size;
+
+    QCOMPARE(at, (quint32)data.size());
+    QCOMPARE(Internal::KeyValueRecord::decode(data, at, &keyLength, &valueLength, &flags), (quint32)0);
+}
+
+void TestMssfCryptoQt::keyValueRecordIncomplete()
+{
+    QByteArray record;
+    Internal::KeyValueRecord::append(record, "key", "value", 0);
+
+    quint32 keyLength, valueLength;
+    quint8 flags;
+
+    // a torn write leaves a prefix of the record behind
+    for (int length = 0; length < record.size(); length++)
+        QCOMPARE(Internal::KeyValueRecord::decode(record.left(length), 0, &keyLength, &valueLength, &flags), (quint32)0);
+
+    // lengths near the limit of quint32 must not wrap around
+    QByteArray huge(Internal::KeyValueRecord::HeaderSize, '\xff');
+    huge.append(QByteArray(64, 'x'));
+    QCOMPARE(Internal::KeyValueRecord::decode(huge, 0, &keyLength, &valueLength, &flags), (quint32)0);
+
+    // an offset past the end is not a record either
+    QCOMPARE(Internal::KeyValueRecord::decode(record, 0xfffffff0, &keyLength, &valueLength, &flags), (quint32)0);
+}
+
+//! A block of the given records, chained to previous.
+static QByteArray logBlock(const QList<QByteArray> &records, const QByteArray &previous)
+{
+    QByteArray body;
+    foreach(const QByteArray &record, records)
+        Internal::LogBlock::appendRecord(body, record);
+    return Internal::LogBlock::encode(body, records.count(), previous);
+}
+
+void TestMssfCryptoQt::logBlockChain()
+{
+    const QByteArray start(Internal::LogBlock::DigestSize, 0);
+    QList<QByteArray> first;
+    first << "one" << QByteArray() << QByteArray(300, 'x');
+    QList<QByteArray> second;
+    second << "two";
+
+    QByteArray block1 = logBlock(first, start);
+    QByteArray block2 = logBlock(second, Internal::LogBlock::digest(block1));
+
+    quint32 count = 0;
+    QCOMPARE(Internal::LogBlock::size(block1.left(Internal::LogBlock::HeaderSize), &count), (quint32)block1.size());
+    QCOMPARE(count, (quint32)3);
+    QCOMPARE(Internal::LogBlock::digest(block1).size(), (int)Internal::LogBlock::DigestSize);
+
+    QVERIFY(Internal::LogBlock::verify(block1, start));
+    QVERIFY(Internal::LogBlock::verify(block2, Internal::LogBlock::digest(block1)));
+
+    QList<QByteArray> records;
+    QVERIFY(Internal::LogBlock::records(block1, count, &records));
+    QCOMPARE(records, first);
+
+    // the same records chained differently give a different block
+    QVERIFY(logBlock(second, start) != block2);
+}
+
+void TestMssfCryptoQt::logBlockDamage()
+{
+    const QByteArray start(Internal::LogBlock::DigestSize, 0);
+    QByteArray block1 = logBlock(QList<QByteArray>() << "one" << "two", start);
+    QByteArray block2 = logBlock(QList<QByteArray>() << "three", Internal::LogBlock::digest(block1));
+
+    // a changed byte anywhere, header, body or digest
+    for (int i = 0; i < block1.size(); i++)
+    {
+        QByteArray damaged = block1;
+        damaged[i] = (char)(damaged.at(i) ^ 0x01);
+        QVERIFY(!Internal::LogBlock::verify(damaged, start));
+    }
+
+    // a block that is missing or out of order
+    QVERIFY(!Internal::LogBlock::verify(block2, start));
+    QVERIFY(!Internal::LogBlock::verify(block1, Internal::LogBlock::digest(block2)));
+
+    // a torn block
+    QVERIFY(!Internal::LogBlock::verify(block1.left(block1.size() - 1), start));
+    QVERIFY(!Internal::LogBlock::verify(block1.left(Internal::LogBlock::HeaderSize), start));
+
+    quint32 count = 0;
+    QCOMPARE(Internal::LogBlock::size(block1.left(Internal::LogBlock::HeaderSize - 1), &count), (quint32)0);
+    QByteArray badMagic = block1;
+    badMagic[0] = 'x';
+    QCOMPARE(Internal::LogBlock::size(badMagic, &count), (quint32)0);
+
+    // more records claimed than the body holds
+    QList<QByteArray> records;
+    QVERIFY(!Internal::LogBlock::records(block1, 3, &records));
+}
+
+//! The SHA1 of a domain prefix followed by data, as the hash tree defines its nodes.
+static QByteArray prefixedHash(char prefix, const QByteArray &data)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(&prefix, 1);
+    hash.addData(data);
+    return hash.result();
+}
+
+//! Build the tree of data in one go.
+static QByteArray buildTree(const QByteArray &data, quint32 blockSize, QByteArray *root)
+{
+    Internal::HashTreeBuilder builder(blockSize);
+    builder.addData(data.constData(), data.size());
+    return builder.finish(root);
+}
+
+void TestMssfCryptoQt::hashTreeLayout()
+{
+    QCOMPARE(Internal::HashTree::levelCounts(10, 4), QVector<quint64>() << 3 << 2 << 1);
+    QCOMPARE(Internal::HashTree::levelCounts(8, 4), QVector<quint64>() << 2 << 1);
+    QCOMPARE(Internal::HashTree::levelCounts(0, 4), QVector<quint64>() << 1);
+
+    QByteArray root(Internal::HashTree::DigestSize, 'r');
+    QByteArray header = Internal::HashTree::encodeHeader(4096, 123456789012LL, root);
+    QCOMPARE(header.size(), (int)Internal::HashTree::HeaderSize);
+
+    quint32 blockSize;
+    quint64 size;
+    QByteArray decoded;
+    QVERIFY(Internal::HashTree::decodeHeader(header, &blockSize, &size, &decoded));
+    QCOMPARE(blockSize, (quint32)4096);
+    QCOMPARE(size, (quint64)123456789012LL);
+    QCOMPARE(decoded, root);
+
+    QVERIFY(!Internal::HashTree::decodeHeader(header.left(header.size() - 1), &blockSize, &size, &decoded));
+    QByteArray badMagic = header;
+    badMagic[0] = 'x';
+    QVERIFY(!Internal::HashTree::decodeHeader(badMagic, &blockSize, &size, &decoded));
+    QVERIFY(!Internal::HashTree::decodeHeader(Internal::HashTree::encodeHeader(0, 1, root), &blockSize, &size,
+                                              &decoded));
+}
+
+void TestMssfCryptoQt::hashTreeBuilder()
+{
+    const QByteArray data("abcdefghij");
+    QByteArray l0 = prefixedHash(0x00, "abcd");
+    QByteArray l1 = prefixedHash(0x00, "efgh");
+    QByteArray l2 = prefixedHash(0x00, "ij");
+    QByteArray n0 = prefixedHash(0x01, l0 + l1);
+    // a node without a right child hashes its left child only
+    QByteArray n1 = prefixedHash(0x01, l2);
+    QByteArray expectedRoot = prefixedHash(0x01, n0 + n1);
+
+    QCOMPARE(Internal::HashTree::leafHash("abcd", 4), l0);
+    QCOMPARE(Internal::HashTree::nodeHash(l0, l1), n0);
+    QCOMPARE(Internal::HashTree::nodeHash(l2, QByteArray()), n1);
+
+    QByteArray root;
+    QByteArray tree = buildTree(data, 4, &root);
+    QCOMPARE(root, expectedRoot);
+    QCOMPARE(tree, l0 + l1 + l2 + n0 + n1 + expectedRoot);
+
+    // the split of the input must not matter
+    Internal::HashTreeBuilder builder(4);
+    const int splits[] = { 1, 3, 5, 1 };
+    int at = 0;
+    for (unsigned i = 0; i < sizeof(splits) / sizeof(splits[0]); i++)
+    {
+        builder.addData(data.constData() + at, splits[i]);
+        at += splits[i];
+    }
+    QCOMPARE(builder.size(), (quint64)data.size());
+    QByteArray splitRoot;
+    QCOMPARE(builder.finish(&splitRoot), tree);
+    QCOMPARE(splitRoot, expectedRoot);
+}
+
+void TestMssfCryptoQt::hashTreeBuilderEdges()
+{
+    // an empty member has a single empty block
+    QByteArray root;
+    QByteArray tree = buildTree(QByteArray(), 4, &root);
+    QCOMPARE(root, prefixedHash(0x00, QByteArray()));
+    QCOMPARE(tree, root);
+
+    // a whole number of blocks gets no empty block at the end
+    tree = buildTree("abcdefgh", 4, &root);
+    QCOMPARE(tree.size(), 3 * (int)Internal::HashTree::DigestSize);
+    QCOMPARE(root, prefixedHash(0x01, prefixedHash(0x00, "abcd") + prefixedHash(0x00, "efgh")));
+
+    // a single block is its own root
+    tree = buildTree("abc", 4, &root);
+    QCOMPARE(root, prefixedHash(0x00, "abc"));
+    QCOMPARE(tree, root);
+}
+
+//! MutableHashTree::BlockReader over a QByteArray.
+static qint64 readBlock(quint64 at, char *buf, quintptr len, void *context)
+{
+    const QByteArray *data = static_cast<const QByteArray *>(context);
+    if (at + len > (quint64)data->size())
+        return -1;
+    memcpy(buf, data->constData() + at, len);
+    return len;
+}
+
+static qint64 failBlock(quint64, char *, quintptr, void *)
+{
+    return -1;
+}
+
+//! A tree kept in memory for data.
+static Internal::MutableHashTree *mutableTree(const QByteArray &data, quint32 blockSize)
+{
+    QByteArray root;
+    QByteArray tree = buildTree(data, blockSize, &root);
+    int leaves = Internal::HashTree::levelCounts(data.size(), blockSize).first() * Internal::HashTree::DigestSize;
+    return new Internal::MutableHashTree(blockSize, data.size(), tree.left(leaves));
+}
+
+void TestMssfCryptoQt::mutableHashTreeUpdate()
+{
+    QByteArray data("abcdefghijklmnopq");
+    QScopedPointer<Internal::MutableHashTree> tree(mutableTree(data, 4));
+    QVERIFY(!tree->isDirty());
+
+    QByteArray root;
+    QCOMPARE(tree->tree(), buildTree(data, 4, &root));
+    QCOMPARE(tree->root(), root);
+    QCOMPARE(tree->leaf(1), Internal::HashTree::leafHash("efgh", 4));
+
+    // a write across the border of blocks 1 and 2
+    data.replace(6, 4, "WXYZ");
+    tree->touch(6, 4, data.size());
+    QVERIFY(tree->isDirty());
+
+    QVERIFY(!tree->update(failBlock, NULL));
+    QVERIFY(tree->update(readBlock, &data));
+    QVERIFY(!tree->isDirty());
+    QCOMPARE(tree->tree(), buildTree(data, 4, &root));
+    QCOMPARE(tree->root(), root);
+
+    // touching past the end changes nothing
+    tree->touch(data.size(), 3, data.size());
+    QVERIFY(!tree->isDirty());
+}
+
+void TestMssfCryptoQt::mutableHashTreeResize()
+{
+    QByteArray data("abcdefghij");
+    QScopedPointer<Internal::MutableHashTree> tree(mutableTree(data, 4));
+    QByteArray root;
+
+    // appending fills the old last block and adds new ones
+    data.append("klmnopqrs");
+    tree->touch(10, 9, data.size());
+    QCOMPARE(tree->size(), (quint64)data.size());
+    QVERIFY(tree->update(readBlock, &data));
+    QCOMPARE(tree->tree(), buildTree(data, 4, &root));
+    QCOMPARE(tree->root(), root);
+
+    // truncating cuts the last block short and drops the ones after it
+    data.truncate(6);
+    tree->touch(0, 0, data.size());
+    QVERIFY(tree->update(readBlock, &data));
+    QCOMPARE(tree->tree(), buildTree(data, 4, &root));
+    QCOMPARE(tree->root(), root);
+
+    // down to nothing, an empty member still has its empty block
+    data.clear();
+    tree->touch(0, 0, 0);
+    QVERIFY(tree->update(readBlock, &data));
+    QCOMPARE(tree->root(), Internal::HashTree::leafHash("", 0));
+}
+
+void TestMssfCryptoQt::mutableHashTreeLoad()
+{
+    const QByteArray data("abcdefghijklmnopq");
+    QString pathname = QDir::temp().filePath(QLatin1String("mssf-qt-test-hashtree"));
+    QByteArray root;
+    QByteArray tree = buildTree(data, 4, &root);
+    QVERIFY(Internal::HashTree::writeFiles(pathname, 4, data.size(), tree, root));
+
+    QFile rootFile(Internal::HashTree::rootName(pathname));
+    QVERIFY(rootFile.open(QIODevice::ReadOnly));
+    QByteArray header = rootFile.readAll();
+    rootFile.close();
+
+    QScopedPointer<Internal::MutableHashTree> loaded(Internal::MutableHashTree::load(header, pathname, data.size()));
+    QVERIFY(loaded);
+    QCOMPARE(loaded->blockSize(), (quint32)4);
+    QCOMPARE(loaded->root(), root);
+    QCOMPARE(loaded->tree(), tree);
+
+    // the member has changed size since the tree was written
+    loaded.reset(Internal::MutableHashTree::load(header, pathname, data.size() + 1));
+    QVERIFY(!loaded);
+
+    // a leaf that does not add up to the root
+    QFile treeFile(Internal::HashTree::treeName(pathname));
+    QVERIFY(treeFile.open(QIODevice::ReadWrite));
+    treeFile.seek(Internal::HashTree::DigestSize);
+    char byte = treeFile.read(1).at(0) ^ 0xff;
+    treeFile.seek(Internal::HashTree::DigestSize);
+    treeFile.write(&byte, 1);
+    treeFile.close();
+    loaded.reset(Internal::MutableHashTree::load(header, pathname, data.size()));
+    QVERIFY(!loaded);
+
+    QFile::remove(Internal::HashTree::treeName(pathname));
+    QFile::remove(Internal::HashTree::rootName(pathname));
+    loaded.reset(Internal::MutableHashTree::load(header, pathname, data.size()));
+    QVERIFY(!loaded);
+}
+
 QTEST_MAIN(TestMssfCryptoQt)
 #include "testmssfcryptoqt.moc"
@@ -1,9 +1,22 @@
-
 QT += testlib
+QT -= gui
+
+INCLUDEPATH += ../src/crypto ../src/global
+LIBS += -L../src/crypto -lMssfCryptoQt
 
  # install
 target.path = $$(DESTDIR)/usr/bin
 SOURCES += \
     testmssfcryptoqt.cpp
 
+# the internal classes are not exported by the library, they are built into the test instead
+SOURCES += \
+    ../src/crypto/storagecache.cpp \
+    ../src/crypto/storagequeue.cpp \
+    ../src/crypto/maskmatcher.cpp \
+    ../src/crypto/digestindex.cpp \
+    ../src/crypto/keyvaluerecord.cpp \
+    ../src/crypto/logblock.cpp \
+    ../src/crypto/hashtree.cpp
+
 INSTALLS += target